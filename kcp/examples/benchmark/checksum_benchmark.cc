@@ -0,0 +1,57 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include "common/macros.h"
+
+#include "kcp_checksum.h"
+#include "kcp_constants.h"
+#include "log_util.h"
+
+// checksum of the packet sizes seen on the wire, from a pure ack to the mtu
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <num_iterations>\n", argv[0]);
+    return 0;
+  }
+
+  const int num_iterations = atoi(argv[1]);
+  ASSERT_EXIT(num_iterations > 0);
+
+  std::vector<char> buf(kMaxPacketSize);
+  for (size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = static_cast<char>(i * 31);
+  }
+
+  printf("crc32c hardware accelerated: %s\n",
+         KCPCrc32cIsHardwareAccelerated() ? "yes" : "no");
+  printf("%-18s %6s %10s %10s\n", "type", "bytes", "ns/packet", "MB/s");
+
+  const size_t kSizes[] = {64, 128, 256, 512, 1024, kMaxPacketSize};
+  const KCPChecksumType kTypes[] = {ADLER32_CHECKSUM, CRC32C_CHECKSUM,
+                                    NO_CHECKSUM};
+  for (KCPChecksumType type : kTypes) {
+    for (size_t size : kSizes) {
+      // folded into the input, so no call is optimized away
+      uint32_t sum = 0;
+      muduo::Timestamp start = muduo::Timestamp::now();
+      for (int i = 0; i < num_iterations; ++i) {
+        buf[0] = static_cast<char>(sum);
+        sum = KCPChecksum(type, buf.data(), size);
+      }
+      double seconds = muduo::timeDifference(muduo::Timestamp::now(), start);
+
+      double ns = seconds * 1e9 / num_iterations;
+      double mbps = static_cast<double>(size) * num_iterations / seconds / 1e6;
+      printf("%-18s %6zu %10.1f %10.1f (%08x)\n",
+             KCPChecksumTypeToString(type), size, ns, mbps, sum);
+    }
+  }
+
+  return 0;
+}
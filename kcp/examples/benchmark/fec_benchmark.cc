@@ -0,0 +1,88 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include "common/macros.h"
+
+#include "kcp_constants.h"
+#include "kcp_fec.h"
+#include "kcp_packets.h"
+#include "log_util.h"
+
+// encode and rebuild cost of a group of full sized data packets, per packet
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <num_iterations>\n", argv[0]);
+    return 0;
+  }
+
+  const int num_iterations = atoi(argv[1]);
+  ASSERT_EXIT(num_iterations > 0);
+
+  const size_t kShardSize =
+      kMaxPacketSize - KCPPublicHeader::kPublicHeaderLength -
+      KCPFecHeader::kFecHeaderLength;
+  const size_t kDataLength = kShardSize - KCPFecHeader::kShardLengthSize;
+
+  std::vector<std::vector<char>> packets(
+      kFecMaxDataShards + kFecMaxParityShards,
+      std::vector<char>(KCPFecHeader::kFecHeaderLength + kShardSize));
+  for (auto& packet : packets) {
+    for (size_t i = 0; i < packet.size(); ++i) {
+      packet[i] = static_cast<char>(i * 31);
+    }
+  }
+
+  printf("galois kernel: %s\n", KCPGaloisKernelName());
+  printf("%-6s %10s %10s %10s\n", "shape", "enc ns/pkt", "dec ns/pkt",
+         "enc MB/s");
+
+  KCPFecEncoder encoder(kShardSize);
+  KCPFecDecoder decoder(kShardSize);
+  KCPFecDecoder::Shard recovered[kFecMaxDataShards];
+
+  int data_shards = encoder.data_shards();
+  int parity_shards = encoder.parity_shards();
+
+  double encode_seconds = 0;
+  double decode_seconds = 0;
+  uint64_t num_recovered = 0;
+  for (int n = 0; n < num_iterations; ++n) {
+    muduo::Timestamp start = muduo::Timestamp::now();
+    for (int j = 0; j < data_shards; ++j) {
+      encoder.AddDataShard(packets[j].data(), kDataLength);
+    }
+    int num_parity = encoder.EncodeParity();
+    for (int i = 0; i < num_parity; ++i) {
+      encoder.WriteParityPacket(i, packets[data_shards + i].data());
+    }
+    muduo::Timestamp encoded = muduo::Timestamp::now();
+
+    // the first data shards are lost, as many as there are parity shards
+    for (int index = num_parity; index < data_shards + num_parity; ++index) {
+      KCPFecHeader header;
+      header.ReadFrom(packets[index].data(), packets[index].size());
+      num_recovered += static_cast<uint64_t>(decoder.AddShard(
+          header, packets[index].data() + KCPFecHeader::kFecHeaderLength,
+          packets[index].size() - KCPFecHeader::kFecHeaderLength, recovered));
+    }
+    muduo::Timestamp decoded = muduo::Timestamp::now();
+
+    encode_seconds += muduo::timeDifference(encoded, start);
+    decode_seconds += muduo::timeDifference(decoded, encoded);
+  }
+  ASSERT_EXIT(num_recovered ==
+              static_cast<uint64_t>(num_iterations) * parity_shards);
+
+  double num_packets = static_cast<double>(num_iterations) * data_shards;
+  printf("%2d+%-3d %10.1f %10.1f %10.1f\n", data_shards, parity_shards,
+         encode_seconds * 1e9 / num_packets, decode_seconds * 1e9 / num_packets,
+         num_packets * static_cast<double>(kShardSize) / encode_seconds / 1e6);
+
+  return 0;
+}
@@ -69,7 +69,7 @@ class SessionBenchmark final {
           });
 
       session->set_output_callback(
-          [=](const void* data, size_t length, auto, const auto&) {
+          [=](const void* data, size_t length, auto, auto, const auto&) {
             SendData(i, data, length);
           });
       sessions_.emplace_back(std::move(session));
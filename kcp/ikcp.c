@@ -36,15 +36,19 @@ const IUINT32 IKCP_CMD_PUSH = 81;  // cmd: push data
 const IUINT32 IKCP_CMD_ACK = 82;   // cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83;  // cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84;  // cmd: window size (tell)
+const IUINT32 IKCP_CMD_SACK = 85;  // cmd: ack ranges
 const IUINT32 IKCP_ASK_SEND = 1;   // need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2;   // need to send IKCP_CMD_WINS
 const IUINT32 IKCP_WND_SND = 32;
 const IUINT32 IKCP_WND_RCV = 128;  // must >= max fragment size
+const IUINT32 IKCP_RING_MIN = 32;
 const IUINT32 IKCP_SND_HGHWAT = 4;
 const IUINT32 IKCP_MTU_DEF = 1400;
 const IUINT32 IKCP_ACK_FAST = 3;
 const IUINT32 IKCP_INTERVAL = 100;
 const IUINT32 IKCP_OVERHEAD = 24;
+const IUINT32 IKCP_SACK_RANGE_SIZE = 4;  // offset from una(16) + count(16)
+const IUINT32 IKCP_SACK_RANGE_MAX = 0xffff;
 const IUINT32 IKCP_DEADLINK = 20;
 const IUINT32 IKCP_THRESH_INIT = 2;
 const IUINT32 IKCP_THRESH_MIN = 2;
@@ -169,6 +173,331 @@ static IKCPSEG *ikcp_segment_new(ikcpcb *kcp, int size) {
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg) { ikcp_free(seg); }
 
+//---------------------------------------------------------------------
+// segment rings
+//---------------------------------------------------------------------
+#define IKCP_RING_AT(ring, mask, sn) ((ring)[(sn) & (mask)])
+
+// grows the ring to hold a window of 'wnd' segments, and indexes the
+// segments of 'list' again, never shrinks
+static int ikcp_ring_reserve(IKCPSEG ***ring, IUINT32 *mask, IUINT32 wnd,
+                             const struct IQUEUEHEAD *list) {
+  const struct IQUEUEHEAD *p;
+  IKCPSEG **newring;
+  IUINT32 size;
+
+  for (size = IKCP_RING_MIN; size < wnd; size <<= 1)
+    ;
+
+  if (*ring != NULL && size <= *mask + 1) return 0;
+
+  newring = (IKCPSEG **)ikcp_malloc(size * sizeof(IKCPSEG *));
+  if (newring == NULL) return -1;
+  memset(newring, 0, size * sizeof(IKCPSEG *));
+
+  for (p = list->next; p != list; p = p->next) {
+    IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+    IKCP_RING_AT(newring, size - 1, seg->sn) = seg;
+  }
+
+  if (*ring != NULL) {
+    ikcp_free(*ring);
+  }
+
+  *ring = newring;
+  *mask = size - 1;
+  return 0;
+}
+
+//---------------------------------------------------------------------
+// congestion control
+//---------------------------------------------------------------------
+const IUINT32 IKCP_PACING_BURST_MS = 2;  // budget kept at least
+const IUINT32 IKCP_GAIN_UNIT = 256;
+const IUINT32 IKCP_RENO_SS_GAIN = 512;  // pace 2x cwnd/srtt in slow start
+const IUINT32 IKCP_RENO_CA_GAIN = 307;  // 1.2x in congestion avoidance
+const IUINT32 IKCP_BBR_STARTUP = 0;
+const IUINT32 IKCP_BBR_DRAIN = 1;
+const IUINT32 IKCP_BBR_PROBE_BW = 2;
+const IUINT32 IKCP_BBR_HIGH_GAIN = 739;  // 2/ln(2)
+const IUINT32 IKCP_BBR_DRAIN_GAIN = 88;  // 1/high gain
+const IUINT32 IKCP_BBR_CWND_GAIN = 512;
+const IUINT32 IKCP_BBR_INIT_CWND = 10;
+const IUINT32 IKCP_BBR_MIN_CWND = 4;
+const IUINT32 IKCP_BBR_MIN_RTT_WIN = 10000;  // ms a min rtt sample lasts
+const IUINT32 IKCP_BBR_FULL_BW_GAIN = 320;   // bw still grows by 25%
+const IUINT32 IKCP_BBR_FULL_BW_ROUNDS = 3;
+#define IKCP_BBR_CYCLE_LEN 8
+
+static const IUINT32 ikcp_bbr_cycle_gains[IKCP_BBR_CYCLE_LEN] = {
+    320, 192, 256, 256, 256, 256, 256, 256};
+
+// bytes per second of |gain| times |cwnd| segments per |rtt| ms
+static IUINT32 ikcp_cc_rate(const ikcpcb *kcp, IUINT32 gain, IUINT32 cwnd,
+                            IUINT32 rtt) {
+  IUINT64 rate;
+  if (rtt == 0) return 0;
+  rate = (IUINT64)cwnd * kcp->mss * 1000 * gain / IKCP_GAIN_UNIT / rtt;
+  return (rate > 0xffffffff) ? 0xffffffff : (IUINT32)rate;
+}
+
+static void ikcp_reno_pace(ikcpcb *kcp) {
+  IUINT32 gain =
+      (kcp->cwnd < kcp->ssthresh) ? IKCP_RENO_SS_GAIN : IKCP_RENO_CA_GAIN;
+  kcp->pacing_rate = ikcp_cc_rate(kcp, gain, kcp->cwnd, (IUINT32)kcp->rx_srtt);
+}
+
+static void ikcp_reno_init(ikcpcb *kcp) {
+  kcp->cwnd = 1;
+  kcp->incr = kcp->mss;
+  kcp->ssthresh = IKCP_THRESH_INIT;
+  kcp->pacing_rate = 0;
+}
+
+static void ikcp_reno_on_ack(ikcpcb *kcp, IUINT32 prev_una, IUINT32 acked,
+                             IINT32 rtt) {
+  if (_itimediff(kcp->snd_una, prev_una) <= 0) return;
+  if (kcp->cwnd < kcp->rmt_wnd) {
+    IUINT32 mss = kcp->mss;
+    if (kcp->cwnd < kcp->ssthresh) {
+      kcp->cwnd++;
+      kcp->incr += mss;
+    } else {
+      if (kcp->incr < mss) kcp->incr = mss;
+      kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+      if ((kcp->cwnd + 1) * mss <= kcp->incr) {
+#if 1
+        kcp->cwnd = (kcp->incr + mss - 1) / ((mss > 0) ? mss : 1);
+#else
+        kcp->cwnd++;
+#endif
+      }
+    }
+    if (kcp->cwnd > kcp->rmt_wnd) {
+      kcp->cwnd = kcp->rmt_wnd;
+      kcp->incr = kcp->rmt_wnd * mss;
+    }
+  }
+  ikcp_reno_pace(kcp);
+}
+
+static void ikcp_reno_on_loss(ikcpcb *kcp, IUINT32 cwnd, IUINT32 resent,
+                              int fast, int timeout) {
+  if (fast) {
+    IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+    kcp->ssthresh = inflight / 2;
+    if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
+    kcp->cwnd = kcp->ssthresh + resent;
+    kcp->incr = kcp->cwnd * kcp->mss;
+  }
+
+  if (timeout) {
+    kcp->ssthresh = cwnd / 2;
+    if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
+    kcp->cwnd = 1;
+    kcp->incr = kcp->mss;
+  }
+  ikcp_reno_pace(kcp);
+}
+
+// bandwidth-delay product in segments, 0 until both are measured
+static IUINT32 ikcp_bbr_bdp(const ikcpcb *kcp) {
+  const struct IKCPBBR *bbr = &kcp->bbr;
+  if (bbr->btl_bw == 0 || bbr->min_rtt == 0xffffffff) return 0;
+  return (IUINT32)((IUINT64)bbr->btl_bw * bbr->min_rtt / 1000 / kcp->mss);
+}
+
+static void ikcp_bbr_pace(ikcpcb *kcp) {
+  const struct IKCPBBR *bbr = &kcp->bbr;
+  IUINT64 rate;
+  if (bbr->btl_bw == 0) {
+    // no round has ended yet, pace the window over srtt
+    kcp->pacing_rate = ikcp_cc_rate(kcp, bbr->pacing_gain, kcp->cwnd,
+                                    (IUINT32)kcp->rx_srtt);
+    return;
+  }
+  rate = (IUINT64)bbr->btl_bw * bbr->pacing_gain / IKCP_GAIN_UNIT;
+  kcp->pacing_rate = (rate > 0xffffffff) ? 0xffffffff : (IUINT32)rate;
+}
+
+static void ikcp_bbr_start_round(ikcpcb *kcp) {
+  struct IKCPBBR *bbr = &kcp->bbr;
+  bbr->round_inflight = _imax_(kcp->nsnd_buf, 1);
+  bbr->round_start_ts = kcp->current;
+  bbr->round_delivered = kcp->delivered;
+}
+
+static void ikcp_bbr_init(ikcpcb *kcp) {
+  struct IKCPBBR *bbr = &kcp->bbr;
+  memset(bbr, 0, sizeof(*bbr));
+  bbr->mode = IKCP_BBR_STARTUP;
+  bbr->pacing_gain = IKCP_BBR_HIGH_GAIN;
+  bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+  bbr->min_rtt = 0xffffffff;
+  bbr->min_rtt_ts = kcp->current;
+  ikcp_bbr_start_round(kcp);
+  kcp->cwnd = IKCP_BBR_INIT_CWND;
+  kcp->incr = kcp->cwnd * kcp->mss;
+  ikcp_bbr_pace(kcp);
+}
+
+// returns 1 if a round has ended and the bandwidth has been sampled
+static int ikcp_bbr_update_bw(ikcpcb *kcp) {
+  struct IKCPBBR *bbr = &kcp->bbr;
+  long interval;
+  IUINT32 i;
+  IUINT64 bw;
+
+  if (kcp->delivered - bbr->round_delivered < bbr->round_inflight) return 0;
+
+  // acks may be compressed, but a round never takes less than min_rtt
+  interval = _itimediff(kcp->current, bbr->round_start_ts);
+  if (bbr->min_rtt != 0xffffffff && interval < (long)bbr->min_rtt) {
+    interval = bbr->min_rtt;
+  }
+  if (interval < 1) interval = 1;
+  bw = (IUINT64)(kcp->delivered - bbr->round_delivered) * kcp->mss * 1000 /
+       interval;
+  bbr->bw_samples[bbr->round_count % IKCP_BBR_BW_ROUNDS] =
+      (bw > 0xffffffff) ? 0xffffffff : (IUINT32)bw;
+  bbr->round_count++;
+
+  bbr->btl_bw = 0;
+  for (i = 0; i < IKCP_BBR_BW_ROUNDS; i++) {
+    bbr->btl_bw = _imax_(bbr->btl_bw, bbr->bw_samples[i]);
+  }
+
+  ikcp_bbr_start_round(kcp);
+  return 1;
+}
+
+static void ikcp_bbr_update_mode(ikcpcb *kcp, int round_ended) {
+  struct IKCPBBR *bbr = &kcp->bbr;
+
+  if (bbr->mode == IKCP_BBR_STARTUP && round_ended) {
+    if ((IUINT64)bbr->btl_bw * IKCP_GAIN_UNIT >=
+        (IUINT64)bbr->full_bw * IKCP_BBR_FULL_BW_GAIN) {
+      bbr->full_bw = bbr->btl_bw;
+      bbr->full_bw_rounds = 0;
+    } else if (++bbr->full_bw_rounds >= IKCP_BBR_FULL_BW_ROUNDS) {
+      // the pipe is full, drain the queue built up in startup
+      bbr->mode = IKCP_BBR_DRAIN;
+      bbr->pacing_gain = IKCP_BBR_DRAIN_GAIN;
+    }
+  }
+
+  if (bbr->mode == IKCP_BBR_DRAIN &&
+      kcp->nsnd_buf <= ikcp_bbr_bdp(kcp)) {
+    bbr->mode = IKCP_BBR_PROBE_BW;
+    bbr->cwnd_gain = IKCP_BBR_CWND_GAIN;
+    // start at a random cruising phase, not at the one draining
+    bbr->cycle_index = 2 + kcp->current % (IKCP_BBR_CYCLE_LEN - 2);
+    bbr->cycle_ts = kcp->current;
+    bbr->pacing_gain = ikcp_bbr_cycle_gains[bbr->cycle_index];
+  }
+
+  if (bbr->mode == IKCP_BBR_PROBE_BW &&
+      _itimediff(kcp->current, bbr->cycle_ts) >= (long)bbr->min_rtt) {
+    bbr->cycle_index = (bbr->cycle_index + 1) % IKCP_BBR_CYCLE_LEN;
+    bbr->cycle_ts = kcp->current;
+    bbr->pacing_gain = ikcp_bbr_cycle_gains[bbr->cycle_index];
+  }
+}
+
+static void ikcp_bbr_on_ack(ikcpcb *kcp, IUINT32 prev_una, IUINT32 acked,
+                            IINT32 rtt) {
+  struct IKCPBBR *bbr = &kcp->bbr;
+  IUINT32 target;
+
+  if (rtt >= 0) {
+    IUINT32 sample = _imax_((IUINT32)rtt, 1);
+    long age = _itimediff(kcp->current, bbr->min_rtt_ts);
+    if (sample <= bbr->min_rtt || age > (long)IKCP_BBR_MIN_RTT_WIN) {
+      bbr->min_rtt = sample;
+      bbr->min_rtt_ts = kcp->current;
+    }
+  }
+
+  ikcp_bbr_update_mode(kcp, ikcp_bbr_update_bw(kcp));
+
+  // a few more segments than the bdp to ride out delayed and batched acks
+  target = ikcp_bbr_bdp(kcp);
+  if (target > 0) {
+    target = (IUINT32)((IUINT64)target * bbr->cwnd_gain / IKCP_GAIN_UNIT) +
+             IKCP_THRESH_MIN;
+  }
+  if (bbr->mode != IKCP_BBR_STARTUP) {
+    kcp->cwnd = _imin_(kcp->cwnd + acked, target);
+  } else if (target == 0 || kcp->cwnd < target) {
+    kcp->cwnd += acked;
+  }
+  kcp->cwnd = _ibound_(IKCP_BBR_MIN_CWND, kcp->cwnd,
+                       _imax_(kcp->snd_wnd, IKCP_BBR_MIN_CWND));
+  kcp->incr = kcp->cwnd * kcp->mss;
+
+  ikcp_bbr_pace(kcp);
+}
+
+// loss is not taken as congestion, a timeout only trims the window down to
+// the estimated bdp without the gain
+static void ikcp_bbr_on_loss(ikcpcb *kcp, IUINT32 cwnd, IUINT32 resent,
+                             int fast, int timeout) {
+  if (timeout) {
+    kcp->cwnd = _ibound_(IKCP_BBR_MIN_CWND, ikcp_bbr_bdp(kcp), kcp->cwnd);
+    kcp->incr = kcp->cwnd * kcp->mss;
+  }
+}
+
+// the idle time must not be taken for a slow round
+static void ikcp_bbr_on_restart(ikcpcb *kcp) { ikcp_bbr_start_round(kcp); }
+
+static const struct IKCPCC ikcp_cc_none = {
+    "none", ikcp_reno_init, ikcp_reno_on_ack, ikcp_reno_on_loss, NULL, 0};
+
+static const struct IKCPCC ikcp_cc_reno = {
+    "reno", ikcp_reno_init, ikcp_reno_on_ack, ikcp_reno_on_loss, NULL, 0};
+
+static const struct IKCPCC ikcp_cc_reno_paced = {"reno_paced",
+                                                 ikcp_reno_init,
+                                                 ikcp_reno_on_ack,
+                                                 ikcp_reno_on_loss,
+                                                 NULL,
+                                                 1};
+
+static const struct IKCPCC ikcp_cc_bbr = {"bbr",
+                                          ikcp_bbr_init,
+                                          ikcp_bbr_on_ack,
+                                          ikcp_bbr_on_loss,
+                                          ikcp_bbr_on_restart,
+                                          1};
+
+// refills the budget by the time elapsed since the last flush, a caller
+// flushing at interval instead of when ikcp_flush asks gets bursts of that
+// long, but an idle one never more
+static void ikcp_pacing_refill(ikcpcb *kcp, IUINT32 current) {
+  long elapsed = _itimediff(current, kcp->ts_pacing);
+  IUINT32 burst_ms = IKCP_PACING_BURST_MS;
+  IINT64 budget = kcp->pacing_budget;
+  IINT64 burst;
+
+  if (elapsed > 0) {
+    budget += (IINT64)kcp->pacing_rate * elapsed / 1000;
+    burst_ms = _imax_(burst_ms, _imin_((IUINT32)elapsed, kcp->interval));
+  }
+  burst = (IINT64)kcp->pacing_rate * burst_ms / 1000;
+  if (burst < (IINT64)kcp->mtu * 2) burst = (IINT64)kcp->mtu * 2;
+  kcp->pacing_budget = (IINT32)((budget > burst) ? burst : budget);
+  kcp->ts_pacing = current;
+}
+
+// ms until the budget turns positive again
+static IUINT32 ikcp_pacing_delay(const ikcpcb *kcp) {
+  IUINT64 deficit = (IUINT64)(1 - (IINT64)kcp->pacing_budget);
+  IUINT64 delay = (deficit * 1000 + kcp->pacing_rate - 1) / kcp->pacing_rate;
+  if (delay > 0xffffffff) return 0xffffffff;
+  return (delay > 0) ? (IUINT32)delay : 1;
+}
+
 // write log
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...) {
   char buffer[1024];
@@ -197,6 +526,30 @@ static int ikcp_output(ikcpcb *kcp, void *data, int size) {
   return kcp->output((char *)data, size, kcp, kcp->user);
 }
 
+// a packet is built in the buffer of output_buffer if it has one, so that
+// output gets it where it is to be sent from
+static char *ikcp_packet_begin(ikcpcb *kcp) {
+  char *buffer = NULL;
+  if (kcp->output_buffer) {
+    buffer = kcp->output_buffer(kcp, kcp->user);
+  }
+  kcp->packet = buffer ? buffer : kcp->buffer;
+  return kcp->packet + kcp->head_room;
+}
+
+// output the packet built up to |ptr| and begin the next one
+static char *ikcp_packet_next(ikcpcb *kcp, char *ptr) {
+  ikcp_output(kcp, kcp->packet, (int)(ptr - kcp->packet));
+  return ikcp_packet_begin(kcp);
+}
+
+static void ikcp_packet_end(ikcpcb *kcp, char *ptr) {
+  int size = (int)(ptr - kcp->packet);
+  if (size > (int)kcp->head_room) {
+    ikcp_output(kcp, kcp->packet, size);
+  }
+}
+
 // output queue
 void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head) {
 #if 0
@@ -237,6 +590,8 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user) {
   kcp->cwnd = 1;
   kcp->incr = kcp->mss;
   kcp->stream = 0;
+  kcp->sack = 0;
+  kcp->unordered = 0;
 
   // kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
   kcp->buffer = (char *)ikcp_malloc(kcp->mtu);
@@ -249,6 +604,19 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user) {
   iqueue_init(&kcp->rcv_queue);
   iqueue_init(&kcp->snd_buf);
   iqueue_init(&kcp->rcv_buf);
+  kcp->snd_ring = NULL;
+  kcp->rcv_ring = NULL;
+  kcp->snd_ring_mask = 0;
+  kcp->rcv_ring_mask = 0;
+  if (ikcp_ring_reserve(&kcp->snd_ring, &kcp->snd_ring_mask, kcp->snd_wnd,
+                        &kcp->snd_buf) != 0 ||
+      ikcp_ring_reserve(&kcp->rcv_ring, &kcp->rcv_ring_mask, kcp->rcv_wnd,
+                        &kcp->rcv_buf) != 0) {
+    if (kcp->snd_ring) ikcp_free(kcp->snd_ring);
+    ikcp_free(kcp->buffer);
+    ikcp_free(kcp);
+    return NULL;
+  }
   kcp->nrcv_buf = 0;
   kcp->nsnd_buf = 0;
   kcp->nrcv_que = 0;
@@ -257,6 +625,7 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user) {
   kcp->acklist = NULL;
   kcp->ackblock = 0;
   kcp->ackcount = 0;
+  kcp->ackurgent = 0;
   kcp->rx_srtt = 0;
   kcp->rx_rttval = 0;
   kcp->rx_rto = IKCP_RTO_DEF;
@@ -271,9 +640,18 @@ ikcpcb *ikcp_create(IUINT32 conv, void *user) {
   kcp->fastresend = 0;
   kcp->fastlimit = IKCP_FASTACK_LIMIT;
   kcp->nocwnd = 0;
+  kcp->cc = &ikcp_cc_reno;
+  kcp->delivered = 0;
+  kcp->retransmits = 0;
+  kcp->pacing_rate = 0;
+  kcp->ts_pacing = 0;
+  kcp->pacing_budget = (IINT32)kcp->mtu * 2;
+  memset(&kcp->bbr, 0, sizeof(kcp->bbr));
   kcp->xmit = 0;
   kcp->dead_link = IKCP_DEADLINK;
   kcp->output = NULL;
+  kcp->output_buffer = NULL;
+  kcp->packet = NULL;
   kcp->writelog = NULL;
 
   return kcp;
@@ -312,6 +690,12 @@ void ikcp_release(ikcpcb *kcp) {
     if (kcp->acklist) {
       ikcp_free(kcp->acklist);
     }
+    if (kcp->snd_ring) {
+      ikcp_free(kcp->snd_ring);
+    }
+    if (kcp->rcv_ring) {
+      ikcp_free(kcp->rcv_ring);
+    }
 
     kcp->nrcv_buf = 0;
     kcp->nsnd_buf = 0;
@@ -320,6 +704,8 @@ void ikcp_release(ikcpcb *kcp) {
     kcp->ackcount = 0;
     kcp->buffer = NULL;
     kcp->acklist = NULL;
+    kcp->snd_ring = NULL;
+    kcp->rcv_ring = NULL;
     ikcp_free(kcp);
   }
 }
@@ -332,6 +718,45 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(char *buf, int len, ikcpcb *kcp,
   kcp->output = output;
 }
 
+void ikcp_setoutputbuffer(ikcpcb *kcp,
+                          char *(*output_buffer)(ikcpcb *kcp, void *user)) {
+  kcp->output_buffer = output_buffer;
+}
+
+//---------------------------------------------------------------------
+// rcv_ring slot of a segment already in rcv_queue in unordered mode, which
+// rcv_nxt only moves over
+//---------------------------------------------------------------------
+static IKCPSEG ikcp_seg_delivered;
+
+#define IKCP_SEG_DELIVERED (&ikcp_seg_delivered)
+
+//---------------------------------------------------------------------
+// move in order segments from rcv_buf to rcv_queue
+//---------------------------------------------------------------------
+static void ikcp_move_rcv_buf(ikcpcb *kcp) {
+  if (kcp->unordered) {
+    while (IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, kcp->rcv_nxt) ==
+           IKCP_SEG_DELIVERED) {
+      IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, kcp->rcv_nxt) = NULL;
+      kcp->rcv_nxt++;
+    }
+    return;
+  }
+
+  while (kcp->nrcv_que < kcp->rcv_wnd) {
+    IKCPSEG *seg =
+        IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, kcp->rcv_nxt);
+    if (seg == NULL || seg->sn != kcp->rcv_nxt) break;
+    IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, kcp->rcv_nxt) = NULL;
+    iqueue_del(&seg->node);
+    kcp->nrcv_buf--;
+    iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+    kcp->nrcv_que++;
+    kcp->rcv_nxt++;
+  }
+}
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -385,18 +810,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len) {
   assert(len == peeksize);
 
   // move available data from rcv_buf -> rcv_queue
-  while (!iqueue_is_empty(&kcp->rcv_buf)) {
-    seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-    if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-      iqueue_del(&seg->node);
-      kcp->nrcv_buf--;
-      iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-      kcp->nrcv_que++;
-      kcp->rcv_nxt++;
-    } else {
-      break;
-    }
-  }
+  ikcp_move_rcv_buf(kcp);
 
   // fast recover
   if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -434,6 +848,28 @@ int ikcp_peeksize(const ikcpcb *kcp) {
   return length;
 }
 
+int ikcp_peekv(const ikcpcb *kcp, struct iovec *iov, int iovcnt) {
+  struct IQUEUEHEAD *p;
+  IKCPSEG *seg;
+  int count = 0;
+
+  assert(kcp);
+
+  if (ikcp_peeksize(kcp) < 0) return -1;
+
+  for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+    seg = iqueue_entry(p, IKCPSEG, node);
+    if (count < iovcnt) {
+      iov[count].iov_base = seg->data;
+      iov[count].iov_len = seg->len;
+    }
+    count++;
+    if (seg->frg == 0) break;
+  }
+
+  return count;
+}
+
 //---------------------------------------------------------------------
 // user/upper level send, returns below zero for error
 //---------------------------------------------------------------------
@@ -442,11 +878,65 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len) {
 }
 
 int ikcp_write(ikcpcb *kcp, const char *buffer, int len, int always_stream) {
+  struct iovec iov;
+  iov.iov_base = (void *)buffer;
+  iov.iov_len = len < 0 ? 0 : (size_t)len;
+  return ikcp_writev(kcp, buffer ? &iov : NULL, buffer ? 1 : 0, 0, len,
+                     always_stream);
+}
+
+// reads the bytes of an iovec in order, NULL iov leaves the segments unfilled
+typedef struct {
+  const struct iovec *iov;
+  int iovcnt;
+  size_t offset;
+} ikcp_iov_reader;
+
+static void ikcp_iov_skip(ikcp_iov_reader *reader, size_t size) {
+  while (reader->iovcnt > 0 && size > 0) {
+    size_t n = reader->iov->iov_len - reader->offset;
+    if (n > size) {
+      reader->offset += size;
+      return;
+    }
+    size -= n;
+    reader->iov++;
+    reader->iovcnt--;
+    reader->offset = 0;
+  }
+}
+
+static void ikcp_iov_read(ikcp_iov_reader *reader, char *data, size_t size) {
+  while (reader->iovcnt > 0 && size > 0) {
+    size_t n = reader->iov->iov_len - reader->offset;
+    if (n > size) n = size;
+    memcpy(data, (const char *)reader->iov->iov_base + reader->offset, n);
+    data += n;
+    size -= n;
+    reader->offset += n;
+    if (reader->offset == reader->iov->iov_len) {
+      reader->iov++;
+      reader->iovcnt--;
+      reader->offset = 0;
+    }
+  }
+}
+
+int ikcp_writev(ikcpcb *kcp, const struct iovec *iov, int iovcnt, int offset,
+                int len, int always_stream) {
   IKCPSEG *seg;
   int count, i;
+  ikcp_iov_reader reader;
 
   assert(kcp->mss > 0);
-  if (len < 0) return -1;
+  if (len < 0 || offset < 0) return -1;
+  // the fragments of a message would be handed over in any order
+  if (kcp->unordered && len > (int)kcp->mss) return -1;
+
+  reader.iov = iov;
+  reader.iovcnt = iov ? iovcnt : 0;
+  reader.offset = 0;
+  ikcp_iov_skip(&reader, (size_t)offset);
 
   int stream_mode = (kcp->stream != 0 || always_stream != 0) ? 1 : 0;
   // append to previous segment in streaming mode (if possible)
@@ -463,12 +953,10 @@ int ikcp_write(ikcpcb *kcp, const char *buffer, int len, int always_stream) {
         }
         iqueue_add_tail(&seg->node, &kcp->snd_queue);
         memcpy(seg->data, old->data, old->len);
-        if (buffer) {
-          memcpy(seg->data + old->len, buffer, extend);
-          buffer += extend;
-        }
+        ikcp_iov_read(&reader, seg->data + old->len, (size_t)extend);
         seg->len = old->len + extend;
         seg->frg = 0;
+        seg->expire = 0;
         len -= extend;
         iqueue_del_init(&old->node);
         ikcp_segment_delete(kcp, old);
@@ -496,23 +984,57 @@ int ikcp_write(ikcpcb *kcp, const char *buffer, int len, int always_stream) {
     if (seg == NULL) {
       return -2;
     }
-    if (buffer && len > 0) {
-      memcpy(seg->data, buffer, size);
+    if (len > 0) {
+      ikcp_iov_read(&reader, seg->data, (size_t)size);
     }
     seg->len = size;
     seg->frg = (stream_mode == 0) ? (count - i - 1) : 0;
+    seg->expire = 0;
     iqueue_init(&seg->node);
     iqueue_add_tail(&seg->node, &kcp->snd_queue);
     kcp->nsnd_que++;
-    if (buffer) {
-      buffer += size;
-    }
     len -= size;
   }
 
   return 0;
 }
 
+int ikcp_expire_last(ikcpcb *kcp, IUINT32 expire) {
+  struct IQUEUEHEAD *p;
+  IKCPSEG *seg;
+
+  if (kcp->stream != 0 || iqueue_is_empty(&kcp->snd_queue)) return -1;
+
+  // back to the first fragment, whose frg is the number of those after it
+  p = kcp->snd_queue.prev;
+  seg = iqueue_entry(p, IKCPSEG, node);
+  if (seg->frg != 0) return -1;
+  while (p->prev != &kcp->snd_queue) {
+    IKCPSEG *prev = iqueue_entry(p->prev, IKCPSEG, node);
+    if (prev->frg != seg->frg + 1) break;
+    p = p->prev;
+    seg = prev;
+  }
+
+  // 0 is never
+  seg->expire = (expire != 0) ? expire : 1;
+  return 0;
+}
+
+//---------------------------------------------------------------------
+// drop the message at the head of snd_queue, all of its fragments
+//---------------------------------------------------------------------
+static void ikcp_drop_snd_queue_head(ikcpcb *kcp) {
+  while (!iqueue_is_empty(&kcp->snd_queue)) {
+    IKCPSEG *seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+    IUINT32 frg = seg->frg;
+    iqueue_del(&seg->node);
+    ikcp_segment_delete(kcp, seg);
+    kcp->nsnd_que--;
+    if (frg == 0) break;
+  }
+}
+
 int ikcp_append(ikcpcb *kcp, const char *buffer, int len) {
   // IUINT32 wait_snd = ikcp_waitsnd(kcp);
   // IUINT32 snd_wnd = kcp->snd_wnd;
@@ -552,23 +1074,18 @@ static void ikcp_shrink_buf(ikcpcb *kcp) {
 }
 
 static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn) {
-  struct IQUEUEHEAD *p, *next;
+  IKCPSEG *seg;
 
   if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
     return;
 
-  for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-    IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-    next = p->next;
-    if (sn == seg->sn) {
-      iqueue_del(p);
-      ikcp_segment_delete(kcp, seg);
-      kcp->nsnd_buf--;
-      break;
-    }
-    if (_itimediff(sn, seg->sn) < 0) {
-      break;
-    }
+  seg = IKCP_RING_AT(kcp->snd_ring, kcp->snd_ring_mask, sn);
+  if (seg != NULL && seg->sn == sn) {
+    IKCP_RING_AT(kcp->snd_ring, kcp->snd_ring_mask, sn) = NULL;
+    iqueue_del(&seg->node);
+    ikcp_segment_delete(kcp, seg);
+    kcp->nsnd_buf--;
+    kcp->delivered++;
   }
 }
 
@@ -578,15 +1095,26 @@ static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una) {
     IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
     next = p->next;
     if (_itimediff(una, seg->sn) > 0) {
+      IKCP_RING_AT(kcp->snd_ring, kcp->snd_ring_mask, seg->sn) = NULL;
       iqueue_del(p);
       ikcp_segment_delete(kcp, seg);
       kcp->nsnd_buf--;
+      kcp->delivered++;
     } else {
       break;
     }
   }
 }
 
+// an ack of a segment sent more than once is no rtt sample of the path
+static int ikcp_sent_once(const ikcpcb *kcp, IUINT32 sn) {
+  const IKCPSEG *seg;
+  if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
+    return 0;
+  seg = IKCP_RING_AT(kcp->snd_ring, kcp->snd_ring_mask, sn);
+  return seg != NULL && seg->sn == sn && seg->xmit == 1;
+}
+
 static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts) {
   struct IQUEUEHEAD *p, *next;
 
@@ -608,6 +1136,30 @@ static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts) {
   }
 }
 
+// ranges of acked sn, [una + offset, una + offset + count)
+static void ikcp_parse_sack(ikcpcb *kcp, IUINT32 una, const char *ranges,
+                            IUINT32 len) {
+  IUINT32 i;
+
+  for (i = 0; i + IKCP_SACK_RANGE_SIZE <= len; i += IKCP_SACK_RANGE_SIZE) {
+    IUINT16 offset, count;
+    IUINT32 sn, end;
+
+    ranges = ikcp_decode16u(ranges, &offset);
+    ranges = ikcp_decode16u(ranges, &count);
+
+    // only the part still in flight
+    sn = una + offset;
+    end = sn + count;
+    if (_itimediff(sn, kcp->snd_una) < 0) sn = kcp->snd_una;
+    if (_itimediff(end, kcp->snd_nxt) > 0) end = kcp->snd_nxt;
+
+    for (; _itimediff(sn, end) < 0; sn++) {
+      ikcp_parse_ack(kcp, sn);
+    }
+  }
+}
+
 //---------------------------------------------------------------------
 // ack append
 //---------------------------------------------------------------------
@@ -656,9 +1208,7 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts) {
 // parse data
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg) {
-  struct IQUEUEHEAD *p, *prev;
   IUINT32 sn = newseg->sn;
-  int repeat = 0;
 
   if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
       _itimediff(sn, kcp->rcv_nxt) < 0) {
@@ -666,24 +1216,25 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg) {
     return;
   }
 
-  for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-    IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-    prev = p->prev;
-    if (seg->sn == sn) {
-      repeat = 1;
-      break;
-    }
-    if (_itimediff(sn, seg->sn) > 0) {
-      break;
+  // the ring is never smaller than the window, a used slot is a repeat
+  if (IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, sn) != NULL) {
+    ikcp_segment_delete(kcp, newseg);
+  } else if (kcp->unordered) {
+    IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, sn) = IKCP_SEG_DELIVERED;
+    if (newseg->frg != 0) {
+      // a fragment could only be stitched to those of other messages, it is
+      // dropped but still passed over by rcv_nxt
+      ikcp_segment_delete(kcp, newseg);
+    } else {
+      iqueue_init(&newseg->node);
+      iqueue_add_tail(&newseg->node, &kcp->rcv_queue);
+      kcp->nrcv_que++;
     }
-  }
-
-  if (repeat == 0) {
+  } else {
+    IKCP_RING_AT(kcp->rcv_ring, kcp->rcv_ring_mask, sn) = newseg;
     iqueue_init(&newseg->node);
-    iqueue_add(&newseg->node, p);
+    iqueue_add_tail(&newseg->node, &kcp->rcv_buf);
     kcp->nrcv_buf++;
-  } else {
-    ikcp_segment_delete(kcp, newseg);
   }
 
 #if 0
@@ -692,18 +1243,7 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg) {
 #endif
 
   // move available data from rcv_buf -> rcv_queue
-  while (!iqueue_is_empty(&kcp->rcv_buf)) {
-    IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-    if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-      iqueue_del(&seg->node);
-      kcp->nrcv_buf--;
-      iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-      kcp->nrcv_que++;
-      kcp->rcv_nxt++;
-    } else {
-      break;
-    }
-  }
+  ikcp_move_rcv_buf(kcp);
 
 #if 0
 	ikcp_qprint("queue", &kcp->rcv_queue);
@@ -721,7 +1261,9 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg) {
 //---------------------------------------------------------------------
 int ikcp_input(ikcpcb *kcp, const char *data, long size) {
   IUINT32 prev_una = kcp->snd_una;
+  IUINT32 prev_delivered = kcp->delivered;
   IUINT32 maxack = 0, latest_ts = 0;
+  IINT32 rtt = -1;
   int flag = 0;
 
   if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
@@ -735,6 +1277,7 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size) {
     IUINT16 wnd;
     IUINT8 cmd, frg;
     IKCPSEG *seg;
+    int sent_once;
 
     if (size < (int)IKCP_OVERHEAD) break;
 
@@ -754,18 +1297,28 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size) {
     if ((long)size < (long)len || (int)len < 0) return -2;
 
     if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK && cmd != IKCP_CMD_WASK &&
-        cmd != IKCP_CMD_WINS)
+        cmd != IKCP_CMD_WINS && cmd != IKCP_CMD_SACK)
       return -3;
 
+    sent_once = (cmd == IKCP_CMD_ACK || cmd == IKCP_CMD_SACK) &&
+                ikcp_sent_once(kcp, sn);
+
     kcp->rmt_wnd = wnd;
     ikcp_parse_una(kcp, una);
     ikcp_shrink_buf(kcp);
 
-    if (cmd == IKCP_CMD_ACK) {
+    if (cmd == IKCP_CMD_ACK || cmd == IKCP_CMD_SACK) {
       if (_itimediff(kcp->current, ts) >= 0) {
-        ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
+        IINT32 sample = _itimediff(kcp->current, ts);
+        ikcp_update_ack(kcp, sample);
+        if (sent_once && (rtt < 0 || sample < rtt)) rtt = sample;
+      }
+      // the sn of a sack is the largest one acked, and ts its latest
+      if (cmd == IKCP_CMD_ACK) {
+        ikcp_parse_ack(kcp, sn);
+      } else {
+        ikcp_parse_sack(kcp, una, data, len);
       }
-      ikcp_parse_ack(kcp, sn);
       ikcp_shrink_buf(kcp);
       if (flag == 0) {
         flag = 1;
@@ -796,6 +1349,10 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size) {
       }
       if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
         ikcp_ack_push(kcp, sn, ts);
+        // a gap, or a repeat whose ack was lost
+        if (sn != kcp->rcv_nxt) {
+          kcp->ackurgent = 1;
+        }
         if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
           seg = ikcp_segment_new(kcp, len);
           seg->conv = conv;
@@ -839,28 +1396,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size) {
     ikcp_parse_fastack(kcp, maxack, latest_ts);
   }
 
-  if (_itimediff(kcp->snd_una, prev_una) > 0) {
-    if (kcp->cwnd < kcp->rmt_wnd) {
-      IUINT32 mss = kcp->mss;
-      if (kcp->cwnd < kcp->ssthresh) {
-        kcp->cwnd++;
-        kcp->incr += mss;
-      } else {
-        if (kcp->incr < mss) kcp->incr = mss;
-        kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
-        if ((kcp->cwnd + 1) * mss <= kcp->incr) {
-#if 1
-          kcp->cwnd = (kcp->incr + mss - 1) / ((mss > 0) ? mss : 1);
-#else
-          kcp->cwnd++;
-#endif
-        }
-      }
-      if (kcp->cwnd > kcp->rmt_wnd) {
-        kcp->cwnd = kcp->rmt_wnd;
-        kcp->incr = kcp->rmt_wnd * mss;
-      }
-    }
+  if (kcp->delivered != prev_delivered ||
+      _itimediff(kcp->snd_una, prev_una) > 0) {
+    kcp->cc->on_ack(kcp, prev_una, kcp->delivered - prev_delivered, rtt);
   }
 
   return 0;
@@ -888,21 +1426,118 @@ static int ikcp_wnd_unused(const ikcpcb *kcp) {
   return 0;
 }
 
+//---------------------------------------------------------------------
+// flush acknowledges
+//---------------------------------------------------------------------
+static int ikcp_ack_compare(const void *a, const void *b) {
+  IUINT32 x = *(const IUINT32 *)a;
+  IUINT32 y = *(const IUINT32 *)b;
+  return (x > y) - (x < y);
+}
+
+static char *ikcp_flush_sack(ikcpcb *kcp, IKCPSEG *seg, char *ptr) {
+  IUINT32 *acklist = kcp->acklist;
+  IUINT32 count = kcp->ackcount;
+  IUINT32 maxsn = acklist[0];
+  IUINT32 latest_ts = acklist[1];
+  IUINT32 i;
+
+  // sn to offset from una, the ones below una wrap around to the end
+  for (i = 0; i < count; i++) {
+    IUINT32 sn = acklist[i * 2 + 0];
+    IUINT32 ts = acklist[i * 2 + 1];
+    if (_itimediff(sn, maxsn) > 0) maxsn = sn;
+    if (_itimediff(ts, latest_ts) > 0) latest_ts = ts;
+    acklist[i * 2 + 0] = sn - seg->una;
+  }
+
+  qsort(acklist, count, sizeof(IUINT32) * 2, ikcp_ack_compare);
+
+  seg->cmd = IKCP_CMD_SACK;
+  seg->sn = maxsn;
+  seg->ts = latest_ts;
+
+  // at least one, una alone acks what the ranges would not
+  i = 0;
+  do {
+    char *header, *ranges;
+    IUINT32 nranges = 0, limit;
+    int size = (int)(ptr - kcp->packet);
+
+    if (size + (int)(IKCP_OVERHEAD + IKCP_SACK_RANGE_SIZE) > (int)kcp->mtu) {
+      ptr = ikcp_packet_next(kcp, ptr);
+    }
+
+    header = ptr;
+    ranges = ptr + IKCP_OVERHEAD;
+    limit = (kcp->mtu - (IUINT32)(ranges - kcp->packet)) / IKCP_SACK_RANGE_SIZE;
+
+    while (i < count && nranges < limit) {
+      IUINT32 start = acklist[i * 2], end = start + 1;
+      if (start > IKCP_SACK_RANGE_MAX) {
+        i = count;
+        break;
+      }
+      // merge the run, duplicates included
+      for (i++; i < count && end - start < IKCP_SACK_RANGE_MAX; i++) {
+        IUINT32 offset = acklist[i * 2];
+        if (offset > end) break;
+        end = offset + 1;
+      }
+      ranges = ikcp_encode16u(ranges, (unsigned short)start);
+      ranges = ikcp_encode16u(ranges, (unsigned short)(end - start));
+      nranges++;
+    }
+
+    seg->len = nranges * IKCP_SACK_RANGE_SIZE;
+    ikcp_encode_seg(header, seg);
+    ptr = ranges;
+  } while (i < count);
+
+  seg->len = 0;
+  return ptr;
+}
+
+// one ack segment per sn of acklist, or ranges of them with sack, |seg|
+// holds the common fields
+static char *ikcp_flush_acks(ikcpcb *kcp, IKCPSEG *seg, char *ptr) {
+  int count = (int)kcp->ackcount;
+  int size, i;
+
+  if (kcp->sack != 0 && count > 0) {
+    ptr = ikcp_flush_sack(kcp, seg, ptr);
+  } else {
+    for (i = 0; i < count; i++) {
+      size = (int)(ptr - kcp->packet);
+      if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+        ptr = ikcp_packet_next(kcp, ptr);
+      }
+      ikcp_ack_get(kcp, i, &seg->sn, &seg->ts);
+      ptr = ikcp_encode_seg(ptr, seg);
+    }
+  }
+
+  kcp->ackcount = 0;
+  kcp->ackurgent = 0;
+  return ptr;
+}
+
 //---------------------------------------------------------------------
 // ikcp_flush
 //---------------------------------------------------------------------
 IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   // IUINT32 current = kcp->current;
   kcp->current = current;
-  char *const buffer = kcp->buffer;
-  char *const begin = kcp->buffer + kcp->head_room;
-  char *ptr = begin;
-  int count, size, i;
+  char *ptr = ikcp_packet_begin(kcp);
+  int size;
   IUINT32 resent, cwnd;
   IUINT32 rtomin;
   struct IQUEUEHEAD *p;
   int change = 0;
   int lost = 0;
+  int paced = kcp->cc->paced && kcp->pacing_rate > 0;
+  int pacing_limited = 0;
+  IINT32 unsent_budget;
   IKCPSEG seg;
 
   // 'ikcp_update' haven't been called.
@@ -918,18 +1553,7 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   seg.ts = 0;
 
   // flush acknowledges
-  count = kcp->ackcount;
-  for (i = 0; i < count; i++) {
-    size = (int)(ptr - buffer);
-    if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-      ikcp_output(kcp, buffer, size);
-      ptr = begin;
-    }
-    ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-    ptr = ikcp_encode_seg(ptr, &seg);
-  }
-
-  kcp->ackcount = 0;
+  ptr = ikcp_flush_acks(kcp, &seg, ptr);
 
   // probe window size (if remote window size equals zero)
   if (kcp->rmt_wnd == 0) {
@@ -955,10 +1579,9 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   // flush window probing commands
   if (kcp->probe & IKCP_ASK_SEND) {
     seg.cmd = IKCP_CMD_WASK;
-    size = (int)(ptr - buffer);
+    size = (int)(ptr - kcp->packet);
     if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-      ikcp_output(kcp, buffer, size);
-      ptr = begin;
+      ptr = ikcp_packet_next(kcp, ptr);
     }
     ptr = ikcp_encode_seg(ptr, &seg);
   }
@@ -966,10 +1589,9 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   // flush window probing commands
   if (kcp->probe & IKCP_ASK_TELL) {
     seg.cmd = IKCP_CMD_WINS;
-    size = (int)(ptr - buffer);
+    size = (int)(ptr - kcp->packet);
     if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-      ikcp_output(kcp, buffer, size);
-      ptr = begin;
+      ptr = ikcp_packet_next(kcp, ptr);
     }
     ptr = ikcp_encode_seg(ptr, &seg);
   }
@@ -980,12 +1602,31 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
   if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
 
-  // move data from snd_queue to snd_buf
+  if (paced) {
+    ikcp_pacing_refill(kcp, current);
+  }
+  unsent_budget = kcp->pacing_budget;
+
+  // move data from snd_queue to snd_buf, no more than can be paced out now
   while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
     IKCPSEG *newseg;
     if (iqueue_is_empty(&kcp->snd_queue)) break;
+    if (paced && unsent_budget <= 0) {
+      pacing_limited = 1;
+      break;
+    }
 
     newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+    // stale before any of it was sent, it takes no window
+    if (newseg->expire != 0 && _itimediff(current, newseg->expire) >= 0) {
+      ikcp_drop_snd_queue_head(kcp);
+      continue;
+    }
+    unsent_budget -= (IINT32)(IKCP_OVERHEAD + newseg->len);
+
+    if (kcp->nsnd_buf == 0 && kcp->cc->on_restart != NULL) {
+      kcp->cc->on_restart(kcp);
+    }
 
     iqueue_del(&newseg->node);
     iqueue_add_tail(&newseg->node, &kcp->snd_buf);
@@ -997,6 +1638,8 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
     newseg->wnd = seg.wnd;
     newseg->ts = current;
     newseg->sn = kcp->snd_nxt++;
+    assert(IKCP_RING_AT(kcp->snd_ring, kcp->snd_ring_mask, newseg->sn) == NULL);
+    IKCP_RING_AT(kcp->snd_ring, kcp->snd_ring_mask, newseg->sn) = newseg;
     newseg->una = kcp->rcv_nxt;
     newseg->resendts = current;
     newseg->rto = kcp->rx_rto;
@@ -1013,6 +1656,10 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
     IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
     int needsend = 0;
+    if (paced && kcp->pacing_budget <= 0) {
+      pacing_limited = 1;
+      break;
+    }
     if (segment->xmit == 0) {
       needsend = 1;
       segment->xmit++;
@@ -1022,6 +1669,7 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
       needsend = 1;
       segment->xmit++;
       kcp->xmit++;
+      kcp->retransmits++;
       if (kcp->nodelay == 0) {
         segment->rto += _imax_(segment->rto, (IUINT32)kcp->rx_rto);
       } else {
@@ -1036,6 +1684,7 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
         needsend = 1;
         segment->xmit++;
         segment->fastack = 0;
+        kcp->retransmits++;
         segment->resendts = current + segment->rto;
         change++;
       }
@@ -1047,12 +1696,11 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
       segment->wnd = seg.wnd;
       segment->una = kcp->rcv_nxt;
 
-      size = (int)(ptr - buffer);
+      size = (int)(ptr - kcp->packet);
       need = IKCP_OVERHEAD + segment->len;
 
       if (size + need > (int)kcp->mtu) {
-        ikcp_output(kcp, buffer, size);
-        ptr = begin;
+        ptr = ikcp_packet_next(kcp, ptr);
       }
 
       ptr = ikcp_encode_seg(ptr, segment);
@@ -1062,6 +1710,10 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
         ptr += segment->len;
       }
 
+      if (paced) {
+        kcp->pacing_budget -= need;
+      }
+
       if (segment->xmit >= kcp->dead_link) {
         kcp->state = (IUINT32)-1;
       }
@@ -1074,30 +1726,20 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current) {
   }
 
   // flash remain segments
-  size = (int)(ptr - buffer);
-  if (size > (int)kcp->head_room) {
-    ikcp_output(kcp, buffer, size);
-  }
+  ikcp_packet_end(kcp, ptr);
 
-  // update ssthresh
-  if (change) {
-    IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
-    kcp->ssthresh = inflight / 2;
-    if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
-    kcp->cwnd = kcp->ssthresh + resent;
-    kcp->incr = kcp->cwnd * kcp->mss;
+  if (change || lost) {
+    kcp->cc->on_loss(kcp, cwnd, resent, change, lost);
   }
 
-  if (lost) {
-    kcp->ssthresh = cwnd / 2;
-    if (kcp->ssthresh < IKCP_THRESH_MIN) kcp->ssthresh = IKCP_THRESH_MIN;
+  if (kcp->cwnd < 1) {
     kcp->cwnd = 1;
     kcp->incr = kcp->mss;
   }
 
-  if (kcp->cwnd < 1) {
-    kcp->cwnd = 1;
-    kcp->incr = kcp->mss;
+  // come back as soon as the next segment can be paced out
+  if (pacing_limited) {
+    wait_time = _imin_(wait_time, ikcp_pacing_delay(kcp));
   }
 
   return wait_time;
@@ -1224,8 +1866,10 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc) {
   if (resend >= 0) {
     kcp->fastresend = resend;
   }
-  if (nc >= 0) {
-    kcp->nocwnd = nc;
+  if (nc > 0) {
+    ikcp_congestion(kcp, IKCP_CC_NONE);
+  } else if (nc == 0 && kcp->cc == &ikcp_cc_none) {
+    ikcp_congestion(kcp, IKCP_CC_RENO);
   }
   return 0;
 }
@@ -1233,15 +1877,78 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc) {
 int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd) {
   if (kcp) {
     if (sndwnd > 0) {
+      if (ikcp_ring_reserve(&kcp->snd_ring, &kcp->snd_ring_mask, sndwnd,
+                            &kcp->snd_buf) != 0)
+        return -1;
       kcp->snd_wnd = sndwnd;
     }
     if (rcvwnd > 0) {  // must >= max fragment size
-      kcp->rcv_wnd = _imax_(rcvwnd, IKCP_WND_RCV);
+      IUINT32 wnd = _imax_(rcvwnd, IKCP_WND_RCV);
+      // the slots of the segments delivered would not be moved over
+      if (kcp->unordered && wnd > kcp->rcv_ring_mask + 1) return -1;
+      if (ikcp_ring_reserve(&kcp->rcv_ring, &kcp->rcv_ring_mask, wnd,
+                            &kcp->rcv_buf) != 0)
+        return -1;
+      kcp->rcv_wnd = wnd;
     }
   }
   return 0;
 }
 
+int ikcp_congestion(ikcpcb *kcp, int algorithm) {
+  switch (algorithm) {
+    case IKCP_CC_NONE:
+      return ikcp_set_congestion(kcp, &ikcp_cc_none);
+    case IKCP_CC_RENO:
+      return ikcp_set_congestion(kcp, &ikcp_cc_reno);
+    case IKCP_CC_BBR:
+      return ikcp_set_congestion(kcp, &ikcp_cc_bbr);
+    case IKCP_CC_RENO_PACED:
+      return ikcp_set_congestion(kcp, &ikcp_cc_reno_paced);
+    default:
+      return -1;
+  }
+}
+
+int ikcp_set_congestion(ikcpcb *kcp, const struct IKCPCC *cc) {
+  if (cc == NULL || cc->init == NULL || cc->on_ack == NULL ||
+      cc->on_loss == NULL)
+    return -1;
+  // none and both renos share their state
+  if (kcp->cc->init != cc->init) cc->init(kcp);
+  kcp->cc = cc;
+  kcp->nocwnd = (cc == &ikcp_cc_none) ? 1 : 0;
+  return 0;
+}
+
+IUINT32 ikcp_pacing_rate(const ikcpcb *kcp) {
+  return kcp->cc->paced ? kcp->pacing_rate : 0;
+}
+
+void ikcp_reset_path(ikcpcb *kcp) {
+  kcp->rx_srtt = 0;
+  kcp->rx_rttval = 0;
+  kcp->rx_rto = IKCP_RTO_DEF;
+  kcp->cc->init(kcp);
+}
+
+void ikcp_xmit_stats(const ikcpcb *kcp, IUINT32 *delivered,
+                     IUINT32 *retransmits) {
+  *delivered = kcp->delivered;
+  *retransmits = kcp->retransmits;
+}
+
+int ikcp_sack(ikcpcb *kcp, int sack) {
+  kcp->sack = (sack != 0) ? 1 : 0;
+  return 0;
+}
+
+int ikcp_unordered(ikcpcb *kcp, int unordered) {
+  if (kcp->rcv_nxt != 0 || kcp->nrcv_buf > 0 || kcp->nrcv_que > 0) return -1;
+  kcp->unordered = (unordered != 0) ? 1 : 0;
+  return 0;
+}
+
 int ikcp_stream(ikcpcb *kcp, int stream) {
   if (stream != 0) {
     kcp->stream = 1;
@@ -1262,6 +1969,19 @@ IUINT32 ikcp_getconv(const void *ptr) {
   return conv;
 }
 
+int ikcp_packet_has_push(const char *data, long size) {
+  while (size >= (long)IKCP_OVERHEAD) {
+    IUINT32 len;
+    IUINT8 cmd;
+    ikcp_decode8u(data + 4, &cmd);
+    if (cmd == IKCP_CMD_PUSH) return 1;
+    ikcp_decode32u(data + 20, &len);
+    data += IKCP_OVERHEAD + len;
+    size -= (long)(IKCP_OVERHEAD + len);
+  }
+  return 0;
+}
+
 IINT32 ikcp_set_head_room(ikcpcb *kcp, IUINT32 head_room) {
   if (head_room >= kcp->mss) {
     return -1;
@@ -1350,18 +2070,24 @@ IUINT32 ikcp_can_send_ack(const ikcpcb *kcp) {
   return 1;
 }
 
+IUINT32 ikcp_acks_pending(const ikcpcb *kcp, int *urgent) {
+  if (urgent) {
+    *urgent = kcp->ackcount > 0 ? kcp->ackurgent : 0;
+  }
+  return kcp->ackcount;
+}
+
 // flush pending ack
 void ikcp_flush_ack(ikcpcb *kcp) {
-  char *const buffer = kcp->buffer;
-  char *const begin = kcp->buffer + kcp->head_room;
-  char *ptr = begin;
-  int count, size, i;
+  char *ptr;
   IKCPSEG seg;
 
   if (kcp->ackcount <= 0) {
     return;
   }
 
+  ptr = ikcp_packet_begin(kcp);
+
   seg.conv = kcp->conv;
   seg.cmd = IKCP_CMD_ACK;
   seg.frg = 0;
@@ -1372,22 +2098,9 @@ void ikcp_flush_ack(ikcpcb *kcp) {
   seg.ts = 0;
 
   // flush acknowledges
-  count = kcp->ackcount;
-  for (i = 0; i < count; i++) {
-    size = (int)(ptr - buffer);
-    if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-      ikcp_output(kcp, buffer, size);
-      ptr = begin;
-    }
-    ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-    ptr = ikcp_encode_seg(ptr, &seg);
-  }
+  ptr = ikcp_flush_acks(kcp, &seg, ptr);
 
-  size = (int)(ptr - buffer);
-  if (size > (int)kcp->head_room) {
-    ikcp_output(kcp, buffer, size);
-  }
-  kcp->ackcount = 0;
+  ikcp_packet_end(kcp, ptr);
 }
 
 IUINT32 ikcp_can_flush_after_input(const ikcpcb *kcp) {
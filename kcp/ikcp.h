@@ -15,6 +15,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 
 //=====================================================================
@@ -279,10 +280,58 @@ struct IKCPSEG
 	IUINT32 rto;
 	IUINT32 fastack;
 	IUINT32 xmit;
+	// first fragment of a message in snd_queue, see ikcp_expire_last
+	IUINT32 expire;
 	char data[1];
 };
 
 
+//---------------------------------------------------------------------
+// CONGESTION CONTROL
+//---------------------------------------------------------------------
+struct IKCPCB;
+
+#define IKCP_CC_NONE		0	// windows only, unpaced (nocwnd)
+#define IKCP_CC_RENO		1	// loss based, unpaced, the default
+#define IKCP_CC_BBR		2	// bottleneck bandwidth and rtt model, paced
+#define IKCP_CC_RENO_PACED	3	// loss based, paced
+
+// hooks of a congestion controller, which keeps cwnd (in segments) and
+// pacing_rate (in bytes per second, 0 if unpaced) of the kcpcb up to date
+struct IKCPCC
+{
+	const char *name;
+	void (*init)(struct IKCPCB *kcp);
+	// an input acknowledged |acked| segments, |rtt| is its smallest sample
+	// or -1, snd_una may not have moved for selective acks
+	void (*on_ack)(struct IKCPCB *kcp, IUINT32 prev_una, IUINT32 acked,
+		IINT32 rtt);
+	// a flush fast resent and/or timed out some segments, |cwnd| is the
+	// window it used
+	void (*on_loss)(struct IKCPCB *kcp, IUINT32 cwnd, IUINT32 resent,
+		int fast, int timeout);
+	// data is queued again after snd_buf ran empty, may be NULL
+	void (*on_restart)(struct IKCPCB *kcp);
+	// flushes send data segments at pacing_rate
+	int paced;
+};
+
+#define IKCP_BBR_BW_ROUNDS	10
+
+struct IKCPBBR
+{
+	IUINT32 mode, pacing_gain, cwnd_gain;
+	// a round ends once as many segments as were in flight when it started
+	// have been acked, a lost one does not hold it up
+	IUINT32 round_count, round_inflight, round_start_ts, round_delivered;
+	// delivery rate of the last rounds, windowed max is the bottleneck
+	IUINT32 bw_samples[IKCP_BBR_BW_ROUNDS];
+	IUINT32 btl_bw, min_rtt, min_rtt_ts;
+	IUINT32 full_bw, full_bw_rounds;
+	IUINT32 cycle_index, cycle_ts;
+};
+
+
 //---------------------------------------------------------------------
 // IKCPCB
 //---------------------------------------------------------------------
@@ -303,16 +352,41 @@ struct IKCPCB
 	struct IQUEUEHEAD rcv_queue;
 	struct IQUEUEHEAD snd_buf;
 	struct IQUEUEHEAD rcv_buf;
+	// segments of snd_buf/rcv_buf indexed by sn & mask, power of two sized
+	// and never smaller than the window, rcv_buf itself is not sorted
+	struct IKCPSEG **snd_ring;
+	struct IKCPSEG **rcv_ring;
+	IUINT32 snd_ring_mask, rcv_ring_mask;
 	IUINT32 *acklist;
 	IUINT32 ackcount;
 	IUINT32 ackblock;
+	// one of the acks is for a segment out of order or repeated, which the
+	// sender is better told of at once
+	int ackurgent;
 	void *user;
 	char *buffer;
 	int fastresend;
 	int fastlimit;
 	int nocwnd, stream;
+	int sack;
+	// segments go to rcv_queue as they arrive, see ikcp_unordered
+	int unordered;
+	const struct IKCPCC *cc;
+	// segments acknowledged so far, by una or (s)ack
+	IUINT32 delivered;
+	// segments sent again, on timeout or fast retransmit
+	IUINT32 retransmits;
+	// the budget is refilled at pacing_rate by each flush, a data segment
+	// is only sent while it is positive
+	IUINT32 pacing_rate, ts_pacing;
+	IINT32 pacing_budget;
+	struct IKCPBBR bbr;
 	int logmask;
 	int (*output)(char *buf, int len, struct IKCPCB *kcp, void *user);
+	// optional, at least mtu bytes to build the next packet in, buffer if
+	// it returns NULL, packet is the one being built
+	char *(*output_buffer)(struct IKCPCB *kcp, void *user);
+	char *packet;
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
 };
 
@@ -352,6 +426,11 @@ void ikcp_release(ikcpcb *kcp);
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(char *buf, int len, 
 	ikcpcb *kcp, void *user));
 
+// set the buffer the next packet is built in and handed to output with,
+// asked for before each packet, so output may take the one it got in place
+void ikcp_setoutputbuffer(ikcpcb *kcp, char *(*output_buffer)(ikcpcb *kcp,
+	void *user));
+
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
@@ -362,6 +441,15 @@ int ikcp_append(ikcpcb *kcp, const char *buffer, int len);
 
 int ikcp_write(ikcpcb *kcp, const char *buffer, int len, int always_stream);
 
+// ikcp_write of the |len| bytes of |iov| from |offset| on, the segments are
+// filled straight from the fragments
+int ikcp_writev(ikcpcb *kcp, const struct iovec *iov, int iovcnt, int offset,
+	int len, int always_stream);
+
+// the message last written is dropped from snd_queue unless it has begun
+// to be sent by |expire|, in the clock of ikcp_update, not in stream mode
+int ikcp_expire_last(ikcpcb *kcp, IUINT32 expire);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask 
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec. 
@@ -385,6 +473,11 @@ IUINT32 ikcp_flush(ikcpcb *kcp, IUINT32 current);
 // check the size of next message in the recv queue
 int ikcp_peeksize(const ikcpcb *kcp);
 
+// the payloads of the fragments of the next message in the recv queue, the
+// first iovcnt of them, returns the number of fragments or below zero if
+// there is no message, ikcp_recv(kcp, NULL, size) drops it after use
+int ikcp_peekv(const ikcpcb *kcp, struct iovec *iov, int iovcnt);
+
 // change MTU size, default is 1400
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
@@ -410,8 +503,39 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 // read conv
 IUINT32 ikcp_getconv(const void *ptr);
 
+// whether the segments of an output packet carry any data, 0 for acks and
+// window probes only
+int ikcp_packet_has_push(const char *data, long size);
+
 int ikcp_stream(ikcpcb* kcp, int stream);
 
+// hand each segment over as soon as it arrives instead of in sn order, the
+// acks and the window are the same, for a peer whose messages are never
+// larger than one segment, a write of more than mss fails and a fragment
+// received is dropped, must be set before any input
+int ikcp_unordered(ikcpcb* kcp, int unordered);
+
+// acknowledge with ranges of sn relative to una instead of one segment per
+// sn, both ends must support IKCP_CMD_SACK
+int ikcp_sack(ikcpcb* kcp, int sack);
+
+// select one of IKCP_CC_*, IKCP_CC_NONE is what ikcp_nodelay(nc=1) does
+int ikcp_congestion(ikcpcb* kcp, int algorithm);
+
+// plug in a congestion controller of your own, must outlive the kcpcb
+int ikcp_set_congestion(ikcpcb* kcp, const struct IKCPCC* cc);
+
+// bytes per second the data segments are paced at, 0 if unpaced
+IUINT32 ikcp_pacing_rate(const ikcpcb* kcp);
+
+// the peer is reached along another path, the rtt and the congestion window
+// are learnt again
+void ikcp_reset_path(ikcpcb* kcp);
+
+// segments delivered and retransmitted since the kcpcb was created
+void ikcp_xmit_stats(const ikcpcb* kcp, IUINT32* delivered,
+                     IUINT32* retransmits);
+
 IINT32 ikcp_set_head_room(ikcpcb* kcp, IUINT32 head_room);
 
 IINT32 ikcp_is_alive(const ikcpcb* kcp);
@@ -434,6 +558,10 @@ IUINT32 ikcp_can_flush_after_input(const ikcpcb* kcp);
 
 IUINT32 ikcp_can_send_ack(const ikcpcb* kcp);
 
+// acks waiting for the next flush, |urgent| tells if one is for a segment
+// out of order or repeated
+IUINT32 ikcp_acks_pending(const ikcpcb *kcp, int *urgent);
+
 void ikcp_flush_ack(ikcpcb *kcp);
 
 #ifdef __cplusplus
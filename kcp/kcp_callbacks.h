@@ -2,6 +2,7 @@
 #define KCP_CALLBACKS_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <functional>
 #include <memory>
@@ -15,6 +16,7 @@ class InetAddress;
 }  // namespace muduo
 
 class KCPSession;
+class KCPStreamMux;
 
 using KCPSessionPtr = std::shared_ptr<KCPSession>;
 
@@ -23,12 +25,34 @@ using ConnectionCallback = std::function<void(const KCPSessionPtr&, bool)>;
 using MessageCallback =
     std::function<void(const KCPSessionPtr&, muduo::net::Buffer*)>;
 
+// a message as the payloads of its fragments, valid until the callback
+// returns
+using MessageSpansCallback =
+    std::function<void(const KCPSessionPtr&, const struct iovec*, int)>;
+
 using WriteCompleteCallback = std::function<void(const KCPSessionPtr&)>;
 
+// bytes which may be written without being queued, see
+// KCPSession::WritableBytes
+using WindowUpdateCallback = std::function<void(const KCPSessionPtr&, size_t)>;
+
 using HighWaterMarkCallback = std::function<void(const KCPSessionPtr&, size_t)>;
 
-using OutputCallback =
-    std::function<void(void*, size_t, uint32_t, const muduo::net::InetAddress&)>;
+// |open| is true at the first frame of a stream opened by the peer, false
+// once the fin of the peer has been delivered
+using StreamCallback = std::function<void(KCPStreamMux*, uint32_t, bool)>;
+
+// data of a stream in order, valid until the callback returns
+using StreamDataCallback =
+    std::function<void(KCPStreamMux*, uint32_t, const char*, size_t)>;
+
+// a datagram of the peer, valid until the callback returns
+using DatagramCallback =
+    std::function<void(const KCPSessionPtr&, const char*, size_t)>;
+
+// the packet type goes into the public header the head room is left for
+using OutputCallback = std::function<void(void*, size_t, uint8_t, uint32_t,
+                                          const muduo::net::InetAddress&)>;
 
 using FlushTxQueueCallback = std::function<void()>;
 
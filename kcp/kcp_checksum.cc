@@ -0,0 +1,137 @@
+
+#include "kcp_checksum.h"
+
+#include <string.h>
+#include <zconf.h>
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+// reflected 0x1EDC6F41
+const uint32_t kCrc32cPolynomial = 0x82F63B78;
+
+// slicing by 8, table[k][b] is the crc of byte b followed by k zero bytes
+struct Crc32cTable {
+  Crc32cTable() {
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; ++i) {
+        crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPolynomial : 0);
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (int k = 1; k < 8; ++k) {
+        uint32_t prev = table[k - 1][b];
+        table[k][b] = (prev >> 8) ^ table[0][prev & 0xFF];
+      }
+    }
+  }
+
+  uint32_t table[8][256];
+};
+
+const Crc32cTable kCrc32cTable;
+
+uint32_t Crc32cSoftware(uint32_t crc, const uint8_t* p, size_t length) {
+  const auto& t = kCrc32cTable.table;
+  while (length >= 8) {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    // little endian
+    lo ^= crc;
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+          t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+
+  while (length > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+    ++p;
+    --length;
+  }
+
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t Crc32cHardware(uint32_t crc,
+                                                          const uint8_t* p,
+                                                          size_t length) {
+  uint64_t crc64 = crc;
+  while (length >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc64 = _mm_crc32_u64(crc64, v);
+    p += 8;
+    length -= 8;
+  }
+
+  auto crc32 = static_cast<uint32_t>(crc64);
+  while (length > 0) {
+    crc32 = _mm_crc32_u8(crc32, *p);
+    ++p;
+    --length;
+  }
+
+  return crc32;
+}
+#endif
+
+using Crc32cFunc = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+Crc32cFunc SelectCrc32c() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return Crc32cHardware;
+  }
+#endif
+  return Crc32cSoftware;
+}
+
+const Crc32cFunc kCrc32c = SelectCrc32c();
+
+}  // namespace
+
+uint32_t KCPCrc32c(const void* data, size_t length) {
+  return ~kCrc32c(~uint32_t(0), static_cast<const uint8_t*>(data), length);
+}
+
+bool KCPCrc32cIsHardwareAccelerated() { return kCrc32c != Crc32cSoftware; }
+
+uint32_t KCPChecksum(KCPChecksumType type, const void* data, size_t length) {
+  switch (type) {
+    case ADLER32_CHECKSUM:
+      return static_cast<uint32_t>(
+          ::adler32(1, static_cast<const Bytef*>(data),
+                    static_cast<uInt>(length)));
+    case CRC32C_CHECKSUM:
+      return KCPCrc32c(data, length);
+    default:
+      return 0;
+  }
+}
+
+#define CHECKSUM_TYPE_CASE(type) \
+  case type:                     \
+    return #type
+
+const char* KCPChecksumTypeToString(uint8_t type) {
+  switch (type) {
+    CHECKSUM_TYPE_CASE(ADLER32_CHECKSUM);
+    CHECKSUM_TYPE_CASE(CRC32C_CHECKSUM);
+    CHECKSUM_TYPE_CASE(NO_CHECKSUM);
+    default:
+      return "UNKNOW";
+  }
+}
+
+#undef CHECKSUM_TYPE_CASE
@@ -0,0 +1,28 @@
+
+#ifndef KCP_CHECKSUM_H_
+#define KCP_CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// checksum of the bytes following the checksum field of KCPPublicHeader, the
+// type travels in the upper bits of the packet type byte so that a packet is
+// verified before its session is looked up
+enum KCPChecksumType : uint8_t {
+  ADLER32_CHECKSUM,
+  CRC32C_CHECKSUM,
+  // for links whose udp checksum is trusted
+  NO_CHECKSUM,
+  NUM_CHECKSUM_TYPES
+};
+
+uint32_t KCPChecksum(KCPChecksumType type, const void* data, size_t length);
+
+// Castagnoli, the sse4.2 crc32 instruction if the cpu has it
+// https://tools.ietf.org/html/rfc3720#appendix-B.4
+uint32_t KCPCrc32c(const void* data, size_t length);
+bool KCPCrc32cIsHardwareAccelerated();
+
+const char* KCPChecksumTypeToString(uint8_t type);
+
+#endif
@@ -1,6 +1,7 @@
 
 #include "kcp_client.h"
 
+#include <errno.h>
 #include <linux/errqueue.h>
 
 #include <string.h>
@@ -22,6 +23,7 @@
 
 #include "kcp_packets.h"
 #include "kcp_session.h"
+#include "kcp_ticket.h"
 #include "udp_socket.h"
 
 KCPClient::KCPClient(muduo::net::EventLoop* loop)
@@ -33,51 +35,75 @@ KCPClient::~KCPClient() {
   // ~socket_
 }
 
-int KCPClient::Connect(const muduo::net::InetAddress& address) {
-  loop_->assertInLoopThread();
+int KCPClient::CreateSocket(const muduo::net::InetAddress& address,
+                            std::unique_ptr<UDPSocket>* socket) {
+  auto new_socket = std::make_unique<UDPSocket>();
 
-  auto socket = std::make_unique<UDPSocket>();
+  new_socket->AllowReceiveError();
 
-  socket->AllowReceiveError();
-
-  int rc = socket->Connect(address);
+  int rc = new_socket->Connect(address);
   if (rc < 0) {
     LOG_ERROR << "Connect error: " << rc;
     return rc;
   }
 
-  rc = socket->SetReceiveBufferSize(static_cast<int32_t>(kSocketReceiveBuffer));
+  rc = new_socket->SetReceiveBufferSize(
+      static_cast<int32_t>(kSocketReceiveBuffer));
   if (rc < 0) {
     LOG_ERROR << "SetReceiveBufferSize error: " << rc;
     return rc;
   }
 
-  rc = socket->SetSendBufferSize(static_cast<int32_t>(kSocketSendBuffer));
+  rc = new_socket->SetSendBufferSize(static_cast<int32_t>(kSocketSendBuffer));
   if (rc < 0) {
     LOG_ERROR << "SetSendBufferSize error: " << rc;
     return rc;
   }
 
-  rc = socket->GetLocalAddress(&client_address_);
+  rc = new_socket->GetLocalAddress(&client_address_);
   if (rc < 0) {
     LOG_ERROR << "GetLocalAddress error: " << rc;
     return rc;
   }
 
-  rc = socket->GetPeerAddress(&server_address_);
+  rc = new_socket->GetPeerAddress(&server_address_);
   if (rc < 0) {
     LOG_ERROR << "GetPeerAddress error: " << rc;
     return rc;
   }
 
-  socket_ = std::move(socket);
+  *socket = std::move(new_socket);
+  return 0;
+}
 
+void KCPClient::CreateChannel() {
   channel_ = std::make_unique<muduo::net::Channel>(loop_, socket_->sockfd());
   channel_->setReadCallback(
       [this](muduo::Timestamp receive_time) { HandleRead(receive_time); });
   channel_->setWriteCallback([this] { HandleWrite(); });
   channel_->setErrorCallback([this] { HandleError(); });
   channel_->enableReading();
+}
+
+void KCPClient::RemoveChannel() {
+  if (channel_) {
+    channel_->disableAll();
+    channel_->remove();
+    channel_.reset();
+  }
+}
+
+int KCPClient::Connect(const muduo::net::InetAddress& address) {
+  loop_->assertInLoopThread();
+
+  std::unique_ptr<UDPSocket> socket;
+  int rc = CreateSocket(address, &socket);
+  if (rc < 0) {
+    return rc;
+  }
+
+  socket_ = std::move(socket);
+  CreateChannel();
 
   BuildSession();
   periodic_task_timer_ = loop_->runEvery(kClientRunPeriodicTaskInterval,
@@ -109,7 +135,7 @@ void KCPClient::RunPeriodicTask() {
         kClientSynSentTimeout) {
       ++pending_session_->retry_times;
       pending_session_->syn_sent_time = now;
-      SendPacket(SYN_PACKET, pending_session_->session_id);
+      SendSynPacket(pending_session_->session_id);
       return;
     }
   } else if (state_ == CONNECTED) {
@@ -129,6 +155,17 @@ void KCPClient::RunPeriodicTask() {
       LOG_DEBUG << "time to send ping packet, session_id: "
                 << session_->session_id();
       SendPacket(PING_PACKET, session_->session_id());
+
+      // asked for again with every ping until it comes
+      if (!ticket_.empty() && ticket_session_id_ == session_->session_id() &&
+          muduo::timeDifference(now, ticket_received_time_) >=
+              kClientTicketRefreshSeconds) {
+        char buf[KCPPublicHeader::kPublicHeaderLength +
+                 KCPTicketCrypter::kTicketLength];
+        memcpy(buf + KCPPublicHeader::kPublicHeaderLength, ticket_.data(),
+               ticket_.size());
+        SendPacket(buf, sizeof(buf), TICKET_PACKET, ticket_session_id_);
+      }
     }
   }
 }
@@ -140,16 +177,59 @@ void KCPClient::BuildSession() {
   }
 
   if (state_ == CLOSED) {
-    SendPacket(SYN_PACKET, 0);
+    if (!ticket_.empty() && ResumeSession()) {
+      return;
+    }
+
+    SendSynPacket(0);
     pending_session_ = std::make_unique<KCPPendingSession>();
     pending_session_->syn_sent_time = muduo::Timestamp::now();
     set_state(PENDING);
   }
 }
 
+bool KCPClient::ResumeSession() {
+  assert(ticket_.size() == KCPTicketCrypter::kTicketLength);
+
+  // a ticket is good for one resumption only
+  std::string ticket;
+  ticket.swap(ticket_);
+  uint32_t session_id = ticket_resume_session_id_;
+  uint8_t options = ticket_options_ & LocalOptions();
+
+  // ahead of whatever the connection callback writes
+  char buf[KCPPublicHeader::kPublicHeaderLength + sizeof(uint8_t) +
+           KCPTicketCrypter::kTicketLength];
+  size_t length = KCPPublicHeader::kPublicHeaderLength;
+  buf[length++] = static_cast<char>(LocalOptions());
+  memcpy(buf + length, ticket.data(), ticket.size());
+  SendPacket(buf, sizeof(buf), RESUME_PACKET, session_id);
+
+  auto session = std::make_shared<KCPSession>(loop_);
+  if (!InitializeSession(session, session_id, options)) {
+    LOG_ERROR << "InitializeSession failed, session_id :" << session_id
+              << ", server_address: " << server_address_.toIpPort();
+    return false;
+  }
+
+  session_ = std::move(session);
+  ticket_options_ = options;
+  resuming_ = true;
+  last_ping_time_ = muduo::Timestamp::now();
+  set_state(CONNECTED);
+
+  LOG_INFO << "session resumed, server_address: " << server_address_.toIpPort()
+           << ", session_id: " << session_id;
+  return true;
+}
+
 void KCPClient::ResetSession() {
   LOG_INFO << "reset session from state: " << state_ << " at " << this;
 
+  resuming_ = false;
+  // of the session gone, not to reset the next one at once
+  last_received_time_ = muduo::Timestamp();
+
   if (pending_session_) {
     pending_session_.reset();
   }
@@ -215,11 +295,11 @@ void KCPClient::Disconnect() {
   loop_->cancel(reconnect_timer_);
   reconnect_timer_registered_ = false;
 
-  if (channel_) {
-    channel_->disableAll();
-    channel_->remove();
-    channel_.reset();
-  }
+  // the server may be another one next time
+  ticket_.clear();
+  resuming_ = false;
+
+  RemoveChannel();
 
   if (socket_) {
     socket_->Close();
@@ -229,6 +309,36 @@ void KCPClient::Disconnect() {
   set_state(CLOSED);
 }
 
+int KCPClient::Rebind() {
+  loop_->assertInLoopThread();
+
+  if (!socket_) {
+    return -ENOTCONN;
+  }
+
+  std::unique_ptr<UDPSocket> socket;
+  int rc = CreateSocket(server_address_, &socket);
+  if (rc < 0) {
+    return rc;
+  }
+
+  // whatever the old socket still holds is lost like any packet in flight
+  RemoveChannel();
+  socket_->Close();
+  socket_ = std::move(socket);
+  CreateChannel();
+
+  LOG_INFO << "kcp client rebound to " << client_address_.toIpPort();
+
+  // the server learns of the new path at once instead of with the next data
+  // packet, and validates it if migration was agreed on
+  if (state_ == CONNECTED) {
+    SendPacket(PING_PACKET, session_->session_id());
+  }
+
+  return 0;
+}
+
 void KCPClient::HandleRead(muduo::Timestamp) {
   if (!(socket_ && socket_->IsValidSocket())) {
     return;
@@ -345,10 +455,24 @@ void KCPClient::HandleError() {
 }
 
 void KCPClient::SendPacket(uint8_t packet_type, uint32_t session_id) {
+  char buf[KCPPublicHeader::kPublicHeaderLength];
+  SendPacket(buf, sizeof(buf), packet_type, session_id);
+}
+
+void KCPClient::SendSynPacket(uint32_t session_id) {
+  char buf[KCPPublicHeader::kPublicHeaderLength + sizeof(uint8_t)];
+  buf[KCPPublicHeader::kPublicHeaderLength] =
+      static_cast<char>(LocalOptions());
+  SendPacket(buf, sizeof(buf), SYN_PACKET, session_id);
+}
+
+void KCPClient::SendPacket(const char* data, size_t length,
+                           uint8_t packet_type, uint32_t session_id) {
   assert(socket_->IsValidSocket());
+  assert(length >= KCPPublicHeader::kPublicHeaderLength);
 
-  char buf[KCPPublicHeader::kPublicHeaderLength];
-  KCPPendingSendPacket packet(buf, sizeof(buf));
+  // the checksum covers whatever follows the public header
+  KCPPendingSendPacket packet(const_cast<char*>(data), length);
   KCPPendingSendPacket::ErrorCode result =
       packet.WritePublicHeader(packet_type, session_id);
   if (result != KCPPendingSendPacket::SUCCESS) {
@@ -357,7 +481,7 @@ void KCPClient::SendPacket(uint8_t packet_type, uint32_t session_id) {
     return;
   }
 
-  int rc = socket_->Write(buf, sizeof(buf));
+  int rc = socket_->Write(data, length);
   if (rc < 0) {
     int saved_errno = -rc;
     LOG_ERROR << "Writer failed, packet_type: " << packet_type
@@ -368,20 +492,31 @@ void KCPClient::SendPacket(uint8_t packet_type, uint32_t session_id) {
   }
 }
 
-bool KCPClient::InitializeSession(KCPSessionPtr& session, uint32_t session_id) {
+bool KCPClient::InitializeSession(KCPSessionPtr& session, uint32_t session_id,
+                                  uint8_t options) {
   KCPSession::Params params = kFastModeKCPParams;
   params.head_room = KCPPublicHeader::kPublicHeaderLength;
+  params.sack = (options & SACK_OPTION) ? 1 : 0;
+  params.checksum_type = ChecksumTypeFromOptions(options);
+  params.fec = (options & FEC_OPTION) ? 1 : 0;
+  params.unordered = unordered_enabled_ ? 1 : 0;
+  params.datagram = (options & DATAGRAM_OPTION) ? 1 : 0;
+  params.migration = (options & MIGRATION_OPTION) ? 1 : 0;
 
   session->set_connection_callback(connection_callback_);
   session->set_message_callback(message_callback_);
   session->set_write_complete_callback(write_complete_callback_);
+  session->set_datagram_callback(datagram_callback_);
   // session->set_high_water_mark_callback(high_water_mark_callback_);
-  session->set_output_callback([this](void* data, size_t len,
-                                      uint32_t curr_session_id,
-                                      const muduo::net::InetAddress& address) {
+  KCPSession* s = session.get();
+  session->set_output_callback([this, s](
+                                   void* data, size_t len, uint8_t packet_type,
+                                   uint32_t curr_session_id,
+                                   const muduo::net::InetAddress& address) {
     KCPPendingSendPacket pending_send_packet(static_cast<char*>(data), len);
     KCPPendingSendPacket::ErrorCode result =
-        pending_send_packet.WritePublicHeader(DATA_PACKET, curr_session_id);
+        pending_send_packet.WritePublicHeader(packet_type, curr_session_id,
+                                              s->checksum_type());
     if (result != KCPPendingSendPacket::SUCCESS) {
       LOG_ERROR << "WritePublicHeader failed, session_id: " << curr_session_id
                 << ", address: " << address.toIpPort();
@@ -402,11 +537,14 @@ bool KCPClient::InitializeSession(KCPSessionPtr& session, uint32_t session_id) {
 
 void KCPClient::ProcessSynPacket(const KCPPublicHeader& public_header,
                                  KCPReceivedPacket& packet) {
-  assert(packet.RemainingBytes() == 0);
   assert(public_header.packet_type == SYN_PACKET);
   assert(public_header.session_id > 0);
 
-  UNUSED(packet);
+  // an old server echoes no options, a ticket follows them if resumption is
+  // among them
+  uint8_t options = 0;
+  packet.ReadUInt8(&options);
+  options &= LocalOptions();
 
   auto session_id = public_header.session_id;
   if (session_.get() != nullptr) {
@@ -433,12 +571,16 @@ void KCPClient::ProcessSynPacket(const KCPPublicHeader& public_header,
 
   // client can send data packet in "connection_callback_" as ack packet
   auto session = std::make_shared<KCPSession>(loop_);
-  if (!InitializeSession(session, session_id)) {
+  if (!InitializeSession(session, session_id, options)) {
     LOG_ERROR << "InitializeSession failed, session_id :" << session_id
               << ", server_address: " << server_address_.toIpPort();
     return;
   }
 
+  if (options & RESUMPTION_OPTION) {
+    StoreTicket(session_id, options, packet);
+  }
+
   session_ = std::move(session);
   pending_session_.reset();
   last_ping_time_ = muduo::Timestamp::now();
@@ -463,7 +605,15 @@ void KCPClient::ProcessRstPacket(const KCPPublicHeader& public_header,
   LOG_INFO << "received rst packet, server_address: "
            << server_address_.toIpPort() << ", session_id: " << session_id;
 
+  bool resumption_refused = resuming_;
   ResetSession();
+
+  // the ticket was the only thing wrong, the handshake follows at once
+  if (resumption_refused && reconnect_timer_registered_) {
+    loop_->cancel(reconnect_timer_);
+    reconnect_timer_registered_ = false;
+    BuildSession();
+  }
 }
 
 void KCPClient::ProcessPongPacket(const KCPPublicHeader& public_header,
@@ -506,10 +656,76 @@ void KCPClient::ProcessDataPacket(const KCPPublicHeader& public_header,
   LOG_DEBUG << "received data packet, server_address: "
             << server_address_.toIpPort() << ", session_id: " << session_id;
 
+  resuming_ = false;
   last_received_time_ = muduo::Timestamp::now();
   session_->ProcessPacket(packet, server_address_);
 }
 
+void KCPClient::ProcessDatagramPacket(const KCPPublicHeader& public_header,
+                                      KCPReceivedPacket& packet) {
+  assert(public_header.packet_type == DATAGRAM_PACKET);
+
+  auto session_id = public_header.session_id;
+  if (session_.get() == nullptr || session_->session_id() != session_id) {
+    LOG_DEBUG << "received datagram packet but session not exists, "
+                 "server_address: "
+              << server_address_.toIpPort() << ", session_id: " << session_id;
+    return;
+  }
+
+  last_received_time_ = muduo::Timestamp::now();
+  session_->ProcessDatagram(packet, server_address_);
+}
+
+void KCPClient::ProcessPathPacket(const KCPPublicHeader& public_header,
+                                  KCPReceivedPacket& packet) {
+  auto session_id = public_header.session_id;
+  if (session_.get() == nullptr || session_->session_id() != session_id) {
+    LOG_DEBUG << "received path packet but session not exists, "
+                 "server_address: "
+              << server_address_.toIpPort() << ", session_id: " << session_id;
+    return;
+  }
+
+  session_->ProcessPathPacket(public_header.packet_type, packet,
+                              server_address_);
+}
+
+void KCPClient::ProcessTicketPacket(const KCPPublicHeader& public_header,
+                                    KCPReceivedPacket& packet) {
+  assert(public_header.packet_type == TICKET_PACKET);
+
+  auto session_id = public_header.session_id;
+  if (session_.get() == nullptr || session_->session_id() != session_id) {
+    LOG_DEBUG << "received ticket packet but session not exists, "
+                 "server_address: "
+              << server_address_.toIpPort() << ", session_id: " << session_id;
+    return;
+  }
+
+  // the resumption has been taken up
+  resuming_ = false;
+  last_received_time_ = muduo::Timestamp::now();
+  StoreTicket(session_id, ticket_options_, packet);
+}
+
+void KCPClient::StoreTicket(uint32_t session_id, uint8_t options,
+                            KCPReceivedPacket& packet) {
+  uint32_t resume_session_id = 0;
+  if (packet.RemainingBytes() != KCPTicketCrypter::kIssuedTicketLength ||
+      !packet.ReadUInt32(&resume_session_id) || resume_session_id == 0) {
+    LOG_ERROR << "received malformed ticket, session_id: " << session_id;
+    return;
+  }
+
+  // opaque to the client
+  ticket_.assign(packet.RemainingData(), packet.RemainingBytes());
+  ticket_session_id_ = session_id;
+  ticket_resume_session_id_ = resume_session_id;
+  ticket_options_ = options;
+  ticket_received_time_ = muduo::Timestamp::now();
+}
+
 void KCPClient::ProcessPacket(KCPReceivedPacket& packet) {
   assert(packet.length() <= kMaxPacketSize);
 
@@ -522,6 +738,13 @@ void KCPClient::ProcessPacket(KCPReceivedPacket& packet) {
     return;
   }
 
+  if (public_header.checksum_type == NO_CHECKSUM &&
+      checksum_type_ != NO_CHECKSUM) {
+    LOG_ERROR << "received unchecked packet, server_address: "
+              << server_address_.toIpPort();
+    return;
+  }
+
   switch (public_header.packet_type) {
     case SYN_PACKET: {
       ProcessSynPacket(public_header, packet);
@@ -539,6 +762,19 @@ void KCPClient::ProcessPacket(KCPReceivedPacket& packet) {
       ProcessDataPacket(public_header, packet);
       break;
     }
+    case DATAGRAM_PACKET: {
+      ProcessDatagramPacket(public_header, packet);
+      break;
+    }
+    case PATH_CHALLENGE_PACKET:
+    case PATH_RESPONSE_PACKET: {
+      ProcessPathPacket(public_header, packet);
+      break;
+    }
+    case TICKET_PACKET: {
+      ProcessTicketPacket(public_header, packet);
+      break;
+    }
     default: {
       LOG_ERROR << "received unknown packet type: "
                 << public_header.packet_type;
@@ -6,6 +6,7 @@
 
 #include <functional>
 #include <memory>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -50,6 +51,11 @@ class KCPClient final {
 
   void Disconnect();
 
+  // carries the session on over a new socket once the local address has
+  // changed, such as the network of a mobile device, the server takes the
+  // new path without a handshake
+  int Rebind();
+
   void set_connection_callback(ConnectionCallback cb) {
     connection_callback_ = std::move(cb);
   }
@@ -62,6 +68,10 @@ class KCPClient final {
     write_complete_callback_ = std::move(cb);
   }
 
+  void set_datagram_callback(DatagramCallback cb) {
+    datagram_callback_ = std::move(cb);
+  }
+
   void set_error_message_callback(ErrorMessageCallback cb) {
     error_message_callback_ = std::move(cb);
   }
@@ -71,6 +81,46 @@ class KCPClient final {
   bool reconnect_enabled() const { return reconnect_enabled_; }
   void set_reconnect_enabled(bool enabled) { reconnect_enabled_ = enabled; }
 
+  // offer selective acks in the syn, used if the server agrees, must be set
+  // before Connect
+  bool sack_enabled() const { return sack_enabled_; }
+  void set_sack_enabled(bool enabled) { sack_enabled_ = enabled; }
+
+  // offer parity packets in the syn, used if the server agrees, for lossy
+  // links, must be set before Connect
+  bool fec_enabled() const { return fec_enabled_; }
+  void set_fec_enabled(bool enabled) { fec_enabled_ = enabled; }
+
+  // offer datagrams in the syn, see KCPSession::SendDatagram, must be set
+  // before Connect
+  bool datagram_enabled() const { return datagram_enabled_; }
+  void set_datagram_enabled(bool enabled) { datagram_enabled_ = enabled; }
+
+  // offer path validation in the syn, a server which agrees only takes a
+  // new address of the client once it has answered a challenge from there,
+  // must be set before Connect
+  bool migration_enabled() const { return migration_enabled_; }
+  void set_migration_enabled(bool enabled) { migration_enabled_ = enabled; }
+
+  // offer resumption in the syn, a server which agrees hands out tickets
+  // with which the client takes the session up again after a reset without
+  // a handshake, the data goes along in the first flight, must be set before
+  // Connect
+  bool resumption_enabled() const { return resumption_enabled_; }
+  void set_resumption_enabled(bool enabled) { resumption_enabled_ = enabled; }
+
+  // hand the messages over as they arrive, for a KCPStreamMux over the
+  // session, must be set before Connect
+  bool unordered_enabled() const { return unordered_enabled_; }
+  void set_unordered_enabled(bool enabled) { unordered_enabled_ = enabled; }
+
+  // asked for in the syn, the data packets fall back to adler32 unless the
+  // server agrees, must be set before Connect
+  KCPChecksumType checksum_type() const { return checksum_type_; }
+  void set_checksum_type(KCPChecksumType checksum_type) {
+    checksum_type_ = checksum_type;
+  }
+
  private:
   void set_state(State state) { state_ = state; }
 
@@ -79,12 +129,20 @@ class KCPClient final {
   void HandleWrite();
   void HandleError();
 
+  int CreateSocket(const muduo::net::InetAddress& address,
+                   std::unique_ptr<UDPSocket>* socket);
+  void CreateChannel();
+  void RemoveChannel();
+
   void BuildSession();
+  // with the ticket of the server, false to fall back to the handshake
+  bool ResumeSession();
   void ResetSession();
   void Reconnect();
   void RunPeriodicTask();
 
-  bool InitializeSession(KCPSessionPtr& session, uint32_t session_id);
+  bool InitializeSession(KCPSessionPtr& session, uint32_t session_id,
+                         uint8_t options);
 
   void ProcessPacket(KCPReceivedPacket& packet);
 
@@ -96,8 +154,29 @@ class KCPClient final {
                          KCPReceivedPacket& packet);
   void ProcessDataPacket(const KCPPublicHeader& public_header,
                          KCPReceivedPacket& packet);
+  void ProcessDatagramPacket(const KCPPublicHeader& public_header,
+                             KCPReceivedPacket& packet);
+  void ProcessPathPacket(const KCPPublicHeader& public_header,
+                         KCPReceivedPacket& packet);
+  void ProcessTicketPacket(const KCPPublicHeader& public_header,
+                           KCPReceivedPacket& packet);
+  // the resume_session_id and the ticket which follow the header
+  void StoreTicket(uint32_t session_id, uint8_t options,
+                   KCPReceivedPacket& packet);
 
   void SendPacket(uint8_t packet_type, uint32_t session_id);
+  // a syn followed by the KCPSessionOption bits offered
+  void SendSynPacket(uint32_t session_id);
+  uint8_t LocalOptions() const {
+    return static_cast<uint8_t>((sack_enabled_ ? SACK_OPTION : 0) |
+                                (fec_enabled_ ? FEC_OPTION : 0) |
+                                (datagram_enabled_ ? DATAGRAM_OPTION : 0) |
+                                (migration_enabled_ ? MIGRATION_OPTION : 0) |
+                                (resumption_enabled_ ? RESUMPTION_OPTION : 0) |
+                                ChecksumTypeToOption(checksum_type_));
+  }
+  void SendPacket(const char* data, size_t length, uint8_t packet_type,
+                  uint32_t session_id);
   void SendDataToWire(const KCPPendingSendPacket& packet,
                       const muduo::net::InetAddress& address);
 
@@ -119,15 +198,37 @@ class KCPClient final {
   State state_{CLOSED};
 
   bool reconnect_enabled_{false};
+  bool sack_enabled_{true};
+  bool fec_enabled_{false};
+  bool unordered_enabled_{false};
+  bool datagram_enabled_{true};
+  bool migration_enabled_{true};
+  bool resumption_enabled_{true};
+  KCPChecksumType checksum_type_{CRC32C_CHECKSUM};
   bool reconnect_timer_registered_{false};
   int reconnect_times_{0};
   int async_error_times_{0};
   muduo::net::TimerId reconnect_timer_;
 
+  // the last ticket of the server, empty once spent on a resumption
+  std::string ticket_;
+  uint32_t ticket_session_id_{0};
+  // a fresh one the server handed out with the ticket, the session resumed
+  // runs under it
+  uint32_t ticket_resume_session_id_{0};
+  // agreed on for the session of the ticket
+  uint8_t ticket_options_{0};
+  muduo::Timestamp ticket_received_time_;
+  // resumed but nothing heard of the server yet, a rst means the ticket was
+  // refused
+  bool resuming_{false};
+
   ConnectionCallback connection_callback_;
 
   MessageCallback message_callback_;
 
+  DatagramCallback datagram_callback_;
+
   WriteCompleteCallback write_complete_callback_;
 
   ErrorMessageCallback error_message_callback_;
@@ -19,6 +19,38 @@ const int kNumPacketsPerRead = 16;  // <= 16 * kMaxPacketSize
 
 const int kNumPacketsPerSend = 32;  // <= 32 * kMaxPacketSize
 
+const int kNumTxBacklogPackets = 256;  // ~350 KB per thread
+
+const int kNumPacketsPerPool = 1024;  // ~1.4 MB per server socket
+
+const int kSegmentPoolSmallSize = 128;  // payload of the small size class
+
+const int kMaxCachedSegmentsPerThread = 2048;  // ~3 MB of the MSS class
+
+const int kMaxGROPacketSize = 65535;  // coalesced by udp gro
+
+const int kNumGROPacketsPerPool = 128;  // ~8 MB per server socket
+
+const int kFecMaxDataShards = 16;
+
+const int kFecMaxParityShards = 8;
+
+const int kFecNumDecodeGroups = 4;  // groups a shard may arrive late for
+
+const int kFecAdaptWindow = 64;  // segments delivered per adaptation
+
+const int kStreamWindow = 64 * kMaxPacketSize;  // ~90 KB per stream
+
+const int kStreamDefaultWeight = 16;
+
+const int kStreamMaxWeight = 256;
+
+const int kStreamQuantum = 256;  // bytes per round and unit of weight
+
+const int kPathChallengeIntervalMs = 200;  // a challenge unanswered is resent
+
+const int kTicketKeyRotationSeconds = 3600;  // and the lifetime of a ticket
+
 const int kServerMaxSynRetryTimes = 10;
 
 const double kServerSynSentTimeout = 2.0;  // 2s
@@ -33,6 +65,8 @@ const int kServerMaxWaitSessionClosedTryTimes = 100000;
 
 const int kServerMaxGenSessionIdTryTimes = 20;
 
+const int kServerNumSessionTableStripes = 64;
+
 const int kClientMaxSynRetryTimes = 30;
 
 const double kClientRunPeriodicTaskInterval = 2.0;  // 2s
@@ -45,6 +79,8 @@ const double kClientMaxReconnectDelay = 3.0;  // 3s
 
 const double kClientPingInterval = 5.0;  // 5s
 
+const double kClientTicketRefreshSeconds = 600.0;  // asked for along a ping
+
 const int kMaxAncillaryDataLength = 1024;
 
 #pragma GCC diagnostic error "-Wunused"
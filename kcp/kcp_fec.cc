@@ -0,0 +1,539 @@
+
+#include "kcp_fec.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+const size_t KCPFecHeader::kFecHeaderLength;
+const size_t KCPFecHeader::kShardLengthSize;
+const size_t KCPFecHeader::kFecHeadRoom;
+
+namespace {
+
+// x^8 + x^4 + x^3 + x^2 + 1, 2 generates the field
+const unsigned int kGaloisPolynomial = 0x11D;
+
+struct GaloisTables {
+  GaloisTables() {
+    unsigned int x = 1;
+    for (int i = 0; i < 255; ++i) {
+      exp[i] = exp[i + 255] = static_cast<uint8_t>(x);
+      log[x] = static_cast<uint8_t>(i);
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= kGaloisPolynomial;
+      }
+    }
+    exp[510] = exp[511] = 0;
+    log[0] = 0;
+
+    for (int a = 0; a < 256; ++a) {
+      for (int b = 0; b < 256; ++b) {
+        mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+      }
+    }
+
+    // a product is the sum of the products of the two nibbles of b
+    for (int c = 0; c < 256; ++c) {
+      for (int n = 0; n < 16; ++n) {
+        low[c][n] = mul[c][n];
+        high[c][n] = mul[c][n << 4];
+      }
+    }
+  }
+
+  uint8_t exp[512];
+  uint8_t log[256];
+  uint8_t mul[256][256];
+  alignas(16) uint8_t low[256][16];
+  alignas(16) uint8_t high[256][16];
+};
+
+const GaloisTables kGalois;
+
+inline uint8_t GaloisMul(uint8_t a, uint8_t b) { return kGalois.mul[a][b]; }
+
+inline uint8_t GaloisInv(uint8_t a) {
+  assert(a != 0);
+  return kGalois.exp[255 - kGalois.log[a]];
+}
+
+void MulAddSoftware(uint8_t c, const uint8_t* src, uint8_t* dst, size_t len) {
+  const uint8_t* row = kGalois.mul[c];
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] ^= row[src[i]];
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) void MulAddSsse3(uint8_t c, const uint8_t* src,
+                                                  uint8_t* dst, size_t len) {
+  const __m128i low = _mm_load_si128(
+      reinterpret_cast<const __m128i*>(kGalois.low[c]));
+  const __m128i high = _mm_load_si128(
+      reinterpret_cast<const __m128i*>(kGalois.high[c]));
+  const __m128i mask = _mm_set1_epi8(0x0F);
+
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    __m128i lo = _mm_and_si128(x, mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi64(x, 4), mask);
+    __m128i product =
+        _mm_xor_si128(_mm_shuffle_epi8(low, lo), _mm_shuffle_epi8(high, hi));
+    __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+    _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), product));
+  }
+
+  MulAddSoftware(c, src + i, dst + i, len - i);
+}
+
+__attribute__((target("avx2"))) void MulAddAvx2(uint8_t c, const uint8_t* src,
+                                                uint8_t* dst, size_t len) {
+  const __m256i low = _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(kGalois.low[c])));
+  const __m256i high = _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(kGalois.high[c])));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i lo = _mm256_and_si256(x, mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi64(x, 4), mask);
+    __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, lo),
+                                       _mm256_shuffle_epi8(high, hi));
+    __m256i* out = reinterpret_cast<__m256i*>(dst + i);
+    _mm256_storeu_si256(out, _mm256_xor_si256(_mm256_loadu_si256(out), product));
+  }
+
+  MulAddSoftware(c, src + i, dst + i, len - i);
+}
+#endif
+
+using MulAddFunc = void (*)(uint8_t, const uint8_t*, uint8_t*, size_t);
+
+MulAddFunc SelectMulAdd() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return MulAddAvx2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return MulAddSsse3;
+  }
+#endif
+  return MulAddSoftware;
+}
+
+const MulAddFunc kMulAdd = SelectMulAdd();
+
+// row data_shards + i of the encoding matrix below the identity, any square
+// submatrix of a cauchy matrix is invertible
+inline uint8_t CauchyCoefficient(int data_shards, int i, int j) {
+  return GaloisInv(static_cast<uint8_t>((data_shards + i) ^ j));
+}
+
+// gauss-jordan, |m| is destroyed
+bool InvertMatrix(uint8_t m[][kFecMaxDataShards],
+                  uint8_t inv[][kFecMaxDataShards], int n) {
+  for (int r = 0; r < n; ++r) {
+    for (int c = 0; c < n; ++c) {
+      inv[r][c] = (r == c) ? 1 : 0;
+    }
+  }
+
+  for (int c = 0; c < n; ++c) {
+    int pivot = c;
+    while (pivot < n && m[pivot][c] == 0) {
+      ++pivot;
+    }
+    if (pivot == n) {
+      return false;
+    }
+    if (pivot != c) {
+      for (int k = 0; k < n; ++k) {
+        std::swap(m[pivot][k], m[c][k]);
+        std::swap(inv[pivot][k], inv[c][k]);
+      }
+    }
+
+    uint8_t scale = GaloisInv(m[c][c]);
+    for (int k = 0; k < n; ++k) {
+      m[c][k] = GaloisMul(m[c][k], scale);
+      inv[c][k] = GaloisMul(inv[c][k], scale);
+    }
+
+    for (int r = 0; r < n; ++r) {
+      uint8_t factor = m[r][c];
+      if (r == c || factor == 0) {
+        continue;
+      }
+      for (int k = 0; k < n; ++k) {
+        m[r][k] ^= GaloisMul(factor, m[c][k]);
+        inv[r][k] ^= GaloisMul(factor, inv[c][k]);
+      }
+    }
+  }
+
+  return true;
+}
+
+struct FecShape {
+  int data_shards;
+  int parity_shards;
+};
+
+// from the least to the most redundant, a level is dropped after some
+// windows without a retransmission and raised once more than 2% of the
+// delivered segments had to be retransmitted
+const FecShape kFecShapes[] = {{10, 1}, {8, 2}, {6, 2}, {5, 3}, {4, 4}};
+const int kFecNumLevels = static_cast<int>(arraysize(kFecShapes));
+const int kFecInitialLevel = 1;
+const int kFecQuietWindowsPerLevel = 4;
+
+}  // namespace
+
+void KCPGaloisMulAdd(uint8_t c, const uint8_t* src, uint8_t* dst, size_t len) {
+  kMulAdd(c, src, dst, len);
+}
+
+const char* KCPGaloisKernelName() {
+#if defined(__x86_64__)
+  if (kMulAdd == MulAddAvx2) {
+    return "avx2";
+  }
+  if (kMulAdd == MulAddSsse3) {
+    return "ssse3";
+  }
+#endif
+  return "table";
+}
+
+bool KCPFecHeader::ReadFrom(const char* buf, size_t length) {
+  assert(buf != nullptr);
+
+  if (length < kFecHeaderLength) {
+    return false;
+  }
+
+  // le16
+  memcpy(&group_id, buf, sizeof(group_id));
+  group_id = le16toh(group_id);
+  size_t offset = sizeof(group_id);
+
+  shard_index = static_cast<uint8_t>(buf[offset++]);
+  data_shards = static_cast<uint8_t>(buf[offset++]);
+  parity_shards = static_cast<uint8_t>(buf[offset++]);
+
+  return true;
+}
+
+bool KCPFecHeader::WriteTo(char* buf, size_t length) const {
+  assert(buf != nullptr);
+
+  if (length < kFecHeaderLength) {
+    return false;
+  }
+
+  uint16_t le16 = htole16(group_id);
+  memcpy(buf, &le16, sizeof(le16));
+  size_t offset = sizeof(le16);
+
+  buf[offset++] = static_cast<char>(shard_index);
+  buf[offset++] = static_cast<char>(data_shards);
+  buf[offset++] = static_cast<char>(parity_shards);
+
+  return true;
+}
+
+KCPFecEncoder::KCPFecEncoder(size_t max_shard_size)
+    : max_shard_size_(max_shard_size),
+      data_(new uint8_t[kFecMaxDataShards * max_shard_size]),
+      parity_(new uint8_t[kFecMaxParityShards * max_shard_size]),
+      level_(kFecInitialLevel),
+      group_data_shards_(kFecShapes[kFecInitialLevel].data_shards),
+      group_parity_shards_(kFecShapes[kFecInitialLevel].parity_shards) {
+  assert(max_shard_size > KCPFecHeader::kShardLengthSize &&
+         max_shard_size <= UINT16_MAX);
+}
+
+bool KCPFecEncoder::AddDataShard(char* buf, size_t data_length) {
+  assert(num_data_shards_ < group_data_shards_);
+
+  KCPFecHeader header;
+  header.group_id = group_id_;
+  header.shard_index = static_cast<uint8_t>(num_data_shards_);
+  header.data_shards = static_cast<uint8_t>(group_data_shards_);
+  header.parity_shards = static_cast<uint8_t>(group_parity_shards_);
+  header.WriteTo(buf, KCPFecHeader::kFecHeaderLength);
+
+  char* shard = buf + KCPFecHeader::kFecHeaderLength;
+  uint16_t le16 = htole16(static_cast<uint16_t>(data_length));
+  memcpy(shard, &le16, sizeof(le16));
+
+  size_t shard_size = KCPFecHeader::kShardLengthSize + data_length;
+  assert(shard_size <= max_shard_size_);
+
+  auto index = static_cast<size_t>(num_data_shards_);
+  memcpy(data_.get() + index * max_shard_size_, shard, shard_size);
+  lengths_[index] = shard_size;
+
+  ++num_data_shards_;
+  return num_data_shards_ == group_data_shards_;
+}
+
+void KCPFecEncoder::WriteUnprotected(char* buf, size_t data_length) {
+  KCPFecHeader header;
+  header.WriteTo(buf, KCPFecHeader::kFecHeaderLength);
+
+  uint16_t le16 = htole16(static_cast<uint16_t>(data_length));
+  memcpy(buf + KCPFecHeader::kFecHeaderLength, &le16, sizeof(le16));
+}
+
+int KCPFecEncoder::EncodeParity() {
+  if (num_data_shards_ == 0) {
+    return 0;
+  }
+
+  size_t shard_size = 0;
+  for (int j = 0; j < num_data_shards_; ++j) {
+    shard_size = std::max(shard_size, lengths_[j]);
+  }
+
+  // shorter shards count as padded with zeros
+  for (int j = 0; j < num_data_shards_; ++j) {
+    uint8_t* data = data_.get() + static_cast<size_t>(j) * max_shard_size_;
+    memset(data + lengths_[j], 0, shard_size - lengths_[j]);
+  }
+
+  for (int i = 0; i < group_parity_shards_; ++i) {
+    uint8_t* parity = parity_.get() + static_cast<size_t>(i) * max_shard_size_;
+    memset(parity, 0, shard_size);
+    for (int j = 0; j < num_data_shards_; ++j) {
+      kMulAdd(CauchyCoefficient(num_data_shards_, i, j),
+              data_.get() + static_cast<size_t>(j) * max_shard_size_, parity,
+              shard_size);
+    }
+  }
+
+  parity_group_id_ = group_id_;
+  parity_data_shards_ = num_data_shards_;
+  num_parity_shards_ = group_parity_shards_;
+  parity_shard_size_ = shard_size;
+
+  ++group_id_;
+  num_data_shards_ = 0;
+  group_data_shards_ = kFecShapes[level_].data_shards;
+  group_parity_shards_ = kFecShapes[level_].parity_shards;
+
+  return num_parity_shards_;
+}
+
+size_t KCPFecEncoder::WriteParityPacket(int index, char* buf) const {
+  assert(index >= 0 && index < num_parity_shards_);
+
+  KCPFecHeader header;
+  header.group_id = parity_group_id_;
+  header.shard_index = static_cast<uint8_t>(parity_data_shards_ + index);
+  header.data_shards = static_cast<uint8_t>(parity_data_shards_);
+  header.parity_shards = static_cast<uint8_t>(num_parity_shards_);
+  header.WriteTo(buf, KCPFecHeader::kFecHeaderLength);
+
+  memcpy(buf + KCPFecHeader::kFecHeaderLength,
+         parity_.get() + static_cast<size_t>(index) * max_shard_size_,
+         parity_shard_size_);
+
+  return KCPFecHeader::kFecHeaderLength + parity_shard_size_;
+}
+
+void KCPFecEncoder::Adapt(uint32_t delivered, uint32_t retransmits) {
+  uint32_t window_delivered = delivered - delivered_base_;
+  if (window_delivered < static_cast<uint32_t>(kFecAdaptWindow)) {
+    return;
+  }
+
+  uint32_t window_retransmits = retransmits - retransmits_base_;
+  delivered_base_ = delivered;
+  retransmits_base_ = retransmits;
+
+  if (window_retransmits * 50 > window_delivered) {
+    quiet_windows_ = 0;
+    level_ = std::min(level_ + 1, kFecNumLevels - 1);
+  } else if (window_retransmits > 0) {
+    quiet_windows_ = 0;
+  } else if (++quiet_windows_ >= kFecQuietWindowsPerLevel) {
+    quiet_windows_ = 0;
+    level_ = std::max(level_ - 1, 0);
+  }
+}
+
+int KCPFecEncoder::data_shards() const { return group_data_shards_; }
+
+int KCPFecEncoder::parity_shards() const { return group_parity_shards_; }
+
+KCPFecDecoder::KCPFecDecoder(size_t max_shard_size)
+    : max_shard_size_(max_shard_size) {}
+
+int KCPFecDecoder::AddShard(const KCPFecHeader& header, const char* shard,
+                            size_t length, Shard* recovered) {
+  assert(shard != nullptr && recovered != nullptr);
+
+  int num_shards = header.data_shards + header.parity_shards;
+  if (header.data_shards == 0 || header.data_shards > kFecMaxDataShards ||
+      header.parity_shards > kFecMaxParityShards ||
+      header.shard_index >= num_shards ||
+      length < KCPFecHeader::kShardLengthSize || length > max_shard_size_) {
+    return 0;
+  }
+
+  Group* group = &groups_[header.group_id % kFecNumDecodeGroups];
+  if (group->active && group->group_id != header.group_id) {
+    // a shard of a group long given up
+    if (static_cast<int16_t>(header.group_id - group->group_id) < 0) {
+      return 0;
+    }
+    group->active = false;
+  }
+
+  if (!group->active) {
+    if (!group->shards) {
+      group->shards.reset(new uint8_t[static_cast<size_t>(
+          kFecMaxDataShards + kFecMaxParityShards) * max_shard_size_]);
+    }
+    group->group_id = header.group_id;
+    group->active = true;
+    group->done = false;
+    group->shape_known = false;
+    group->data_shards = header.data_shards;
+    group->parity_shards = header.parity_shards;
+    group->present = 0;
+  }
+
+  if (group->done) {
+    return 0;
+  }
+
+  bool is_parity = header.shard_index >= header.data_shards;
+  if (is_parity) {
+    if (!group->shape_known) {
+      // the group may have been closed before it was full, the shards beyond
+      // its actual size can not be data shards of it
+      group->data_shards = header.data_shards;
+      group->parity_shards = header.parity_shards;
+      group->present &= (1u << header.data_shards) - 1;
+      group->shape_known = true;
+    } else if (group->data_shards != header.data_shards ||
+               group->parity_shards != header.parity_shards) {
+      return 0;
+    }
+  } else if (header.shard_index >= group->data_shards) {
+    return 0;
+  }
+
+  uint32_t bit = 1u << header.shard_index;
+  if (group->present & bit) {
+    return 0;
+  }
+
+  memcpy(ShardAt(group, header.shard_index), shard, length);
+  group->lengths[header.shard_index] = length;
+  group->present |= bit;
+
+  uint32_t data_mask = (1u << group->data_shards) - 1;
+  if ((group->present & data_mask) == data_mask) {
+    group->done = true;
+    return 0;
+  }
+
+  if (!group->shape_known ||
+      __builtin_popcount(group->present) < group->data_shards) {
+    return 0;
+  }
+
+  return Rebuild(group, recovered);
+}
+
+int KCPFecDecoder::Rebuild(Group* group, Shard* recovered) {
+  int data_shards = group->data_shards;
+  int num_shards = data_shards + group->parity_shards;
+
+  // the parity shards are as long as the longest data shard
+  size_t shard_size = 0;
+  int rows[kFecMaxDataShards];
+  int num_rows = 0;
+  for (int index = 0; index < num_shards && num_rows < data_shards; ++index) {
+    if (group->present & (1u << index)) {
+      rows[num_rows++] = index;
+      if (index >= data_shards) {
+        shard_size = group->lengths[index];
+      }
+    }
+  }
+  assert(num_rows == data_shards && shard_size > 0);
+
+  uint8_t matrix[kFecMaxDataShards][kFecMaxDataShards];
+  for (int r = 0; r < data_shards; ++r) {
+    int index = rows[r];
+    if (index < data_shards) {
+      for (int c = 0; c < data_shards; ++c) {
+        matrix[r][c] = (c == index) ? 1 : 0;
+      }
+    } else {
+      for (int c = 0; c < data_shards; ++c) {
+        matrix[r][c] = CauchyCoefficient(data_shards, index - data_shards, c);
+      }
+    }
+
+    // shorter shards count as padded with zeros
+    size_t length = group->lengths[index];
+    if (length > shard_size) {
+      group->done = true;
+      return 0;
+    }
+    memset(ShardAt(group, index) + length, 0, shard_size - length);
+  }
+
+  uint8_t inverse[kFecMaxDataShards][kFecMaxDataShards];
+  if (!InvertMatrix(matrix, inverse, data_shards)) {
+    group->done = true;
+    return 0;
+  }
+
+  int num_recovered = 0;
+  for (int j = 0; j < data_shards; ++j) {
+    if (group->present & (1u << j)) {
+      continue;
+    }
+
+    uint8_t* shard = ShardAt(group, j);
+    memset(shard, 0, shard_size);
+    for (int r = 0; r < data_shards; ++r) {
+      if (inverse[j][r] != 0) {
+        kMulAdd(inverse[j][r], ShardAt(group, rows[r]), shard, shard_size);
+      }
+    }
+
+    uint16_t data_length;
+    memcpy(&data_length, shard, sizeof(data_length));
+    data_length = le16toh(data_length);
+    if (KCPFecHeader::kShardLengthSize + data_length > shard_size) {
+      continue;
+    }
+
+    recovered[num_recovered].data =
+        reinterpret_cast<const char*>(shard) + KCPFecHeader::kShardLengthSize;
+    recovered[num_recovered].length = data_length;
+    ++num_recovered;
+  }
+
+  group->done = true;
+  num_recovered_shards_ += static_cast<uint64_t>(num_recovered);
+  return num_recovered;
+}
@@ -0,0 +1,155 @@
+
+#ifndef KCP_FEC_H_
+#define KCP_FEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "common/macros.h"
+
+#include "kcp_constants.h"
+
+// forward error correction of the data packets, each group of data shards is
+// followed by parity shards of a systematic reed-solomon code over GF(2^8)
+// with a cauchy matrix, any data shards of the group can be rebuilt from as
+// many parity shards
+//
+// the sub header follows KCPPublicHeader, the shard follows it:
+//
+// +----------+-------------+-------------+---------------+--------+------+
+// | group_id | shard_index | data_shards | parity_shards | length | data |
+// +----------+-------------+-------------+---------------+--------+------+
+//     le16        uint8         uint8          uint8        le16
+//
+// length is the size of the data of a data shard so that a rebuilt one knows
+// it, a parity shard carries the parity of the lengths there instead, a
+// packet of no group, such as one of acks only, has data_shards 0
+struct KCPFecHeader {
+  bool ReadFrom(const char* buf, size_t length);
+  bool WriteTo(char* buf, size_t length) const;
+
+  uint16_t group_id{0};
+  uint8_t shard_index{0};
+  uint8_t data_shards{0};
+  uint8_t parity_shards{0};
+
+  static const size_t kFecHeaderLength =
+      sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t);
+  static const size_t kShardLengthSize = sizeof(uint16_t);
+  // reserved in front of the data of a packet
+  static const size_t kFecHeadRoom = kFecHeaderLength + kShardLengthSize;
+};
+
+// dst ^= c * src, with the avx2 or ssse3 shuffles if the cpu has them
+void KCPGaloisMulAdd(uint8_t c, const uint8_t* src, uint8_t* dst, size_t len);
+// "avx2", "ssse3" or "table"
+const char* KCPGaloisKernelName();
+
+class KCPFecEncoder final {
+ public:
+  // |max_shard_size| includes the length field
+  explicit KCPFecEncoder(size_t max_shard_size);
+
+  // writes the sub header of the next data shard to |buf|, followed by the
+  // length of the |data_length| bytes of data after it, returns true once the
+  // group is complete
+  bool AddDataShard(char* buf, size_t data_length);
+
+  // the sub header of a packet of no group, not kept for parity
+  static void WriteUnprotected(char* buf, size_t data_length);
+
+  bool HasPendingShards() const { return num_data_shards_ > 0; }
+
+  // parity of the data shards added so far, which may be fewer than the
+  // group was begun with, the next group is begun in the shape adapted to
+  // the loss, returns the number of parity shards
+  int EncodeParity();
+
+  // the sub header and the parity shard |index| of the last EncodeParity,
+  // returns the bytes written to |buf|
+  size_t WriteParityPacket(int index, char* buf) const;
+
+  // residual loss, the segments retransmitted although protected, over the
+  // segments delivered, both counted since the session began
+  void Adapt(uint32_t delivered, uint32_t retransmits);
+
+  int data_shards() const;
+  int parity_shards() const;
+
+ private:
+  const size_t max_shard_size_{0};
+
+  std::unique_ptr<uint8_t[]> data_;
+  std::unique_ptr<uint8_t[]> parity_;
+  size_t lengths_[kFecMaxDataShards];
+
+  uint16_t group_id_{0};
+  int num_data_shards_{0};
+  // shape of the group being filled
+  int level_{0};
+  int group_data_shards_{0};
+  int group_parity_shards_{0};
+
+  // of the last EncodeParity
+  uint16_t parity_group_id_{0};
+  int parity_data_shards_{0};
+  int num_parity_shards_{0};
+  size_t parity_shard_size_{0};
+
+  uint32_t delivered_base_{0};
+  uint32_t retransmits_base_{0};
+  int quiet_windows_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(KCPFecEncoder);
+};
+
+class KCPFecDecoder final {
+ public:
+  // data of a rebuilt data shard
+  struct Shard {
+    const char* data{nullptr};
+    size_t length{0};
+  };
+
+  explicit KCPFecDecoder(size_t max_shard_size);
+
+  // |shard| is what follows the sub header, fills in |recovered| with at most
+  // kFecMaxDataShards data shards of the group rebuilt with it, valid until
+  // the next call, returns their number
+  int AddShard(const KCPFecHeader& header, const char* shard, size_t length,
+               Shard* recovered);
+
+  uint64_t num_recovered_shards() const { return num_recovered_shards_; }
+
+ private:
+  struct Group {
+    uint16_t group_id{0};
+    bool active{false};
+    // all of its data shards are here
+    bool done{false};
+    // data_shards is only final once a parity shard has told it
+    bool shape_known{false};
+    uint8_t data_shards{0};
+    uint8_t parity_shards{0};
+    // bit per shard index
+    uint32_t present{0};
+    size_t lengths[kFecMaxDataShards + kFecMaxParityShards];
+    std::unique_ptr<uint8_t[]> shards;
+  };
+
+  uint8_t* ShardAt(Group* group, int index) const {
+    return group->shards.get() + static_cast<size_t>(index) * max_shard_size_;
+  }
+
+  int Rebuild(Group* group, Shard* recovered);
+
+  const size_t max_shard_size_{0};
+  Group groups_[kFecNumDecodeGroups];
+  uint64_t num_recovered_shards_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(KCPFecDecoder);
+};
+
+#endif
@@ -0,0 +1,98 @@
+
+#include "kcp_packet_pool.h"
+
+#include <assert.h>
+
+#include <utility>
+
+#include <muduo/base/Logging.h>
+
+KCPPacketRef::KCPPacketRef(const KCPPacketRef& other) : slot_(other.slot_) {
+  if (slot_ != nullptr) {
+    slot_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+KCPPacketRef::KCPPacketRef(KCPPacketRef&& other) noexcept
+    : slot_(other.slot_) {
+  other.slot_ = nullptr;
+}
+
+KCPPacketRef::~KCPPacketRef() { reset(); }
+
+KCPPacketRef& KCPPacketRef::operator=(KCPPacketRef other) noexcept {
+  swap(other);
+  return *this;
+}
+
+void KCPPacketRef::reset() {
+  if (slot_ == nullptr) {
+    return;
+  }
+
+  // the buffer written by one thread must be visible before it is reused
+  if (slot_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    slot_->pool->Release(slot_);
+  }
+  slot_ = nullptr;
+}
+
+void KCPPacketRef::swap(KCPPacketRef& other) noexcept {
+  std::swap(slot_, other.slot_);
+}
+
+KCPPacketPool::KCPPacketPool(size_t num_slots, size_t slot_size)
+    : num_slots_(num_slots),
+      slot_size_(slot_size),
+      slots_(std::make_unique<KCPPacketSlot[]>(num_slots)),
+      // not value initialized, the kernel writes it
+      slab_(new char[num_slots * slot_size]) {
+  free_slots_.reserve(num_slots_);
+  released_slots_.reserve(num_slots_);
+
+  for (size_t i = 0; i < num_slots_; ++i) {
+    KCPPacketSlot* slot = &slots_[i];
+    slot->buf = slab_.get() + i * slot_size_;
+    slot->capacity = slot_size_;
+    slot->iov.iov_base = slot->buf;
+    slot->iov.iov_len = slot->capacity;
+    slot->pool = this;
+    free_slots_.push_back(slot);
+  }
+}
+
+KCPPacketPool::~KCPPacketPool() {
+  muduo::MutexLockGuard lock(mutex_);
+  size_t num_free_slots = free_slots_.size() + released_slots_.size();
+  if (num_free_slots != num_slots_) {
+    LOG_ERROR << "~KCPPacketPool there are still "
+              << num_slots_ - num_free_slots << " slots in use";
+  }
+}
+
+KCPPacketRef KCPPacketPool::Acquire() {
+  if (free_slots_.empty()) {
+    muduo::MutexLockGuard lock(mutex_);
+    free_slots_.swap(released_slots_);
+  }
+
+  if (free_slots_.empty()) {
+    return KCPPacketRef();
+  }
+
+  KCPPacketSlot* slot = free_slots_.back();
+  free_slots_.pop_back();
+
+  assert(slot->refs.load(std::memory_order_relaxed) == 0);
+  slot->refs.store(1, std::memory_order_relaxed);
+  slot->length = 0;
+
+  return KCPPacketRef(slot);
+}
+
+void KCPPacketPool::Release(KCPPacketSlot* slot) {
+  assert(slot->pool == this);
+
+  muduo::MutexLockGuard lock(mutex_);
+  released_slots_.push_back(slot);
+}
@@ -0,0 +1,96 @@
+
+#ifndef KCP_PACKET_POOL_H_
+#define KCP_PACKET_POOL_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <muduo/base/Mutex.h>
+#include <muduo/net/InetAddress.h>
+
+#include "common/macros.h"
+
+class KCPPacketPool;
+
+// a receive buffer of KCPPacketPool, filled by the loop that reads the socket
+// and possibly consumed by the loop of the session it belongs to
+struct KCPPacketSlot {
+  struct iovec iov;
+  struct sockaddr_storage addr;
+  // points into the slab of the pool, a datagram filling it up was truncated
+  char* buf{nullptr};
+  size_t capacity{0};
+
+  size_t length{0};
+  muduo::net::InetAddress peer_address;
+
+  std::atomic<int> refs{0};
+  KCPPacketPool* pool{nullptr};
+};
+
+// intrusive reference to a slot, the last one returns it to its pool,
+// copyable so that it can be captured by a muduo Functor
+class KCPPacketRef final {
+ public:
+  KCPPacketRef() = default;
+  KCPPacketRef(const KCPPacketRef& other);
+  KCPPacketRef(KCPPacketRef&& other) noexcept;
+  ~KCPPacketRef();
+
+  KCPPacketRef& operator=(KCPPacketRef other) noexcept;
+
+  KCPPacketSlot* get() const { return slot_; }
+  KCPPacketSlot* operator->() const { return slot_; }
+  explicit operator bool() const { return slot_ != nullptr; }
+
+  void reset();
+  void swap(KCPPacketRef& other) noexcept;
+
+ private:
+  friend class KCPPacketPool;
+
+  // adopts the first reference
+  explicit KCPPacketRef(KCPPacketSlot* slot) : slot_(slot) {}
+
+  KCPPacketSlot* slot_{nullptr};
+};
+
+// fixed number of slots allocated once, Acquire is called by the owner loop
+// only while slots may be released by any thread
+class KCPPacketPool final {
+ public:
+  KCPPacketPool(size_t num_slots, size_t slot_size);
+  // all slots must have been returned
+  ~KCPPacketPool();
+
+  // empty if all slots are in use
+  KCPPacketRef Acquire();
+
+  size_t num_slots() const { return num_slots_; }
+  size_t slot_size() const { return slot_size_; }
+
+ private:
+  friend class KCPPacketRef;
+
+  void Release(KCPPacketSlot* slot);
+
+  const size_t num_slots_{0};
+  const size_t slot_size_{0};
+  std::unique_ptr<KCPPacketSlot[]> slots_;
+  std::unique_ptr<char[]> slab_;
+
+  // owner loop only
+  std::vector<KCPPacketSlot*> free_slots_;
+
+  // returned by any thread, moved to free_slots_ in batch when it runs out
+  muduo::MutexLock mutex_;
+  std::vector<KCPPacketSlot*> released_slots_;
+
+  DISALLOW_COPY_AND_ASSIGN(KCPPacketPool);
+};
+
+#endif
@@ -1,14 +1,35 @@
 
 #include "kcp_packets.h"
 
-#include <zconf.h>
-#include <zlib.h>
-
 #include <memory>
 
 #include <muduo/base/LogStream.h>
 
 const size_t KCPPublicHeader::kPublicHeaderLength;
+const size_t KCPPublicHeader::kSessionIdOffset;
+const uint8_t KCPPublicHeader::kPacketTypeMask;
+const int KCPPublicHeader::kChecksumTypeShift;
+
+uint8_t ChecksumTypeToOption(KCPChecksumType checksum_type) {
+  switch (checksum_type) {
+    case CRC32C_CHECKSUM:
+      return CRC32C_OPTION;
+    case NO_CHECKSUM:
+      return NO_CHECKSUM_OPTION;
+    default:
+      return 0;
+  }
+}
+
+KCPChecksumType ChecksumTypeFromOptions(uint8_t options) {
+  if (options & NO_CHECKSUM_OPTION) {
+    return NO_CHECKSUM;
+  }
+  if (options & CRC32C_OPTION) {
+    return CRC32C_CHECKSUM;
+  }
+  return ADLER32_CHECKSUM;
+}
 
 bool KCPPublicHeader::ReadFrom(const char* buf, size_t length) {
   assert(buf != nullptr);
@@ -25,8 +46,11 @@ bool KCPPublicHeader::ReadFrom(const char* buf, size_t length) {
   offset += sizeof(checksum);
 
   // uint8_t
-  memcpy(&packet_type, buf + offset, sizeof(packet_type));
-  offset += sizeof(packet_type);
+  uint8_t type_byte;
+  memcpy(&type_byte, buf + offset, sizeof(type_byte));
+  packet_type = type_byte & kPacketTypeMask;
+  checksum_type = static_cast<uint8_t>(type_byte >> kChecksumTypeShift);
+  offset += sizeof(type_byte);
 
   // le32
   memcpy(&session_id, buf + offset, sizeof(session_id));
@@ -49,8 +73,11 @@ bool KCPPublicHeader::WriteTo(char* buf, size_t length) const {
   offset += sizeof(checksum);
 
   // uint8_t
-  memcpy(buf + offset, &packet_type, sizeof(packet_type));
-  offset += sizeof(packet_type);
+  assert((packet_type & ~kPacketTypeMask) == 0);
+  auto type_byte =
+      static_cast<uint8_t>(packet_type | (checksum_type << kChecksumTypeShift));
+  memcpy(buf + offset, &type_byte, sizeof(type_byte));
+  offset += sizeof(type_byte);
 
   le32 = htole32(session_id);
   memcpy(buf + offset, &le32, sizeof(session_id));
@@ -82,7 +109,13 @@ std::string KCPPublicHeader::PacketTypeToString(uint8_t packet_type) {
     PACKET_TYPE_CASE(ACK_PACKET);
     PACKET_TYPE_CASE(RST_PACKET);
     PACKET_TYPE_CASE(PING_PACKET);
+    PACKET_TYPE_CASE(PONG_PACKET);
     PACKET_TYPE_CASE(DATA_PACKET);
+    PACKET_TYPE_CASE(DATAGRAM_PACKET);
+    PACKET_TYPE_CASE(PATH_CHALLENGE_PACKET);
+    PACKET_TYPE_CASE(PATH_RESPONSE_PACKET);
+    PACKET_TYPE_CASE(RESUME_PACKET);
+    PACKET_TYPE_CASE(TICKET_PACKET);
     default:
       return "UNKNOW";
   }
@@ -94,6 +127,8 @@ muduo::LogStream& operator<<(muduo::LogStream& s,
                              const KCPPublicHeader& header) {
   s << "{ packet_type: " << header.packet_type << "("
     << KCPPublicHeader::PacketTypeToString(header.packet_type) << ")"
+    << ", checksum_type: "
+    << KCPChecksumTypeToString(header.checksum_type)
     << ", session_id: " << header.session_id << " }";
   return s;
 }
@@ -248,8 +283,8 @@ KCPReceivedPacket::ErrorCode KCPReceivedPacket::ReadPublicHeader(
     return UNABLE_READ_CHECKSUM;
   }
 
-  uint8_t packet_type;
-  if (!ReadUInt8(&packet_type)) {
+  uint8_t type_byte;
+  if (!ReadUInt8(&type_byte)) {
     return UNABLE_READ_PACKET_TYPE;
   }
 
@@ -258,16 +293,24 @@ KCPReceivedPacket::ErrorCode KCPReceivedPacket::ReadPublicHeader(
     return UNABLE_READ_SESSION_ID;
   }
 
-  // crc32/adler32
-  auto expected_checksum = static_cast<uint32_t>(
-      ::adler32(1, reinterpret_cast<const Bytef*>(data() + 4),
-                static_cast<uInt>(length() - 4)));
-  if (checksum != expected_checksum) {
-    return INVALID_CHECKSUM;
+  auto checksum_type = static_cast<KCPChecksumType>(
+      type_byte >> KCPPublicHeader::kChecksumTypeShift);
+  if (checksum_type >= NUM_CHECKSUM_TYPES) {
+    return INVALID_CHECKSUM_TYPE;
+  }
+
+  if (checksum_type != NO_CHECKSUM) {
+    uint32_t expected_checksum =
+        KCPChecksum(checksum_type, data() + sizeof(checksum),
+                    length() - sizeof(checksum));
+    if (checksum != expected_checksum) {
+      return INVALID_CHECKSUM;
+    }
   }
 
   public_header->checksum = checksum;
-  public_header->packet_type = packet_type;
+  public_header->packet_type = type_byte & KCPPublicHeader::kPacketTypeMask;
+  public_header->checksum_type = checksum_type;
   public_header->session_id = session_id;
 
   return SUCCESS;
@@ -285,6 +328,7 @@ std::string KCPReceivedPacket::ErrorCodeToString(uint8_t code) {
     ERROR_CODE_CASE(UNABLE_READ_PACKET_TYPE);
     ERROR_CODE_CASE(UNABLE_READ_SESSION_ID);
     ERROR_CODE_CASE(INVALID_CHECKSUM);
+    ERROR_CODE_CASE(INVALID_CHECKSUM_TYPE);
     default:
       return "UNKNOW";
   }
@@ -303,6 +347,19 @@ KCPClonedPacket::KCPClonedPacket(const void* data, size_t length)
   memcpy(data_, data, length);
 }
 
+KCPClonedPacket::KCPClonedPacket(const struct iovec* iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; ++i) {
+    length_ += iov[i].iov_len;
+  }
+
+  data_ = new char[length_];
+  size_t offset = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    memcpy(data_ + offset, iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+}
+
 KCPClonedPacket::~KCPClonedPacket() { delete[] data_; }
 
 KCPPendingSendPacket::KCPPendingSendPacket(char* data, size_t length)
@@ -319,18 +376,20 @@ KCPPendingSendPacket::~KCPPendingSendPacket() {
 }
 
 KCPPendingSendPacket::ErrorCode KCPPendingSendPacket::WritePublicHeader(
-    uint8_t packet_type, uint32_t session_id) {
+    uint8_t packet_type, uint32_t session_id, KCPChecksumType checksum_type) {
   KCPPublicHeader public_header;
 
   public_header.packet_type = packet_type;
+  public_header.checksum_type = checksum_type;
   public_header.session_id = session_id;
   if (!public_header.WriteTo(data(), length())) {
     return UNABLE_WRITE_PUBLIC_HEADER;
   }
 
-  public_header.checksum = static_cast<uint32_t>(
-      ::adler32(1, reinterpret_cast<const Bytef*>(data() + 4),
-                static_cast<uInt>(length() - 4)));
+  // covers the type byte written above
+  public_header.checksum =
+      KCPChecksum(checksum_type, data() + sizeof(public_header.checksum),
+                  length() - sizeof(public_header.checksum));
   if (!public_header.WriteChecksum(data(), length())) {
     return UNABLE_WRITE_CHECKSUM;
   }
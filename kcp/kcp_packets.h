@@ -2,11 +2,15 @@
 #ifndef KCP_PACKETS_H_
 #define KCP_PACKETS_H_
 
+#include <sys/uio.h>
+
 #include <memory>
 #include <string>
 
 #include "common/macros.h"
 
+#include "kcp_checksum.h"
+
 namespace muduo {
 
 class LogStream;
@@ -19,9 +23,43 @@ enum KCPReceivedPacketType : uint8_t {
   PING_PACKET,
   PONG_PACKET,
   DATA_PACKET,
+  // a message of its own, past ikcp, neither acked nor retransmitted
+  DATAGRAM_PACKET,
+  // a token the peer echoes from the address being validated, see
+  // KCPSession::ProbePeerAddress
+  PATH_CHALLENGE_PACKET,
+  PATH_RESPONSE_PACKET,
+  // the options offered followed by a ticket of the server, under the
+  // resume_session_id handed out with it, the session of the ticket is taken
+  // up at once and the data may follow right after it
+  RESUME_PACKET,
+  // a new ticket from the server after its resume_session_id, from the client
+  // the ticket it has, to ask for a fresh one
+  TICKET_PACKET,
   NUM_PACKET_TYPES
 };
 
+// optional byte following the public header of a SYN, a peer which sends none
+// knows of no options and gets none back, so old peers keep working
+enum KCPSessionOption : uint8_t {
+  SACK_OPTION = 1 << 0,
+  // the checksum of the data packets, adler32 if neither is agreed on
+  CRC32C_OPTION = 1 << 1,
+  NO_CHECKSUM_OPTION = 1 << 2,
+  // parity shards along the data packets, see KCPFecHeader
+  FEC_OPTION = 1 << 3,
+  // DATAGRAM_PACKET is known of
+  DATAGRAM_OPTION = 1 << 4,
+  // the peer answers PATH_CHALLENGE_PACKET, a new address of it is only
+  // taken once validated
+  MIGRATION_OPTION = 1 << 5,
+  // the server appends a ticket to its SYN, see KCPTicketCrypter
+  RESUMPTION_OPTION = 1 << 6,
+};
+
+uint8_t ChecksumTypeToOption(KCPChecksumType checksum_type);
+KCPChecksumType ChecksumTypeFromOptions(uint8_t options);
+
 struct KCPPublicHeader {
   // KCPPublicHeader() = default;
   // KCPPublicHeader(const KCPPublicHeader&) = default;
@@ -35,11 +73,18 @@ struct KCPPublicHeader {
   static std::string PacketTypeToString(uint8_t packet_type);
 
   uint32_t checksum{0};
+  // packet_type and checksum_type share a byte on the wire
   uint8_t packet_type{0};
+  uint8_t checksum_type{ADLER32_CHECKSUM};
   uint32_t session_id{0};
 
+  static const uint8_t kPacketTypeMask = 0x3F;
+  static const int kChecksumTypeShift = 6;
+
   static const size_t kPublicHeaderLength =
       sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+  // where the little endian session_id starts, see KCPServer::Listen
+  static const size_t kSessionIdOffset = sizeof(uint32_t) + sizeof(uint8_t);
 };
 
 muduo::LogStream& operator<<(muduo::LogStream& s,
@@ -54,6 +99,7 @@ class KCPReceivedPacket final {
     UNABLE_READ_PACKET_TYPE,
     UNABLE_READ_SESSION_ID,
     INVALID_CHECKSUM,
+    INVALID_CHECKSUM_TYPE,
   };
 
   KCPReceivedPacket(const char* data, size_t length);
@@ -104,6 +150,8 @@ muduo::LogStream& operator<<(muduo::LogStream& s,
 class KCPClonedPacket final {
  public:
   KCPClonedPacket(const void* data, size_t length);
+  // gathers the fragments
+  KCPClonedPacket(const struct iovec* iov, int iovcnt);
   ~KCPClonedPacket();
 
   char* data() { return data_; }
@@ -134,7 +182,9 @@ class KCPPendingSendPacket final {
   const char* data() const { return data_; }
   size_t length() const { return length_; }
 
-  ErrorCode WritePublicHeader(uint8_t packet_type, uint32_t session_id);
+  ErrorCode WritePublicHeader(
+      uint8_t packet_type, uint32_t session_id,
+      KCPChecksumType checksum_type = ADLER32_CHECKSUM);
 
   static std::string ErrorCodeToString(uint8_t code);
 
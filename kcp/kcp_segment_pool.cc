@@ -0,0 +1,145 @@
+
+#include "kcp_segment_pool.h"
+
+#include <stdlib.h>
+
+#include <cstddef>
+#include <mutex>
+
+#include <muduo/base/ThreadLocalSingleton.h>
+
+#include "ikcp.h"
+
+#include "kcp_constants.h"
+
+namespace {
+
+const int kNumSizeClasses = KCPSegmentPool::NUM_SIZE_CLASSES;
+
+// total block sizes, the segment header included
+const size_t kSizeClassSizes[kNumSizeClasses] = {
+    sizeof(IKCPSEG) + kSegmentPoolSmallSize,
+    sizeof(IKCPSEG) + kMaxPacketSize,
+};
+
+const uint32_t kNoSizeClass = UINT32_MAX;
+
+// in front of every block, keeps the alignment of malloc
+union BlockHeader {
+  uint32_t size_class;
+  std::max_align_t align;
+};
+
+// a cached block, linked through its payload
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct ThreadCache {
+  ~ThreadCache() {
+    for (int i = 0; i < kNumSizeClasses; ++i) {
+      while (free_lists[i] != nullptr) {
+        FreeBlock* block = free_lists[i];
+        free_lists[i] = block->next;
+        ::free(reinterpret_cast<BlockHeader*>(block) - 1);
+      }
+    }
+  }
+
+  FreeBlock* free_lists[kNumSizeClasses] = {};
+  size_t num_free_blocks[kNumSizeClasses] = {};
+  KCPSegmentPool::Stats stats[kNumSizeClasses];
+};
+
+ThreadCache& GetThreadCache() {
+  return muduo::ThreadLocalSingleton<ThreadCache>::instance();
+}
+
+uint32_t GetSizeClass(size_t size) {
+  for (uint32_t i = 0; i < kNumSizeClasses; ++i) {
+    if (size <= kSizeClassSizes[i]) {
+      return i;
+    }
+  }
+  return kNoSizeClass;
+}
+
+}  // namespace
+
+void KCPSegmentPool::Install() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    ikcp_allocator(&KCPSegmentPool::Malloc, &KCPSegmentPool::Free);
+  });
+}
+
+KCPSegmentPool::Stats KCPSegmentPool::GetStats(SizeClass size_class) {
+  return GetThreadCache().stats[size_class];
+}
+
+void* KCPSegmentPool::Malloc(size_t size) {
+  uint32_t size_class = GetSizeClass(size);
+  if (size_class == kNoSizeClass) {
+    auto header =
+        static_cast<BlockHeader*>(::malloc(sizeof(BlockHeader) + size));
+    if (header == nullptr) {
+      return nullptr;
+    }
+    header->size_class = kNoSizeClass;
+    return header + 1;
+  }
+
+  ThreadCache& cache = GetThreadCache();
+  Stats& stats = cache.stats[size_class];
+
+  void* ptr = nullptr;
+  FreeBlock* block = cache.free_lists[size_class];
+  if (block != nullptr) {
+    cache.free_lists[size_class] = block->next;
+    --cache.num_free_blocks[size_class];
+    ++stats.hits;
+    ptr = block;
+  } else {
+    auto header = static_cast<BlockHeader*>(
+        ::malloc(sizeof(BlockHeader) + kSizeClassSizes[size_class]));
+    if (header == nullptr) {
+      return nullptr;
+    }
+    header->size_class = size_class;
+    ++stats.misses;
+    ptr = header + 1;
+  }
+
+  if (++stats.in_use > stats.high_water) {
+    stats.high_water = stats.in_use;
+  }
+
+  return ptr;
+}
+
+void KCPSegmentPool::Free(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+
+  BlockHeader* header = static_cast<BlockHeader*>(ptr) - 1;
+  uint32_t size_class = header->size_class;
+  if (size_class == kNoSizeClass) {
+    ::free(header);
+    return;
+  }
+
+  ThreadCache& cache = GetThreadCache();
+  --cache.stats[size_class].in_use;
+
+  if (cache.num_free_blocks[size_class] >=
+      static_cast<size_t>(kMaxCachedSegmentsPerThread)) {
+    ::free(header);
+    return;
+  }
+
+  FreeBlock* block = static_cast<FreeBlock*>(ptr);
+  block->next = cache.free_lists[size_class];
+  cache.free_lists[size_class] = block;
+  ++cache.num_free_blocks[size_class];
+}
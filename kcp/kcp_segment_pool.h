@@ -0,0 +1,46 @@
+
+#ifndef KCP_SEGMENT_POOL_H_
+#define KCP_SEGMENT_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// thread local cache of the allocations of ikcp, by size class, so that the
+// segments sent and received by a session do not go through malloc
+//
+// a block freed by another thread than the one which allocated it is simply
+// cached by the freeing thread. allocations larger than the MSS class, or
+// beyond the cache bound of a thread, go to malloc and free.
+class KCPSegmentPool final {
+ public:
+  enum SizeClass {
+    // small messages
+    SMALL,
+    // up to a full segment of the largest packet
+    MSS,
+    NUM_SIZE_CLASSES,
+  };
+
+  // of the calling thread
+  struct Stats {
+    // allocations served from the cache
+    uint64_t hits{0};
+    // allocations which went to malloc
+    uint64_t misses{0};
+    // blocks allocated minus blocks freed by this thread
+    int64_t in_use{0};
+    int64_t high_water{0};
+  };
+
+  // installs the pool into ikcp with ikcp_allocator, idempotent, must be
+  // called before the first ikcp_create of the process as blocks of the
+  // default allocator can not be freed by the pool
+  static void Install();
+
+  static Stats GetStats(SizeClass size_class);
+
+  static void* Malloc(size_t size);
+  static void Free(void* ptr);
+};
+
+#endif
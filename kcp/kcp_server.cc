@@ -1,13 +1,18 @@
 
 #include "kcp_server.h"
 
+#include <endian.h>
 #include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <memory>
 
+#include <muduo/base/CountDownLatch.h>
 #include <muduo/base/Logging.h>
 #include <muduo/base/ThreadLocalSingleton.h>
 #include <muduo/base/ThreadPool.h>
@@ -25,81 +30,138 @@
 #include "udp_socket.h"
 #include "urandom.h"
 
-KCPServer::KCPServer(muduo::net::EventLoop* loop) : loop_(CHECK_NOTNULL(loop)) {
-  Initialize();
-}
+KCPServer::KCPServer(muduo::net::EventLoop* loop)
+    : loop_(CHECK_NOTNULL(loop)),
+      session_table_(kServerNumSessionTableStripes) {}
 
 KCPServer::~KCPServer() {
   loop_->assertInLoopThread();
 
-  channel_->disableAll();
-  channel_->remove();
-
-  loop_->cancel(periodic_task_timer_);
-
-  int num_sessions = 0;
-  std::atomic<int> num_closed_sessions{0};
-  for (auto& s : session_map_) {
-    KCPSessionPtr& session = s.second;
-    session->loop()->runInLoop([session, &num_closed_sessions] {
-      session->Close(true);
-      ++num_closed_sessions;
+  // shards must be stopped in their own loops
+  muduo::CountDownLatch latch(static_cast<int>(shards_.size()));
+  for (auto& s : shards_) {
+    Shard* shard = s.get();
+    shard->loop->runInLoop([this, shard, &latch] {
+      StopShard(shard);
+      latch.countDown();
     });
-    ++num_sessions;
   }
-
-  // spin
-  int try_times = 0;
-  while (num_closed_sessions < num_sessions &&
-         ++try_times < kServerMaxWaitSessionClosedTryTimes)
-    ;
-
-  int num_unclosed_sessions = num_sessions - num_closed_sessions;
-  if (num_unclosed_sessions > 0) {
-    LOG_ERROR << "~KCPServer there are still have " << num_unclosed_sessions
-              << " sessions not closed yet";
+  latch.wait();
+
+  CloseAllSessions();
+
+  // thread sockets and channels must go before their loops
+  if (thread_pool_) {
+    std::vector<muduo::net::EventLoop*> loops = thread_pool_->getAllLoops();
+    muduo::CountDownLatch thread_latch(static_cast<int>(loops.size()));
+    for (muduo::net::EventLoop* loop : loops) {
+      loop->runInLoop([this, &thread_latch] {
+        ResetThread();
+        thread_latch.countDown();
+      });
+    }
+    thread_latch.wait();
   }
 
   // ...
   // ~thread_pool_ => quit thread loop, not 100% safe
   // ...
   // ...
-  // ~socket_ => close socket
+  // ~shards_ => close sockets
 }
 
-int KCPServer::Listen(const muduo::net::InetAddress& address) {
-  loop_->assertInLoopThread();
+int KCPServer::CreateSocket(const muduo::net::InetAddress& address,
+                            std::unique_ptr<UDPSocket>* socket) const {
+  assert(socket != nullptr);
 
-  auto socket = std::make_unique<UDPSocket>();
+  auto new_socket = std::make_unique<UDPSocket>();
 
-  // socket->AllowReusePort();
-  socket->AllowReceiveError();
+  if (reuse_port_) {
+    new_socket->AllowReusePort();
+  }
+  new_socket->AllowReceiveError();
+  if (udp_gro_) {
+    new_socket->AllowReceiveGRO();
+  }
 
-  int rc = socket->Bind(address);
+  int rc = new_socket->Bind(address);
   if (rc < 0) {
     LOG_ERROR << "Bind error: " << rc;
     return rc;
   }
 
-  rc = socket->SetReceiveBufferSize(static_cast<int32_t>(kSocketReceiveBuffer));
+  rc = new_socket->SetReceiveBufferSize(
+      static_cast<int32_t>(kSocketReceiveBuffer));
   if (rc < 0) {
     LOG_ERROR << "SetReceiveBufferSize error: " << rc;
     return rc;
   }
 
-  rc = socket->SetSendBufferSize(static_cast<int32_t>(kSocketSendBuffer));
+  rc = new_socket->SetSendBufferSize(static_cast<int32_t>(kSocketSendBuffer));
   if (rc < 0) {
     LOG_ERROR << "SetSendBufferSize error: " << rc;
     return rc;
   }
 
-  rc = socket->GetLocalAddress(&server_address_);
-  if (rc < 0) {
-    LOG_ERROR << "GetLocalAddress error: " << rc;
-    return rc;
+  *socket = std::move(new_socket);
+  return 0;
+}
+
+int KCPServer::Listen(const muduo::net::InetAddress& address) {
+  loop_->assertInLoopThread();
+  assert(shards_.empty());
+
+  // the loops of the pool are only known after it has started, so bind all
+  // sockets first and hand them out to the loops later
+  int num_shards = reuse_port_ ? std::max<int>(num_threads_, 1) : 1;
+  std::vector<std::unique_ptr<Shard>> shards;
+  for (int i = 0; i < num_shards; ++i) {
+    auto shard = std::make_unique<Shard>();
+
+    // the others bind to the actual address in case of port 0
+    int rc = CreateSocket(i == 0 ? address : server_address_, &shard->socket);
+    if (rc < 0) {
+      return rc;
+    }
+
+    if (i == 0) {
+      rc = shard->socket->GetLocalAddress(&server_address_);
+      if (rc < 0) {
+        LOG_ERROR << "GetLocalAddress error: " << rc;
+        return rc;
+      }
+
+      int segment_size = 0;
+      gso_supported_ =
+          udp_gso_ && shard->socket->GetSegmentSize(&segment_size) == 0;
+      tx_time_supported_ = tx_time_;
+    }
+
+    // set on the socket, the descriptors of the threads share it
+    if (tx_time_supported_) {
+      rc = shard->socket->EnableTxTime();
+      if (rc < 0) {
+        LOG_WARN << "EnableTxTime error: " << rc << ", tx time disabled";
+        tx_time_supported_ = false;
+      }
+    }
+
+    shard->index = static_cast<uint32_t>(i);
+    InitializeShard(shard.get());
+    shards.push_back(std::move(shard));
+  }
+
+  // the group is complete, the program applies to all of its sockets
+  if (reuse_port_ && session_affinity_ && num_shards > 1) {
+    int rc = AttachSessionAffinityFilter(shards.front()->socket.get(),
+                                         static_cast<uint32_t>(num_shards));
+    if (rc < 0) {
+      LOG_ERROR << "AttachSessionAffinityFilter error: " << rc;
+      return rc;
+    }
   }
 
-  socket_ = std::move(socket);
+  shards_ = std::move(shards);
 
   thread_pool_ =
       std::make_unique<muduo::net::EventLoopThreadPool>(loop_, "KCPServer");
@@ -107,23 +169,165 @@ int KCPServer::Listen(const muduo::net::InetAddress& address) {
   thread_pool_->start(
       [this](muduo::net::EventLoop* loop) { InitializeThread(loop); });
 
-  channel_ = std::make_unique<muduo::net::Channel>(loop_, socket_->sockfd());
-  channel_->setReadCallback(
-      [this](muduo::Timestamp receive_time) { HandleRead(receive_time); });
-  channel_->setWriteCallback([this] { HandleWrite(); });
-  channel_->setErrorCallback([this] { HandleError(); });
-  channel_->enableReading();
+  if (reuse_port_) {
+    std::vector<muduo::net::EventLoop*> loops = thread_pool_->getAllLoops();
+    assert(loops.size() == shards_.size());
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      shards_[i]->loop = loops[i];
+    }
+  } else {
+    shards_.front()->loop = loop_;
+  }
 
-  periodic_task_timer_ = loop_->runEvery(kServerRunPeriodicTaskInterval,
-                                         [this] { RunPeriodicTask(); });
+  for (auto& s : shards_) {
+    Shard* shard = s.get();
+    shard->loop->runInLoop([this, shard] { StartShard(shard); });
+  }
 
   return 0;
 }
 
-void KCPServer::RunPeriodicTask() {
+void KCPServer::InitializeShard(Shard* shard) const {
+  shard->mmsg_hdrs = std::make_unique<mmsghdr[]>(kNumPacketsPerRead);
+  memset(shard->mmsg_hdrs.get(), 0, kNumPacketsPerRead * sizeof(mmsghdr));
+
+  // MSG_TRUNC
+  if (udp_gro_) {
+    shard->packet_pool = std::make_unique<KCPPacketPool>(
+        kNumGROPacketsPerPool, kMaxGROPacketSize + 1);
+  } else {
+    shard->packet_pool =
+        std::make_unique<KCPPacketPool>(kNumPacketsPerPool, kMaxPacketSize + 1);
+  }
+
+  shard->rx_slots.resize(kNumPacketsPerRead);
+  for (int i = 0; i < kNumPacketsPerRead; ++i) {
+    RxSlot* rx_slot = &shard->rx_slots[i];
+    rx_slot->slot = shard->packet_pool->Acquire();
+    assert(rx_slot->slot);
+
+    struct msghdr* hdr = &shard->mmsg_hdrs[i].msg_hdr;
+    hdr->msg_name = &rx_slot->slot->addr;
+    hdr->msg_namelen = sizeof(sockaddr_storage);
+    hdr->msg_iov = &rx_slot->slot->iov;
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = nullptr;
+    hdr->msg_controllen = 0;
+    hdr->msg_flags = 0;
+  }
+}
+
+int KCPServer::AttachSessionAffinityFilter(UDPSocket* socket,
+                                           uint32_t num_shards) {
+  assert(socket != nullptr);
+  assert(num_shards > 1);
+
+  // A = session_id, BPF_ABS loads are big endian so assemble the little
+  // endian value byte by byte, the offsets are relative to the udp payload
+  const uint32_t offset = KCPPublicHeader::kSessionIdOffset;
+  struct sock_filter filter[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, KCPPublicHeader::kPublicHeaderLength,
+               1, 0),
+      BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset + 3),
+      BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset + 2),
+      BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+      BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset + 1),
+      BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+      BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset),
+      BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+      // session_id 0 (handshake), out of range index => 4-tuple hash
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+      // see GenerateSessionId
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_shards),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+
+  return socket->AttachReusePortFilter(
+      filter, static_cast<unsigned short>(sizeof(filter) / sizeof(filter[0])));
+}
+
+void KCPServer::StartShard(Shard* shard) {
+  shard->loop->assertInLoopThread();
+
+  // sessions of this loop send through the socket they were received on
+  if (reuse_port_) {
+    InitializeThreadSocket(shard->loop, *shard->socket);
+  }
+
+  shard->channel = std::make_unique<muduo::net::Channel>(
+      shard->loop, shard->socket->sockfd());
+  shard->channel->setReadCallback(
+      [this, shard](muduo::Timestamp receive_time) {
+        HandleRead(shard, receive_time);
+      });
+  shard->channel->setErrorCallback([this, shard] { HandleError(shard); });
+  shard->channel->enableReading();
+
+  shard->periodic_task_timer =
+      shard->loop->runEvery(kServerRunPeriodicTaskInterval,
+                            [this, shard] { RunPeriodicTask(shard); });
+}
+
+void KCPServer::StopShard(Shard* shard) {
+  shard->loop->assertInLoopThread();
+
+  if (shard->channel) {
+    shard->channel->disableAll();
+    shard->channel->remove();
+  }
+
+  shard->loop->cancel(shard->periodic_task_timer);
+}
+
+void KCPServer::CloseAllSessions() {
+  std::vector<KCPSessionPtr> sessions;
+  for (size_t i = 0; i < session_table_.num_stripes(); ++i) {
+    session_table_.Sweep(i, [&sessions](KCPSessionTable::Entry* entry) {
+      if (entry->session) {
+        sessions.push_back(std::move(entry->session));
+      }
+      return false;
+    });
+  }
+
+  int num_sessions = 0;
+  std::atomic<int> num_closed_sessions{0};
+  for (KCPSessionPtr& session : sessions) {
+    session->loop()->runInLoop([session, &num_closed_sessions] {
+      session->Close(true);
+      ++num_closed_sessions;
+    });
+    ++num_sessions;
+  }
+
+  // spin
+  int try_times = 0;
+  while (num_closed_sessions < num_sessions &&
+         ++try_times < kServerMaxWaitSessionClosedTryTimes)
+    ;
+
+  int num_unclosed_sessions = num_sessions - num_closed_sessions;
+  if (num_unclosed_sessions > 0) {
+    LOG_ERROR << "~KCPServer there are still have " << num_unclosed_sessions
+              << " sessions not closed yet";
+  }
+}
+
+void KCPServer::RunPeriodicTask(Shard* shard) {
+  PendingSessionMap& pending_session_map = shard->pending_session_map;
+
   muduo::Timestamp now = muduo::Timestamp::now();
-  for (auto it = pending_session_map_.begin();
-       it != pending_session_map_.end();) {
+  for (auto it = pending_session_map.begin();
+       it != pending_session_map.end();) {
     std::unique_ptr<KCPPendingSession>& pending_session = it->second;
     if (pending_session->retry_times >= kServerMaxSynRetryTimes) {
       // send rst packet
@@ -131,7 +335,7 @@ void KCPServer::RunPeriodicTask() {
       LOG_ERROR << "session syn retry reach the limit, session_id: "
                 << pending_session->session_id << ", client_address: "
                 << pending_session->peer_address.toIpPort();
-      it = pending_session_map_.erase(it);
+      it = pending_session_map.erase(it);
       continue;
     }
 
@@ -140,8 +344,7 @@ void KCPServer::RunPeriodicTask() {
       // send syn packet
       ++pending_session->retry_times;
       pending_session->syn_sent_time = now;
-      SendPacket(SYN_PACKET, pending_session->session_id,
-                 pending_session->peer_address);
+      SendSynPacket(shard, *pending_session);
       LOG_WARN << "session syn timeout the " << pending_session->retry_times
                << "th time retry syn has sent, session_id: "
                << pending_session->session_id;
@@ -149,53 +352,38 @@ void KCPServer::RunPeriodicTask() {
     ++it;
   }
 
-  for (auto it = session_map_.begin(); it != session_map_.end();) {
-    uint32_t session_id = it->first;
-    KCPSessionPtr& session = it->second;
-
-    auto idle_session_it = idle_session_map_.find(session_id);
-    if (idle_session_it == idle_session_map_.end()) {
-      session->loop()->runInLoop([session] { session->Close(); });
-      it = session_map_.erase(it);
-      time_wait_session_map_.insert(std::make_pair(session_id, now));
-      LOG_ERROR << "session exists but idle session not exists, session_id: "
-                << session_id;
-      continue;
+  // the sessions are closed once the stripe has been unlocked
+  std::vector<KCPSessionPtr> expired_sessions;
+  auto visitor = [now, &expired_sessions](KCPSessionTable::Entry* entry) {
+    if (entry->state == KCPSessionTable::TIME_WAIT) {
+      return muduo::timeDifference(now, entry->time) <
+             kServerSessionTimeWaitSeconds;
     }
 
-    muduo::Timestamp last_received_time = idle_session_it->second;
-    if (muduo::timeDifference(now, last_received_time) >=
+    const KCPSessionPtr& session = entry->session;
+    if (muduo::timeDifference(now, entry->time) >=
         kServerSessionIdleSeconds) {
-      session->loop()->runInLoop([session] { session->Close(); });
-      it = session_map_.erase(it);
-      idle_session_map_.erase(idle_session_it);
-      time_wait_session_map_.insert(std::make_pair(session_id, now));
-      LOG_INFO << "session exipred, session_id: " << session_id
-               << ", last_received_time: "
-               << last_received_time.toFormattedString();
-      continue;
+      LOG_INFO << "session exipred, session_id: " << entry->session_id
+               << ", last_received_time: " << entry->time.toFormattedString();
+      expired_sessions.push_back(session);
+    } else if (!session->IsClosed()) {
+      return true;
     }
 
-    if (session->IsClosed()) {
-      it = session_map_.erase(it);
-      idle_session_map_.erase(idle_session_it);
-      time_wait_session_map_.insert(std::make_pair(session_id, now));
-      continue;
-    }
+    entry->state = KCPSessionTable::TIME_WAIT;
+    entry->session.reset();
+    entry->time = now;
+    return true;
+  };
 
-    ++it;
+  // the stripes are shared out among the shards
+  for (size_t i = shard->index; i < session_table_.num_stripes();
+       i += shards_.size()) {
+    session_table_.Sweep(i, visitor);
   }
 
-  for (auto it = time_wait_session_map_.begin();
-       it != time_wait_session_map_.end();) {
-    muduo::Timestamp start_time = it->second;
-    if (muduo::timeDifference(now, start_time) >=
-        kServerSessionTimeWaitSeconds) {
-      it = time_wait_session_map_.erase(it);
-      continue;
-    }
-
-    ++it;
+  for (KCPSessionPtr& session : expired_sessions) {
+    session->loop()->runInLoop([session] { session->Close(); });
   }
 }
 
@@ -207,42 +395,32 @@ void KCPServer::ListenOrDie(const muduo::net::InetAddress& address) {
   LOG_INFO << "kcp server listening on " << address.toIpPort();
 }
 
-void KCPServer::Initialize() {
-  mmsg_hdrs_ = std::make_unique<mmsghdr[]>(kNumPacketsPerRead);
-  raw_packets_ = std::make_unique<RawPacket[]>(kNumPacketsPerRead);
-  memset(mmsg_hdrs_.get(), 0, kNumPacketsPerRead * sizeof(mmsghdr));
-
-  for (int i = 0; i < kNumPacketsPerRead; ++i) {
-    RawPacket* pkt = &raw_packets_[i];
-    pkt->iov.iov_base = pkt->buf;
-    pkt->iov.iov_len = sizeof(pkt->buf);
-    memset(&pkt->addr, 0, sizeof(pkt->addr));
-    memset(pkt->buf, 0, sizeof(pkt->buf));
-
-    struct msghdr* hdr = &mmsg_hdrs_[i].msg_hdr;
-    hdr->msg_name = &pkt->addr;
-    hdr->msg_namelen = sizeof(sockaddr_storage);
-    hdr->msg_iov = &pkt->iov;
-    hdr->msg_iovlen = 1;
-    hdr->msg_control = nullptr;
-    hdr->msg_controllen = 0;
-    hdr->msg_flags = 0;
-  }
-}
-
-void KCPServer::HandleRead(muduo::Timestamp) {
+void KCPServer::HandleRead(Shard* shard, muduo::Timestamp) {
   // HandleError();
 
-  for (int i = 0; i < kNumPacketsPerRead; ++i) {
-    msghdr* hdr = &mmsg_hdrs_[i].msg_hdr;
-    hdr->msg_namelen = sizeof(sockaddr_storage);
-    hdr->msg_controllen = 0;
-    hdr->msg_flags = 0;
-  }
+  std::unique_ptr<mmsghdr[]>& mmsg_hdrs = shard->mmsg_hdrs;
+  std::vector<RxSlot>& rx_slots = shard->rx_slots;
 
-  muduo::net::InetAddress client_address;
+  auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
   while (true) {
-    int packets_read = socket_->RecvMmsg(mmsg_hdrs_.get(), kNumPacketsPerRead);
+    // slots shared in the last batch have been replaced
+    for (int i = 0; i < kNumPacketsPerRead; ++i) {
+      RxSlot* rx_slot = &rx_slots[i];
+      msghdr* hdr = &mmsg_hdrs[i].msg_hdr;
+      hdr->msg_name = &rx_slot->slot->addr;
+      hdr->msg_namelen = sizeof(sockaddr_storage);
+      hdr->msg_iov = &rx_slot->slot->iov;
+      if (udp_gro_) {
+        hdr->msg_control = rx_slot->control.buf;
+        hdr->msg_controllen = sizeof(rx_slot->control.buf);
+      } else {
+        hdr->msg_controllen = 0;
+      }
+      hdr->msg_flags = 0;
+    }
+
+    int packets_read =
+        shard->socket->RecvMmsg(mmsg_hdrs.get(), kNumPacketsPerRead);
     if (packets_read < 0) {
       int saved_errno = -packets_read;
       if (!IS_EAGAIN(saved_errno)) {
@@ -252,28 +430,60 @@ void KCPServer::HandleRead(muduo::Timestamp) {
       break;
     }
 
+    thread_data.in_ingress_batch = true;
     for (int i = 0; i < packets_read; ++i) {
-      if (mmsg_hdrs_[i].msg_len == 0) {
+      if (mmsg_hdrs[i].msg_len == 0) {
         continue;
       }
 
+      RxSlot* rx_slot = &rx_slots[i];
+      KCPPacketSlot* slot = rx_slot->slot.get();
+
       // MSG_TRUNC
-      if (mmsg_hdrs_[i].msg_len > kMaxPacketSize) {
+      if (mmsg_hdrs[i].msg_len >= slot->capacity) {
         LOG_ERROR << "RecvMsg normal data was truncated";
         continue;
       }
 
-      msghdr* hdr = &mmsg_hdrs_[i].msg_hdr;
-      if (!SockaddrStorage::ToInetAddr(raw_packets_[i].addr, hdr->msg_namelen,
-                                       &client_address)) {
+      msghdr* hdr = &mmsg_hdrs[i].msg_hdr;
+      if (!SockaddrStorage::ToInetAddr(slot->addr, hdr->msg_namelen,
+                                       &slot->peer_address)) {
         LOG_ERROR << "ToInetAddr failed with msg_namelen: " << hdr->msg_namelen;
         continue;
       }
 
-      KCPReceivedPacket packet(static_cast<char*>(raw_packets_[i].iov.iov_base),
-                               mmsg_hdrs_[i].msg_len);
-      ProcessPacket(packet, client_address);
+      slot->length = mmsg_hdrs[i].msg_len;
+
+      // the segments of a coalesced datagram have the same size, except the
+      // last one which may be shorter
+      size_t segment_size = slot->length;
+      if (udp_gro_) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg != nullptr;
+             cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+          if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int gso_size = 0;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            if (gso_size > 0) {
+              segment_size = static_cast<size_t>(gso_size);
+            }
+            break;
+          }
+        }
+      }
+
+      for (size_t offset = 0; offset < slot->length; offset += segment_size) {
+        size_t length = std::min(segment_size, slot->length - offset);
+        ProcessPacket(shard, rx_slot, slot->buf + offset, length);
+      }
+
+      if (rx_slot->spare) {
+        rx_slot->slot = std::move(rx_slot->spare);
+      }
     }
+    thread_data.in_ingress_batch = false;
+
+    DispatchIngressBatches(shard);
+    FlushTxQueue();
 
     if (packets_read != kNumPacketsPerRead) {
       break;
@@ -282,17 +492,72 @@ void KCPServer::HandleRead(muduo::Timestamp) {
 }
 
 void KCPServer::HandleWrite() {
-  // SetWritable();
-  //
-  // for (auto& packet: queued_packets_)
-  // }
-  //
-  // if (queued_packets_.empty()) {
-  //   channel_->disableWriting();
-  // }
+  auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
+  std::deque<BacklogPacket>& backlog = thread_data.backlog;
+
+  mmsghdr mmsg_hdrs[kNumPacketsPerSend];
+  // the queued packets may still hold thread_data.tx_time_controls
+  TxTimeControl tx_time_controls[kNumPacketsPerSend];
+  while (!backlog.empty()) {
+    auto num_packets = static_cast<unsigned int>(
+        std::min<size_t>(backlog.size(), kNumPacketsPerSend));
+    memset(mmsg_hdrs, 0, num_packets * sizeof(mmsghdr));
+    for (unsigned int i = 0; i < num_packets; ++i) {
+      const BacklogPacket& backlog_packet = backlog[i];
+      struct msghdr* hdr = &mmsg_hdrs[i].msg_hdr;
+      hdr->msg_name = &backlog_packet.slot->addr;
+      hdr->msg_namelen = backlog_packet.addr_len;
+      hdr->msg_iov = &backlog_packet.slot->iov;
+      hdr->msg_iovlen = 1;
+
+      // paced as it would have been without the backlog
+      if (backlog_packet.tx_time > 0) {
+        TxTimeControl* control = &tx_time_controls[i];
+        hdr->msg_control = control->buf;
+        hdr->msg_controllen = sizeof(control->buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &backlog_packet.tx_time,
+               sizeof(backlog_packet.tx_time));
+      }
+    }
+
+    int rc = thread_data.socket->SendMmsg(mmsg_hdrs, num_packets);
+    unsigned int packets_done = 0;
+    if (rc < 0) {
+      int saved_errno = -rc;
+      if (IS_EAGAIN(saved_errno)) {
+        return;
+      }
+
+      // the first packet can not be sent at all, drop it to make progress
+      LOG_ERROR << "SendMmsg backlog error: " << saved_errno
+                << ", detail: " << muduo::strerror_tl(saved_errno);
+      ++num_dropped_tx_packets_;
+      num_dropped_tx_bytes_ += backlog.front().slot->iov.iov_len;
+      packets_done = 1;
+    } else {
+      packets_done = static_cast<unsigned int>(rc);
+    }
+
+    for (unsigned int i = 0; i < packets_done; ++i) {
+      backlog.pop_front();
+    }
+
+    // the socket buffer is full again, wait for the next writable event
+    if (rc >= 0 && packets_done < num_packets) {
+      return;
+    }
+  }
+
+  thread_data.channel->disableWriting();
+  SetWritable();
 }
 
-void KCPServer::HandleError() {
+void KCPServer::HandleError(Shard* shard) {
   // man 7 udp
   // When the IP_RECVERR option is enabled, all errors are stored in the socket
   // error queue, and can be received by recvmsg(2) with the MSG_ERRQUEUE flag
@@ -320,7 +585,7 @@ void KCPServer::HandleError() {
     msg.msg_controllen = sizeof(buf);
     msg.msg_flags = 0;
 
-    int rc = socket_->RecvMsg(&msg, MSG_ERRQUEUE);
+    int rc = shard->socket->RecvMsg(&msg, MSG_ERRQUEUE);
     if (rc < 0) {
       int saved_errno = -rc;
       if (!IS_EAGAIN(saved_errno)) {
@@ -350,9 +615,9 @@ void KCPServer::HandleError() {
 
           KCPPublicHeader public_header;
           if (public_header.ReadFrom(packet.buf, rc)) {
-            auto session_it = session_map_.find(public_header.session_id);
-            if (session_it != session_map_.end()) {
-              KCPSessionPtr& session = session_it->second;
+            KCPSessionPtr session =
+                session_table_.Find(public_header.session_id);
+            if (session) {
               PendingError pending_error = {.type = serr->ee_type,
                                             .code = serr->ee_code};
               session->loop()->runInLoop([session, pending_error] {
@@ -381,7 +646,8 @@ void KCPServer::HandleError() {
   }
 }
 
-bool KCPServer::GenerateSessionId(uint32_t* session_id) const {
+bool KCPServer::GenerateSessionId(const Shard* shard,
+                                  uint32_t* session_id) const {
   assert(session_id != nullptr);
 
   uint32_t rand_id = 0;
@@ -390,11 +656,23 @@ bool KCPServer::GenerateSessionId(uint32_t* session_id) const {
       continue;
     }
 
-    if (session_map_.count(rand_id) > 0) {
+    // the affinity filter steers session_id % num_shards to this shard
+    if (reuse_port_ && session_affinity_ && shards_.size() > 1) {
+      auto num_shards = static_cast<uint32_t>(shards_.size());
+      uint32_t base = rand_id - rand_id % num_shards;
+      if (base > UINT32_MAX - shard->index) {
+        continue;
+      }
+      rand_id = base + shard->index;
+    }
+
+    // 0 is reserved for the handshake
+    if (rand_id == 0) {
       continue;
     }
 
-    if (time_wait_session_map_.count(rand_id) > 0) {
+    // established or in time wait
+    if (session_table_.Contains(rand_id)) {
       continue;
     }
 
@@ -405,10 +683,88 @@ bool KCPServer::GenerateSessionId(uint32_t* session_id) const {
   return false;
 }
 
-void KCPServer::SendPacket(uint8_t packet_type, uint32_t session_id,
+muduo::net::EventLoop* KCPServer::GetLoopForSession(
+    const Shard* shard, uint32_t session_id) const {
+  // no cross thread dispatching in reuse port mode
+  if (reuse_port_) {
+    return shard->loop;
+  }
+
+  return thread_pool_->getLoopForHash(session_id);
+}
+
+void KCPServer::SendPacket(Shard* shard, uint8_t packet_type,
+                           uint32_t session_id,
                            const muduo::net::InetAddress& client_address) {
   char buf[KCPPublicHeader::kPublicHeaderLength];
-  KCPPendingSendPacket packet(buf, sizeof(buf));
+  SendPacket(shard, buf, sizeof(buf), packet_type, session_id, client_address);
+}
+
+void KCPServer::SendSynPacket(Shard* shard,
+                              const KCPPendingSession& pending_session) {
+  char buf[KCPPublicHeader::kPublicHeaderLength + sizeof(uint8_t) +
+           KCPTicketCrypter::kIssuedTicketLength];
+  size_t length = KCPPublicHeader::kPublicHeaderLength;
+  if (pending_session.has_options) {
+    buf[length++] = static_cast<char>(pending_session.options);
+  }
+
+  // a fresh one with every retry, the client keeps the last
+  if (pending_session.options & RESUMPTION_OPTION) {
+    KCPTicket ticket;
+    ticket.session_id = pending_session.session_id;
+    ticket.options = pending_session.options;
+    if (IssueTicket(shard, ticket, buf + length, sizeof(buf) - length)) {
+      length += KCPTicketCrypter::kIssuedTicketLength;
+    }
+  }
+
+  SendPacket(shard, buf, length, SYN_PACKET, pending_session.session_id,
+             pending_session.peer_address);
+}
+
+void KCPServer::SendTicketPacket(
+    Shard* shard, const KCPTicket& ticket,
+    const muduo::net::InetAddress& client_address) {
+  char buf[KCPPublicHeader::kPublicHeaderLength +
+           KCPTicketCrypter::kIssuedTicketLength];
+  if (!IssueTicket(shard, ticket, buf + KCPPublicHeader::kPublicHeaderLength,
+                   KCPTicketCrypter::kIssuedTicketLength)) {
+    return;
+  }
+
+  SendPacket(shard, buf, sizeof(buf), TICKET_PACKET, ticket.session_id,
+             client_address);
+}
+
+bool KCPServer::IssueTicket(const Shard* shard, KCPTicket ticket, char* buf,
+                            size_t length) {
+  assert(buf != nullptr);
+
+  if (length < KCPTicketCrypter::kIssuedTicketLength) {
+    return false;
+  }
+
+  // not held for the ticket, taken by then it costs the client a handshake
+  if (!GenerateSessionId(shard, &ticket.resume_session_id)) {
+    LOG_ERROR << "GenerateSessionId failed, no ticket for session_id: "
+              << ticket.session_id;
+    return false;
+  }
+
+  uint32_t le32 = htole32(ticket.resume_session_id);
+  memcpy(buf, &le32, sizeof(le32));
+  return ticket_crypter_.Seal(ticket, muduo::Timestamp::now(),
+                              buf + sizeof(le32), length - sizeof(le32));
+}
+
+void KCPServer::SendPacket(Shard* shard, const char* data, size_t length,
+                           uint8_t packet_type, uint32_t session_id,
+                           const muduo::net::InetAddress& client_address) {
+  assert(length >= KCPPublicHeader::kPublicHeaderLength);
+
+  // the checksum covers whatever follows the public header
+  KCPPendingSendPacket packet(const_cast<char*>(data), length);
   KCPPendingSendPacket::ErrorCode result =
       packet.WritePublicHeader(packet_type, session_id);
   if (result != KCPPendingSendPacket::SUCCESS) {
@@ -417,7 +773,7 @@ void KCPServer::SendPacket(uint8_t packet_type, uint32_t session_id,
     return;
   }
 
-  int rc = socket_->SendTo(buf, sizeof(buf), client_address);
+  int rc = shard->socket->SendTo(data, length, client_address);
   if (rc < 0) {
     int saved_errno = -rc;
     LOG_ERROR << "SendTo failed, packet_type: " << packet_type
@@ -429,26 +785,32 @@ void KCPServer::SendPacket(uint8_t packet_type, uint32_t session_id,
 }
 
 void KCPServer::ProcessSynPacket(
-    const KCPPublicHeader& public_header, KCPReceivedPacket& packet,
-    const muduo::net::InetAddress& client_address) {
-  assert(packet.RemainingBytes() == 0);
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
+  assert(packet.RemainingBytes() <= sizeof(uint8_t));
   assert(public_header.packet_type == SYN_PACKET);
   assert(public_header.session_id == 0);
 
   UNUSED(public_header);
-  UNUSED(packet);
+
+  // an old client offers no options and must not get any back
+  uint8_t options = 0;
+  bool has_options = packet.ReadUInt8(&options);
+  uint8_t local_options = LocalOptions();
+
+  PendingSessionMap& pending_session_map = shard->pending_session_map;
 
   uint32_t session_id = 0;
   const std::string& session_key = client_address.toIpPort();
-  auto it = pending_session_map_.find(session_key);
-  if (it != pending_session_map_.end()) {
+  auto it = pending_session_map.find(session_key);
+  if (it != pending_session_map.end()) {
     std::unique_ptr<KCPPendingSession>& pending_session = it->second;
     if (pending_session->retry_times >= kServerMaxSynRetryTimes) {
       LOG_INFO << "server syn retry times reach limit, session_id: "
                << pending_session->session_id
                << ", client_address: " << client_address.toIpPort();
-      SendPacket(RST_PACKET, 0, client_address);
-      pending_session_map_.erase(it);
+      SendPacket(shard, RST_PACKET, 0, client_address);
+      pending_session_map.erase(it);
       return;
     }
 
@@ -457,9 +819,9 @@ void KCPServer::ProcessSynPacket(
 
     session_id = pending_session->session_id;
   } else {
-    if (!GenerateSessionId(&session_id)) {
+    if (!GenerateSessionId(shard, &session_id)) {
       LOG_ERROR << "GenerateSessionId failed";
-      SendPacket(RST_PACKET, 0, client_address);
+      SendPacket(shard, RST_PACKET, 0, client_address);
       return;
     }
 
@@ -468,7 +830,9 @@ void KCPServer::ProcessSynPacket(
     pending_session->syn_sent_time = pending_session->syn_received_time =
         muduo::Timestamp::now();
     pending_session->peer_address = client_address;
-    auto result = pending_session_map_.insert(
+    pending_session->options = options & local_options;
+    pending_session->has_options = has_options;
+    auto result = pending_session_map.insert(
         std::make_pair(session_key, std::move(pending_session)));
     if (!result.second) {
       return;
@@ -477,12 +841,12 @@ void KCPServer::ProcessSynPacket(
     it = result.first;
   }
 
-  SendPacket(SYN_PACKET, session_id, client_address);
+  SendSynPacket(shard, *it->second);
 }
 
 void KCPServer::ProcessPingPacket(
-    const KCPPublicHeader& public_header, KCPReceivedPacket& packet,
-    const muduo::net::InetAddress& client_address) {
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
   assert(packet.RemainingBytes() == 0);
   assert(public_header.packet_type == PING_PACKET);
   assert(public_header.session_id > 0);
@@ -491,47 +855,44 @@ void KCPServer::ProcessPingPacket(
   UNUSED(packet);
 
   uint32_t session_id = public_header.session_id;
-  auto session_it = session_map_.find(session_id);
-  if (session_it == session_map_.end()) {
+  if (!session_table_.Touch(session_id, muduo::Timestamp::now())) {
     LOG_ERROR << "received ping packet but session not exists, session_id: "
               << session_id
               << ", client_address: " << client_address.toIpPort();
-    SendPacket(RST_PACKET, session_id, client_address);
+    SendPacket(shard, RST_PACKET, session_id, client_address);
     return;
   }
 
-  auto idle_session_it = idle_session_map_.find(session_id);
-  if (idle_session_it != idle_session_map_.end()) {
-    idle_session_it->second = muduo::Timestamp::now();
-  } else {
-    LOG_WARN
-        << "received ping packet, but idle session not exists, session_id: "
-        << session_id << ", client_address: " << client_address.toIpPort();
-    idle_session_map_.insert(
-        std::make_pair(session_id, muduo::Timestamp::now()));
+  // the client may have rebound, the pong goes back along the path the ping
+  // came from either way, a session which knows of no challenge is only
+  // moved by its data as before, anyone can send a ping
+  KCPSessionPtr session = session_table_.Find(session_id);
+  if (session && session->migration()) {
+    session->ProbePeerAddress(client_address);
   }
 
-  SendPacket(PONG_PACKET, session_id, client_address);
+  SendPacket(shard, PONG_PACKET, session_id, client_address);
 }
 
 void KCPServer::ProcessAckPacket(
-    const KCPPublicHeader& public_header, KCPReceivedPacket& packet,
-    const muduo::net::InetAddress& client_address) {
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
   assert(packet.RemainingBytes() == 0);
   assert(public_header.packet_type == ACK_PACKET);
 
   UNUSED(public_header);
   UNUSED(packet);
 
+  PendingSessionMap& pending_session_map = shard->pending_session_map;
+
   uint32_t session_id = public_header.session_id;
   const std::string& session_key = client_address.toIpPort();
-  auto pending_session_it = pending_session_map_.find(session_key);
-  if (pending_session_it == pending_session_map_.end()) {
-    auto session_it = session_map_.find(session_id);
-    if (session_it == session_map_.end()) {
+  auto pending_session_it = pending_session_map.find(session_key);
+  if (pending_session_it == pending_session_map.end()) {
+    if (!session_table_.Find(session_id)) {
       LOG_INFO << "session not exists, session_id: " << session_id
                << ", client_address: " << client_address.toIpPort();
-      SendPacket(RST_PACKET, 0, client_address);
+      SendPacket(shard, RST_PACKET, 0, client_address);
       return;
     }
     LOG_INFO << "session already connected, session_id: " << session_id
@@ -543,44 +904,41 @@ void KCPServer::ProcessAckPacket(
       LOG_ERROR << "received ack packet with incorrect session_id: "
                 << session_id
                 << ", expected session_id: " << pending_session->session_id;
-      SendPacket(RST_PACKET, 0, client_address);
+      SendPacket(shard, RST_PACKET, 0, client_address);
       return;
     }
 
-    auto session_it = session_map_.find(session_id);
-    if (session_it != session_map_.end()) {
+    if (session_table_.Find(session_id)) {
       LOG_WARN << "received ack packet from client_addres: "
                << client_address.toIpPort()
                << " but session already connected, session_id: " << session_id;
       return;
     }
 
-    muduo::net::EventLoop* loop = thread_pool_->getLoopForHash(session_id);
+    muduo::net::EventLoop* loop = GetLoopForSession(shard, session_id);
 
     auto session = std::make_shared<KCPSession>(loop);
-    if (!InitializeSession(session, session_id, client_address)) {
+    if (!InitializeSession(session, session_id, client_address,
+                           pending_session->options)) {
       LOG_ERROR << "initialize session failed, session_id: " << session_id
                 << ", client_address: " << client_address.toIpPort();
       return;
     }
 
-    auto result = session_map_.insert(std::make_pair(session_id, session));
-    if (!result.second) {
+    if (!session_table_.Insert(session_id, session,
+                               muduo::Timestamp::now())) {
       LOG_ERROR << "insert session failed, session_id: " << session_id
                 << ", client_address: " << client_address.toIpPort();
+      session->loop()->runInLoop([session] { session->Close(); });
       return;
     }
-    pending_session_map_.erase(pending_session_it);
-
-    // ignore result
-    idle_session_map_.insert(
-        std::make_pair(session_id, muduo::Timestamp::now()));
+    pending_session_map.erase(pending_session_it);
   }
 }
 
 void KCPServer::ProcessRstPacket(
-    const KCPPublicHeader& public_header, KCPReceivedPacket& packet,
-    const muduo::net::InetAddress& client_address) {
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
   assert(packet.RemainingBytes() == 0);
   assert(public_header.packet_type == RST_PACKET);
 
@@ -588,47 +946,49 @@ void KCPServer::ProcessRstPacket(
   UNUSED(packet);
 
   uint32_t session_id = public_header.session_id;
-  pending_session_map_.erase(client_address.toIpPort());
+  shard->pending_session_map.erase(client_address.toIpPort());
 
-  auto session_it = session_map_.find(session_id);
-  if (session_it != session_map_.end()) {
-    KCPSessionPtr& session = session_it->second;
+  KCPSessionPtr session =
+      session_table_.Remove(session_id, muduo::Timestamp::now());
+  if (session) {
     session->loop()->runInLoop([session] { session->Close(); });
-    session_map_.erase(session_it);
-    muduo::Timestamp now = muduo::Timestamp::now();
-    time_wait_session_map_.insert(std::make_pair(session_id, now));
   }
-
-  idle_session_map_.erase(session_id);
 }
 
 bool KCPServer::InitializeSession(
     KCPSessionPtr& session, uint32_t session_id,
-    const muduo::net::InetAddress& client_address) {
-  KCPSession::Params params = kFastModeKCPParams;
+    const muduo::net::InetAddress& client_address, uint8_t options) {
+  KCPSession::Params params = session_params_;
   params.head_room = KCPPublicHeader::kPublicHeaderLength;
+  params.sack = (options & SACK_OPTION) ? 1 : 0;
+  params.checksum_type = ChecksumTypeFromOptions(options);
+  params.fec = (options & FEC_OPTION) ? 1 : 0;
+  params.datagram = (options & DATAGRAM_OPTION) ? 1 : 0;
+  params.migration = (options & MIGRATION_OPTION) ? 1 : 0;
 
   session->set_connection_callback(connection_callback_);
   session->set_message_callback(message_callback_);
   session->set_write_complete_callback(write_complete_callback_);
+  session->set_datagram_callback(datagram_callback_);
   session->set_high_water_mark_callback(high_water_mark_callback_);
-  session->set_output_callback([this](void* data, size_t len,
-                                      uint32_t curr_session_id,
-                                      const muduo::net::InetAddress& address) {
-    KCPPendingSendPacket pending_send_packet(static_cast<char*>(data), len);
-    KCPPendingSendPacket::ErrorCode result =
-        pending_send_packet.WritePublicHeader(DATA_PACKET, curr_session_id);
-    if (result != KCPPendingSendPacket::SUCCESS) {
-      LOG_ERROR << "WritePublicHeader failed, session_id: " << curr_session_id
-                << ", address: " << address.toIpPort();
-      return;
-    }
 
-    AppendPacket(pending_send_packet, address);
-    // socket_->SendTo(pending_send_packet.data(), pending_send_packet.length(),
-    //                address);
+  KCPSession::OutputTransport output_transport;
+  output_transport.acquire_buffer = AcquireTxBuffer;
+  output_transport.output = OutputSessionPacket;
+  output_transport.context = this;
+  session->set_output_transport(output_transport);
+  session->set_flush_tx_queue([this] {
+    auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
+    if (!thread_data.in_ingress_batch &&
+        !(thread_data.timer_wheel && thread_data.timer_wheel->InTick())) {
+      FlushTxQueue();
+    }
   });
-  session->set_flush_tx_queue([this] { FlushTxQueue(); });
+
+  auto timer_wheel_it = timer_wheels_.find(session->loop());
+  if (timer_wheel_it != timer_wheels_.end()) {
+    session->set_timer_wheel(timer_wheel_it->second);
+  }
 
   if (!session->Initialize(session_id, client_address, params)) {
     LOG_ERROR << "Initialize failed, session_id :" << session_id
@@ -640,47 +1000,301 @@ bool KCPServer::InitializeSession(
 }
 
 void KCPServer::ProcessDataPacket(
-    const KCPPublicHeader& public_header, KCPReceivedPacket& packet,
-    const muduo::net::InetAddress& client_address) {
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address,
+    RxSlot* rx_slot) {
+  PendingSessionMap& pending_session_map = shard->pending_session_map;
+
   uint32_t session_id = public_header.session_id;
-  auto session_it = session_map_.find(session_id);
-  if (session_it == session_map_.end()) {
+  KCPSessionPtr session = session_table_.Find(session_id);
+  if (!session) {
+    // the data of the client acks the syn as well, if the ack is lost or
+    // still on its way
     const std::string& pending_session_key = client_address.toIpPort();
-    auto pending_session_it = pending_session_map_.find(pending_session_key);
-    if (pending_session_it == pending_session_map_.end()) {
+    auto pending_session_it = pending_session_map.find(pending_session_key);
+    if (pending_session_it == pending_session_map.end() ||
+        pending_session_it->second->session_id != session_id) {
       LOG_ERROR << "received data packet but session not exists, session_id "
                 << session_id;
-      SendPacket(RST_PACKET, 0, client_address);
+      SendPacket(shard, RST_PACKET, 0, client_address);
       return;
     }
 
-    muduo::net::EventLoop* loop = thread_pool_->getLoopForHash(session_id);
-    auto session = std::make_shared<KCPSession>(loop);
-    if (!InitializeSession(session, session_id, client_address)) {
+    muduo::net::EventLoop* loop = GetLoopForSession(shard, session_id);
+    session = std::make_shared<KCPSession>(loop);
+    if (!InitializeSession(session, session_id, client_address,
+                           pending_session_it->second->options)) {
       LOG_ERROR << "InitializeSession failed, session_id: " << session_id
                 << ", client_address: " << client_address.toIpPort();
       return;
     }
 
-    auto result = session_map_.insert(std::make_pair(session_id, session));
-    if (!result.second) {
+    if (!session_table_.Insert(session_id, session,
+                               muduo::Timestamp::now())) {
       LOG_ERROR << "session insert failed, session_id :" << session_id
                 << ", client_address: " << client_address.toIpPort();
+      session->loop()->runInLoop([session] { session->Close(); });
+      return;
+    }
+    pending_session_map.erase(pending_session_it);
+  }
+
+  if (!AcceptsChecksum(*session, public_header, client_address)) {
+    return;
+  }
+
+  if (!session->loop()->isInLoopThread()) {
+    // share the receive slot with the loop of the session, a spare one is
+    // armed in its place, the packet is cloned only if the pool runs out
+    if (!rx_slot->spare) {
+      rx_slot->spare = shard->packet_pool->Acquire();
+    }
+    if (rx_slot->spare) {
+      AppendIngressPacket(shard, session, DATA_PACKET, packet, rx_slot->slot);
+      return;
+    }
+  }
+
+  session->ProcessPacket(packet, client_address);
+}
+
+bool KCPServer::AcceptsChecksum(
+    const KCPSession& session, const KCPPublicHeader& public_header,
+    const muduo::net::InetAddress& client_address) const {
+  // the type bits are not covered, a corrupted one must not turn the
+  // checksum agreed on off
+  if (public_header.checksum_type == NO_CHECKSUM &&
+      session.checksum_type() != NO_CHECKSUM) {
+    LOG_ERROR << "received unchecked packet of checked session, session_id: "
+              << public_header.session_id
+              << ", client_address: " << client_address.toIpPort();
+    return false;
+  }
+  return true;
+}
+
+void KCPServer::ProcessDatagramPacket(
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address,
+    RxSlot* rx_slot) {
+  assert(public_header.packet_type == DATAGRAM_PACKET);
+
+  uint32_t session_id = public_header.session_id;
+  KCPSessionPtr session = session_table_.Find(session_id);
+  if (!session) {
+    // ahead of the data which establishes the session, or lost anyway
+    if (shard->pending_session_map.count(client_address.toIpPort()) > 0) {
       return;
     }
-    session_it = result.first;
-    pending_session_map_.erase(pending_session_it);
 
-    // ignore result
-    idle_session_map_.insert(
-        std::make_pair(session_id, muduo::Timestamp::now()));
+    LOG_ERROR << "received datagram packet but session not exists, "
+                 "session_id "
+              << session_id;
+    SendPacket(shard, RST_PACKET, 0, client_address);
+    return;
+  }
+
+  if (!AcceptsChecksum(*session, public_header, client_address)) {
+    return;
+  }
+
+  if (!session->loop()->isInLoopThread()) {
+    if (!rx_slot->spare) {
+      rx_slot->spare = shard->packet_pool->Acquire();
+    }
+    if (rx_slot->spare) {
+      AppendIngressPacket(shard, session, DATAGRAM_PACKET, packet,
+                          rx_slot->slot);
+      return;
+    }
+  }
+
+  session->ProcessDatagram(packet, client_address);
+}
+
+void KCPServer::ProcessPathPacket(
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
+  assert(public_header.packet_type == PATH_CHALLENGE_PACKET ||
+         public_header.packet_type == PATH_RESPONSE_PACKET);
+
+  UNUSED(shard);
+
+  // looked up by the session id alone, the address is what is in question
+  uint32_t session_id = public_header.session_id;
+  KCPSessionPtr session = session_table_.Find(session_id);
+  if (!session) {
+    // no rst, anyone could have sent it from anywhere
+    LOG_DEBUG << "received path packet but session not exists, session_id: "
+              << session_id
+              << ", client_address: " << client_address.toIpPort();
+    return;
+  }
+
+  session->ProcessPathPacket(public_header.packet_type, packet,
+                             client_address);
+}
+
+void KCPServer::ProcessResumePacket(
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
+  assert(public_header.packet_type == RESUME_PACKET);
+
+  muduo::Timestamp now = muduo::Timestamp::now();
+  uint32_t session_id = public_header.session_id;
+
+  // a refused ticket costs the client the handshake it was to save, it
+  // starts one on the rst, the data which came along is lost with it, the
+  // id of the ticket was not held for it and may have been handed out since,
+  // which is found before the ticket is spent
+  uint8_t options = 0;
+  KCPTicket ticket;
+  if (!resumption_enabled_ || session_id == 0 ||
+      session_table_.Contains(session_id) || !packet.ReadUInt8(&options) ||
+      !ticket_crypter_.Open(packet.RemainingData(), packet.RemainingBytes(),
+                            now, true, &ticket) ||
+      ticket.resume_session_id != session_id) {
+    LOG_INFO << "resumption refused, session_id: " << session_id
+             << ", client_address: " << client_address.toIpPort();
+    SendPacket(shard, RST_PACKET, session_id, client_address);
+    return;
+  }
+
+  // the client takes the options of the ticket which it still offers, the
+  // server must still agree on them all
+  options &= ticket.options;
+  if ((options & LocalOptions()) != options) {
+    LOG_INFO << "resumption refused with options changed, session_id: "
+             << session_id
+             << ", client_address: " << client_address.toIpPort();
+    SendPacket(shard, RST_PACKET, session_id, client_address);
+    return;
+  }
+
+  muduo::net::EventLoop* loop = GetLoopForSession(shard, session_id);
+  auto session = std::make_shared<KCPSession>(loop);
+  if (!InitializeSession(session, session_id, client_address, options)) {
+    LOG_ERROR << "InitializeSession failed, session_id: " << session_id
+              << ", client_address: " << client_address.toIpPort();
+    return;
+  }
+
+  // taken by another loop since it was looked up
+  if (!session_table_.Insert(session_id, session, now)) {
+    LOG_INFO << "resumption refused with session_id taken, session_id: "
+             << session_id
+             << ", client_address: " << client_address.toIpPort();
+    session->loop()->runInLoop([session] { session->Close(); });
+    SendPacket(shard, RST_PACKET, session_id, client_address);
+    return;
+  }
+
+  // the client has given up the session of the ticket if the server has not
+  // yet, its late packets miss the session resumed, see KCPTicket
+  KCPSessionPtr resumed = session_table_.Remove(ticket.session_id, now);
+  if (resumed) {
+    resumed->loop()->runInLoop([resumed] { resumed->Close(); });
+  }
+  shard->pending_session_map.erase(client_address.toIpPort());
+
+  LOG_INFO << "session resumed, session_id: " << session_id
+           << ", session_id resumed: " << ticket.session_id
+           << ", client_address: " << client_address.toIpPort();
+
+  // the next ticket, the ticket of the resumption is spent
+  ticket.session_id = session_id;
+  ticket.options = options;
+  SendTicketPacket(shard, ticket, client_address);
+}
+
+void KCPServer::ProcessTicketPacket(
+    Shard* shard, const KCPPublicHeader& public_header,
+    KCPReceivedPacket& packet, const muduo::net::InetAddress& client_address) {
+  assert(public_header.packet_type == TICKET_PACKET);
+
+  // the ticket the client has vouches for the options, a fresh one goes out
+  // for a session still established
+  uint32_t session_id = public_header.session_id;
+  KCPTicket ticket;
+  if (!resumption_enabled_ || !session_table_.Find(session_id) ||
+      !ticket_crypter_.Open(packet.RemainingData(), packet.RemainingBytes(),
+                            muduo::Timestamp::now(), false, &ticket) ||
+      ticket.session_id != session_id) {
+    LOG_DEBUG << "ticket refresh refused, session_id: " << session_id
+              << ", client_address: " << client_address.toIpPort();
+    return;
+  }
+
+  SendTicketPacket(shard, ticket, client_address);
+}
+
+void KCPServer::AppendIngressPacket(Shard* shard,
+                                    const KCPSessionPtr& session,
+                                    uint8_t packet_type,
+                                    const KCPReceivedPacket& packet,
+                                    KCPPacketRef slot) {
+  muduo::net::EventLoop* loop = session->loop();
+
+  // only a few loops, a linear search is fine
+  auto it = std::find_if(
+      shard->ingress_batches.begin(), shard->ingress_batches.end(),
+      [loop](const IngressBatch& batch) { return batch.loop == loop; });
+  if (it == shard->ingress_batches.end()) {
+    IngressBatch batch;
+    batch.loop = loop;
+    it = shard->ingress_batches.insert(it, std::move(batch));
+  }
+
+  IngressPacket ingress_packet;
+  ingress_packet.session = session;
+  ingress_packet.offset =
+      static_cast<size_t>(packet.RemainingData() - slot->buf);
+  ingress_packet.length = packet.RemainingBytes();
+  ingress_packet.packet_type = packet_type;
+  ingress_packet.slot = std::move(slot);
+  it->packets.push_back(std::move(ingress_packet));
+}
+
+void KCPServer::DispatchIngressBatches(Shard* shard) {
+  for (IngressBatch& batch : shard->ingress_batches) {
+    if (batch.packets.empty()) {
+      continue;
+    }
+
+    // a muduo Functor must be copyable
+    auto packets = std::make_shared<IngressPackets>();
+    packets->swap(batch.packets);
+    batch.loop->queueInLoop(
+        [this, packets] { ProcessIngressBatch(*packets); });
+  }
+}
+
+void KCPServer::ProcessIngressBatch(IngressPackets& packets) {
+  auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
+
+  thread_data.in_ingress_batch = true;
+  for (IngressPacket& ingress_packet : packets) {
+    KCPPacketSlot* slot = ingress_packet.slot.get();
+    KCPReceivedPacket packet(slot->buf + ingress_packet.offset,
+                             ingress_packet.length);
+    if (ingress_packet.packet_type == DATAGRAM_PACKET) {
+      ingress_packet.session->ProcessDatagram(packet,
+                                              std::move(ingress_packet.slot));
+    } else {
+      ingress_packet.session->ProcessPacket(packet,
+                                            std::move(ingress_packet.slot));
+    }
   }
+  thread_data.in_ingress_batch = false;
 
-  session_it->second->ProcessPacket(packet, client_address);
+  FlushTxQueue();
 }
 
-void KCPServer::ProcessPacket(KCPReceivedPacket& packet,
-                              const muduo::net::InetAddress& client_address) {
+void KCPServer::ProcessPacket(Shard* shard, RxSlot* rx_slot, const char* data,
+                              size_t length) {
+  KCPReceivedPacket packet(data, length);
+  const muduo::net::InetAddress& client_address = rx_slot->slot->peer_address;
+
   if (packet.length() > kMaxPacketSize) {
     LOG_ERROR << "received incorrect packet length: " << packet.length()
               << ", max length limit: " << kMaxPacketSize;
@@ -696,25 +1310,51 @@ void KCPServer::ProcessPacket(KCPReceivedPacket& packet,
     return;
   }
 
+  if (public_header.checksum_type == NO_CHECKSUM &&
+      !(checksum_options_ & NO_CHECKSUM_OPTION)) {
+    LOG_ERROR << "received unchecked packet, client_address: "
+              << client_address.toIpPort();
+    return;
+  }
+
   switch (public_header.packet_type) {
     case SYN_PACKET: {
-      ProcessSynPacket(public_header, packet, client_address);
+      ProcessSynPacket(shard, public_header, packet, client_address);
       break;
     }
     case ACK_PACKET: {
-      ProcessAckPacket(public_header, packet, client_address);
+      ProcessAckPacket(shard, public_header, packet, client_address);
       break;
     }
     case RST_PACKET: {
-      ProcessRstPacket(public_header, packet, client_address);
+      ProcessRstPacket(shard, public_header, packet, client_address);
       break;
     }
     case PING_PACKET: {
-      ProcessPingPacket(public_header, packet, client_address);
+      ProcessPingPacket(shard, public_header, packet, client_address);
       break;
     }
     case DATA_PACKET: {
-      ProcessDataPacket(public_header, packet, client_address);
+      ProcessDataPacket(shard, public_header, packet, client_address,
+                        rx_slot);
+      break;
+    }
+    case DATAGRAM_PACKET: {
+      ProcessDatagramPacket(shard, public_header, packet, client_address,
+                            rx_slot);
+      break;
+    }
+    case PATH_CHALLENGE_PACKET:
+    case PATH_RESPONSE_PACKET: {
+      ProcessPathPacket(shard, public_header, packet, client_address);
+      break;
+    }
+    case RESUME_PACKET: {
+      ProcessResumePacket(shard, public_header, packet, client_address);
+      break;
+    }
+    case TICKET_PACKET: {
+      ProcessTicketPacket(shard, public_header, packet, client_address);
       break;
     }
     default: {
@@ -725,7 +1365,7 @@ void KCPServer::ProcessPacket(KCPReceivedPacket& packet,
   }
 }
 
-void KCPServer::InitializeThread(muduo::net::EventLoop*) const {
+void KCPServer::InitializeThread(muduo::net::EventLoop* loop) {
   auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
 
   thread_data.mmsg_hdrs = std::make_unique<mmsghdr[]>(kNumPacketsPerSend);
@@ -746,11 +1386,116 @@ void KCPServer::InitializeThread(muduo::net::EventLoop*) const {
     hdr->msg_iov = &pkt->iov;
     hdr->msg_iovlen = 1;
   }
+
+  thread_data.gso_enabled = gso_supported_;
+  if (thread_data.gso_enabled) {
+    thread_data.gso_hdrs = std::make_unique<mmsghdr[]>(kNumPacketsPerSend);
+    thread_data.gso_iovs = std::make_unique<struct iovec[]>(kNumPacketsPerSend);
+    thread_data.gso_controls =
+        std::make_unique<GSOControl[]>(kNumPacketsPerSend);
+    memset(thread_data.gso_hdrs.get(), 0,
+           kNumPacketsPerSend * sizeof(mmsghdr));
+  }
+
+  thread_data.tx_time_enabled = tx_time_supported_;
+  if (thread_data.tx_time_enabled) {
+    thread_data.tx_time_controls =
+        std::make_unique<TxTimeControl[]>(kNumPacketsPerSend);
+  }
+
+  thread_data.backlog_pool = std::make_unique<KCPPacketPool>(
+      kNumTxBacklogPackets, kMaxPacketSize);
+
+  thread_data.timer_wheel = std::make_unique<KCPTimerWheel>(loop);
+  thread_data.timer_wheel->set_tick_callback([this] { FlushTxQueue(); });
+  timer_wheels_[loop] = thread_data.timer_wheel.get();
+
+  // all threads share the only socket by default, see StartShard for the
+  // reuse port mode
+  if (!reuse_port_) {
+    InitializeThreadSocket(loop, *shards_.front()->socket);
+  }
+}
+
+void KCPServer::InitializeThreadSocket(muduo::net::EventLoop* loop,
+                                       const UDPSocket& socket) {
+  loop->assertInLoopThread();
+
+  auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
+  assert(!thread_data.socket);
+
+  // the same socket, but the channel needs a descriptor of its own as the
+  // loop of a shard may already watch the original one
+  auto thread_socket = std::make_unique<UDPSocket>();
+  int rc = socket.Duplicate(thread_socket.get());
+  if (rc < 0) {
+    LOG_FATAL << "Duplicate error: " << rc;
+  }
+
+  thread_data.channel =
+      std::make_unique<muduo::net::Channel>(loop, thread_socket->sockfd());
+  thread_data.channel->setWriteCallback([this] { HandleWrite(); });
+  thread_data.socket = std::move(thread_socket);
+}
+
+void KCPServer::ResetThread() {
+  auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
+
+  if (thread_data.channel) {
+    if (thread_data.channel->isWriting()) {
+      SetWritable();
+    }
+    thread_data.channel->disableAll();
+    thread_data.channel->remove();
+    thread_data.channel.reset();
+  }
+
+  thread_data.socket.reset();
+  thread_data.backlog.clear();
+  thread_data.backlog_pool.reset();
+  thread_data.num_packets = 0;
+  thread_data.timer_wheel.reset();
+}
+
+void KCPServer::OutputSessionPacket(KCPSession* session, char* data,
+                                    size_t len, uint8_t packet_type,
+                                    const muduo::net::InetAddress& address,
+                                    void* context) {
+  auto server = static_cast<KCPServer*>(context);
+
+  KCPPendingSendPacket packet(data, len);
+  KCPPendingSendPacket::ErrorCode result = packet.WritePublicHeader(
+      packet_type, session->session_id(), session->checksum_type());
+  if (result != KCPPendingSendPacket::SUCCESS) {
+    LOG_ERROR << "WritePublicHeader failed, session_id: "
+              << session->session_id()
+              << ", address: " << address.toIpPort();
+    return;
+  }
+
+  server->AppendPacket(
+      packet, address,
+      server->tx_time_supported_ ? session->NextDepartureTime(len) : 0);
+}
+
+char* KCPServer::AcquireTxBuffer(size_t capacity, void* context) {
+  UNUSED(context);
+
+  auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
+  unsigned int index = thread_data.num_packets;
+  if (!thread_data.raw_packets || index >= kNumPacketsPerSend ||
+      capacity > kMaxPacketSize) {
+    return nullptr;
+  }
+
+  // the slot is only taken by AppendPacket, until then it is free to be
+  // handed out again
+  return thread_data.raw_packets[index].buf;
 }
 
-void KCPServer::AppendPacket(
-    const KCPPendingSendPacket& packet,
-    const muduo::net::InetAddress& address) /* const */ {
+void KCPServer::AppendPacket(const KCPPendingSendPacket& packet,
+                             const muduo::net::InetAddress& address,
+                             uint64_t tx_time) /* const */ {
   if (packet.length() > kMaxPacketSize) {
     LOG_ERROR << "AppendPacket with invalid data length: " << packet.length()
               << " address: " << address.toIpPort();
@@ -774,7 +1519,26 @@ void KCPServer::AppendPacket(
 
   RawPacket* pkt = &thread_data.raw_packets[index];
   pkt->iov.iov_len = packet.length();
-  memcpy(pkt->iov.iov_base, packet.data(), packet.length());
+  // built in place if it came from AcquireTxBuffer
+  if (packet.data() != pkt->buf) {
+    memcpy(pkt->iov.iov_base, packet.data(), packet.length());
+  }
+
+  pkt->tx_time = thread_data.tx_time_enabled ? tx_time : 0;
+  if (pkt->tx_time > 0) {
+    TxTimeControl* control = &thread_data.tx_time_controls[index];
+    hdr->msg_control = control->buf;
+    hdr->msg_controllen = sizeof(control->buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &pkt->tx_time, sizeof(pkt->tx_time));
+  } else {
+    hdr->msg_control = nullptr;
+    hdr->msg_controllen = 0;
+  }
 
   ++thread_data.num_packets;
   if (thread_data.num_packets >= kNumPacketsPerSend) {
@@ -782,6 +1546,84 @@ void KCPServer::AppendPacket(
   }
 }
 
+// udp gso requires the segments of a send to have the same size, except the
+// last one which may be shorter, the segments leave together so packets with
+// different departure times are not coalesced
+// https://lwn.net/Articles/752184/
+static_assert(kNumPacketsPerSend * kMaxPacketSize <= 65507,
+              "coalesced packets must fit in one udp datagram");
+
+unsigned int KCPServer::CoalesceTxQueue(ThreadData* thread_data) {
+  unsigned int num_packets = thread_data->num_packets;
+  unsigned int num_hdrs = 0;
+
+  for (unsigned int i = 0; i < num_packets;) {
+    const struct msghdr& first = thread_data->mmsg_hdrs[i].msg_hdr;
+    size_t segment_size = thread_data->raw_packets[i].iov.iov_len;
+    uint64_t tx_time = thread_data->raw_packets[i].tx_time;
+
+    unsigned int j = i + 1;
+    size_t last_size = segment_size;
+    while (j < num_packets && last_size == segment_size) {
+      const struct msghdr& next = thread_data->mmsg_hdrs[j].msg_hdr;
+      size_t size = thread_data->raw_packets[j].iov.iov_len;
+      if (size > segment_size || next.msg_namelen != first.msg_namelen ||
+          memcmp(next.msg_name, first.msg_name, first.msg_namelen) != 0 ||
+          thread_data->raw_packets[j].tx_time != tx_time) {
+        break;
+      }
+      last_size = size;
+      ++j;
+    }
+
+    for (unsigned int k = i; k < j; ++k) {
+      thread_data->gso_iovs[k] = thread_data->raw_packets[k].iov;
+    }
+
+    struct msghdr* hdr = &thread_data->gso_hdrs[num_hdrs].msg_hdr;
+    hdr->msg_name = first.msg_name;
+    hdr->msg_namelen = first.msg_namelen;
+    hdr->msg_iov = &thread_data->gso_iovs[i];
+    hdr->msg_iovlen = j - i;
+    hdr->msg_flags = 0;
+
+    // the cmsgs are laid out by hand, CMSG_NXTHDR reads the length of the
+    // next header which is not written yet
+    GSOControl* control = &thread_data->gso_controls[num_hdrs];
+    size_t control_len = 0;
+    if (j - i > 1) {
+      auto cmsg = reinterpret_cast<struct cmsghdr*>(control->buf);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      auto gso_size = static_cast<uint16_t>(segment_size);
+      memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+      control_len += CMSG_SPACE(sizeof(uint16_t));
+    }
+    if (tx_time > 0) {
+      auto cmsg = reinterpret_cast<struct cmsghdr*>(control->buf + control_len);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+      memcpy(CMSG_DATA(cmsg), &tx_time, sizeof(tx_time));
+      control_len += CMSG_SPACE(sizeof(uint64_t));
+    }
+
+    if (control_len > 0) {
+      hdr->msg_control = control->buf;
+      hdr->msg_controllen = control_len;
+    } else {
+      hdr->msg_control = nullptr;
+      hdr->msg_controllen = 0;
+    }
+
+    ++num_hdrs;
+    i = j;
+  }
+
+  return num_hdrs;
+}
+
 void KCPServer::FlushTxQueue() /* const */ {
   auto& thread_data = muduo::ThreadLocalSingleton<ThreadData>::instance();
 
@@ -791,35 +1633,107 @@ void KCPServer::FlushTxQueue() /* const */ {
   }
 
   assert(num_packets <= kNumPacketsPerSend);
+  assert(thread_data.socket);
+
+  // keep the order, nothing is sent before the backlog has been drained
+  if (!thread_data.backlog.empty()) {
+    AppendTxBacklog(&thread_data, 0);
+    thread_data.num_packets = 0;
+    return;
+  }
 
-  std::unique_ptr<mmsghdr[]>& mmsg_hdrs = thread_data.mmsg_hdrs;
+  mmsghdr* send_hdrs = thread_data.mmsg_hdrs.get();
+  unsigned int num_hdrs = num_packets;
+  if (thread_data.gso_enabled) {
+    send_hdrs = thread_data.gso_hdrs.get();
+    num_hdrs = CoalesceTxQueue(&thread_data);
+  }
 
   // thread safe
   // man 2 sendmmsg
   // An error is returned only if no datagrams could be sent.
-  int rc = socket_->SendMmsg(mmsg_hdrs.get(), num_packets);
-  if (rc < 0) {
-    int saved_errno = -rc;
-    if (IS_EAGAIN(saved_errno)) {
-      // MutexLockGuard ...
-      // SetWriteBlocked();
-      // channel_->enableWriting();
-      // cache packets unsent
-    } else {
-      // print thread local error
+  unsigned int first_hdr = 0;
+  // sent or dropped
+  unsigned int packets_done = 0;
+  while (first_hdr < num_hdrs) {
+    int rc = thread_data.socket->SendMmsg(send_hdrs + first_hdr,
+                                          num_hdrs - first_hdr);
+    if (rc == -EIO && thread_data.gso_enabled) {
+      // the device can not do the segmentation (checksum offload off)
+      LOG_WARN << "SendMmsg with udp gso failed, disabled for this thread";
+      thread_data.gso_enabled = false;
+      send_hdrs = thread_data.mmsg_hdrs.get();
+      num_hdrs = num_packets;
+      first_hdr = packets_done;
+      continue;
+    }
+
+    if (rc < 0) {
+      int saved_errno = -rc;
+      if (IS_EAGAIN(saved_errno)) {
+        AppendTxBacklog(&thread_data, packets_done);
+        break;
+      }
+
+      // the first one can not be sent at all, drop it and go on with the
+      // packets of the other peers, as HandleWrite does
+      const struct msghdr& hdr = send_hdrs[first_hdr].msg_hdr;
       LOG_ERROR << "SendMmsg error: " << saved_errno
                 << ", detail: " << muduo::strerror_tl(saved_errno)
-                << ", packets unsent: " << num_packets;
+                << ", packets dropped: " << hdr.msg_iovlen;
+      for (size_t i = 0; i < hdr.msg_iovlen; ++i) {
+        ++num_dropped_tx_packets_;
+        num_dropped_tx_bytes_ += hdr.msg_iov[i].iov_len;
+      }
+      packets_done += static_cast<unsigned int>(hdr.msg_iovlen);
+      ++first_hdr;
+      continue;
     }
-  } else {
-    auto packets_sent = static_cast<unsigned int>(rc);
-    if (packets_sent < num_packets) {
+
+    auto hdrs_sent = static_cast<unsigned int>(rc);
+    for (unsigned int i = first_hdr; i < first_hdr + hdrs_sent; ++i) {
+      packets_done +=
+          static_cast<unsigned int>(send_hdrs[i].msg_hdr.msg_iovlen);
+    }
+    first_hdr += hdrs_sent;
+
+    if (first_hdr < num_hdrs) {
       LOG_WARN << "FlushTxQueue total packets: " << num_packets
-               << ", sent: " << packets_sent
-               << ", unsent: " << (num_packets - packets_sent);
-      // cache packets unsent
+               << ", done: " << packets_done
+               << ", unsent: " << (num_packets - packets_done);
+      AppendTxBacklog(&thread_data, packets_done);
+      break;
     }
   }
 
   thread_data.num_packets = 0;
 }
+
+void KCPServer::AppendTxBacklog(ThreadData* thread_data,
+                                unsigned int first_packet) {
+  for (unsigned int i = first_packet; i < thread_data->num_packets; ++i) {
+    const RawPacket& raw_packet = thread_data->raw_packets[i];
+    size_t length = raw_packet.iov.iov_len;
+    BacklogPacket backlog_packet;
+    backlog_packet.slot = thread_data->backlog_pool->Acquire();
+    if (!backlog_packet.slot) {
+      ++num_dropped_tx_packets_;
+      num_dropped_tx_bytes_ += length;
+      continue;
+    }
+
+    KCPPacketSlot* slot = backlog_packet.slot.get();
+    backlog_packet.addr_len = thread_data->mmsg_hdrs[i].msg_hdr.msg_namelen;
+    backlog_packet.tx_time = raw_packet.tx_time;
+    memcpy(&slot->addr, &raw_packet.addr, backlog_packet.addr_len);
+    memcpy(slot->buf, raw_packet.buf, length);
+    slot->iov.iov_len = length;
+
+    thread_data->backlog.push_back(std::move(backlog_packet));
+  }
+
+  if (!thread_data->backlog.empty() && !thread_data->channel->isWriting()) {
+    thread_data->channel->enableWriting();
+    SetWriteBlocked();
+  }
+}
@@ -4,8 +4,11 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include <muduo/base/Timestamp.h>
 #include <muduo/net/InetAddress.h>
@@ -15,7 +18,12 @@
 
 #include "kcp_callbacks.h"
 #include "kcp_constants.h"
+#include "kcp_packet_pool.h"
 #include "kcp_packets.h"
+#include "kcp_session.h"
+#include "kcp_session_table.h"
+#include "kcp_ticket.h"
+#include "kcp_timer_wheel.h"
 
 namespace muduo {
 namespace net {
@@ -52,101 +60,363 @@ class KCPServer final {
     write_complete_callback_ = std::move(cb);
   }
 
+  void set_datagram_callback(DatagramCallback cb) {
+    datagram_callback_ = std::move(cb);
+  }
+
   void set_high_water_mark_callback(HighWaterMarkCallback cb) {
     high_water_mark_callback_ = std::move(cb);
   }
 
   void set_num_threads(uint8_t num_threads) { num_threads_ = num_threads; }
 
-  bool IsWriteBlocked() const { return write_blocked_; }
+  // every loop of the thread pool binds its own SO_REUSEPORT socket and owns
+  // the sessions received on it, must be set before Listen
+  void set_reuse_port(bool reuse_port) { reuse_port_ = reuse_port; }
+
+  // steer packets to the socket by session_id instead of the 4-tuple hash, so
+  // a session stays on its shard after the client address changes, only used
+  // with reuse port, must be set before Listen
+  void set_session_affinity(bool session_affinity) {
+    session_affinity_ = session_affinity;
+  }
+
+  // coalesce same sized packets to the same peer into one udp gso send, only
+  // used if the kernel supports it, must be set before Listen
+  void set_udp_gso(bool udp_gso) { udp_gso_ = udp_gso; }
+
+  // receive coalesced datagrams with udp gro and split them into packets,
+  // needs larger receive buffers, must be set before Listen
+  void set_udp_gro(bool udp_gro) { udp_gro_ = udp_gro; }
+
+  // agree on selective acks with the clients offering them in the syn
+  void set_sack_enabled(bool sack_enabled) { sack_enabled_ = sack_enabled; }
+
+  // agree on parity packets with the clients offering them in the syn
+  void set_fec_enabled(bool fec_enabled) { fec_enabled_ = fec_enabled; }
+
+  // agree on datagrams with the clients offering them in the syn, see
+  // KCPSession::SendDatagram
+  void set_datagram_enabled(bool datagram_enabled) {
+    datagram_enabled_ = datagram_enabled;
+  }
+
+  // agree on path validation with the clients offering it in the syn, a
+  // session then moves to another address of its client only once the
+  // client has answered a challenge sent there
+  void set_migration_enabled(bool migration_enabled) {
+    migration_enabled_ = migration_enabled;
+  }
+
+  // hand out tickets to the clients offering resumption in the syn, a client
+  // reconnecting with one takes its session up again without a handshake
+  void set_resumption_enabled(bool resumption_enabled) {
+    resumption_enabled_ = resumption_enabled;
+  }
+
+  // checksums agreed on with the clients asking for them, a mask of
+  // CRC32C_OPTION and NO_CHECKSUM_OPTION, adler32 is always accepted
+  void set_checksum_options(uint8_t checksum_options) {
+    checksum_options_ = checksum_options & (CRC32C_OPTION | NO_CHECKSUM_OPTION);
+  }
+
+  // params of the accepted sessions, kFastModeKCPParams by default, the head
+  // room and the options agreed on are filled in by the server
+  void set_session_params(const KCPSession::Params& session_params) {
+    session_params_ = session_params;
+  }
+
+  // stamp the packets of paced sessions with their departure time and leave
+  // the spacing to the kernel, needs the fq qdisc on the egress device, only
+  // used if the kernel supports it, must be set before Listen
+  void set_tx_time(bool tx_time) { tx_time_ = tx_time; }
+
+  // some loop is waiting for its socket to become writable
+  bool IsWriteBlocked() const { return num_write_blocked_threads_ > 0; }
+
+  // packets dropped because the tx backlog of a loop was full
+  uint64_t num_dropped_tx_packets() const { return num_dropped_tx_packets_; }
+  uint64_t num_dropped_tx_bytes() const { return num_dropped_tx_bytes_; }
 
  private:
-  void Initialize();
+  struct Shard;
+  struct ThreadData;
+  struct RxSlot;
+
+  int CreateSocket(const muduo::net::InetAddress& address,
+                   std::unique_ptr<UDPSocket>* socket) const;
+
+  void InitializeShard(Shard* shard) const;
+
+  int AttachSessionAffinityFilter(UDPSocket* socket, uint32_t num_shards);
+
+  void StartShard(Shard* shard);
+
+  void StopShard(Shard* shard);
+
+  void CloseAllSessions();
 
-  void RunPeriodicTask();
+  void RunPeriodicTask(Shard* shard);
 
-  void HandleRead(muduo::Timestamp receive_time);
+  void HandleRead(Shard* shard, muduo::Timestamp receive_time);
 
   void HandleWrite();
 
-  void HandleError();
+  void HandleError(Shard* shard);
 
-  bool GenerateSessionId(uint32_t* session_id) const;
+  bool GenerateSessionId(const Shard* shard, uint32_t* session_id) const;
+
+  muduo::net::EventLoop* GetLoopForSession(const Shard* shard,
+                                           uint32_t session_id) const;
 
   bool InitializeSession(KCPSessionPtr& session, uint32_t session_id,
-                         const muduo::net::InetAddress& client_address);
+                         const muduo::net::InetAddress& client_address,
+                         uint8_t options);
 
-  void SendPacket(uint8_t packet_type, uint32_t session_id,
+  void SendPacket(Shard* shard, uint8_t packet_type, uint32_t session_id,
+                  const muduo::net::InetAddress& client_address);
+  // a syn echoing the options agreed on, if the client offered any, and a
+  // ticket if resumption is among them
+  void SendSynPacket(Shard* shard, const KCPPendingSession& pending_session);
+  void SendTicketPacket(Shard* shard, const KCPTicket& ticket,
+                        const muduo::net::InetAddress& client_address);
+  // a fresh resume_session_id and the ticket sealed with it, to |buf| of
+  // KCPTicketCrypter::kIssuedTicketLength bytes at least
+  bool IssueTicket(const Shard* shard, KCPTicket ticket, char* buf,
+                   size_t length);
+  void SendPacket(Shard* shard, const char* data, size_t length,
+                  uint8_t packet_type, uint32_t session_id,
                   const muduo::net::InetAddress& client_address);
 
-  void ProcessSynPacket(const KCPPublicHeader& public_header,
+  void ProcessSynPacket(Shard* shard, const KCPPublicHeader& public_header,
                         KCPReceivedPacket& packet,
                         const muduo::net::InetAddress& client_address);
-  void ProcessAckPacket(const KCPPublicHeader& public_header,
+  void ProcessAckPacket(Shard* shard, const KCPPublicHeader& public_header,
                         KCPReceivedPacket& packet,
                         const muduo::net::InetAddress& client_address);
-  void ProcessPingPacket(const KCPPublicHeader& public_header,
+  void ProcessPingPacket(Shard* shard, const KCPPublicHeader& public_header,
                          KCPReceivedPacket& packet,
                          const muduo::net::InetAddress& client_address);
-  void ProcessRstPacket(const KCPPublicHeader& public_header,
+  void ProcessRstPacket(Shard* shard, const KCPPublicHeader& public_header,
                         KCPReceivedPacket& packet,
                         const muduo::net::InetAddress& client_address);
-  void ProcessDataPacket(const KCPPublicHeader& public_header,
+  void ProcessDataPacket(Shard* shard, const KCPPublicHeader& public_header,
+                         KCPReceivedPacket& packet,
+                         const muduo::net::InetAddress& client_address,
+                         RxSlot* rx_slot);
+  // NO_CHECKSUM packets only for a session which agreed on no checksum
+  bool AcceptsChecksum(const KCPSession& session,
+                       const KCPPublicHeader& public_header,
+                       const muduo::net::InetAddress& client_address) const;
+  // only for a session established, the reliable data establishes it
+  void ProcessDatagramPacket(Shard* shard,
+                             const KCPPublicHeader& public_header,
+                             KCPReceivedPacket& packet,
+                             const muduo::net::InetAddress& client_address,
+                             RxSlot* rx_slot);
+  void ProcessPathPacket(Shard* shard, const KCPPublicHeader& public_header,
                          KCPReceivedPacket& packet,
                          const muduo::net::InetAddress& client_address);
-  void ProcessPacket(KCPReceivedPacket& packet,
-                     const muduo::net::InetAddress& client_address);
-
-  void SetWritable() { write_blocked_ = false; }
-  void SetWriteBlocked() { write_blocked_ = true; }
-
-  void InitializeThread(muduo::net::EventLoop* loop) const;
+  void ProcessResumePacket(Shard* shard, const KCPPublicHeader& public_header,
+                           KCPReceivedPacket& packet,
+                           const muduo::net::InetAddress& client_address);
+  void ProcessTicketPacket(Shard* shard, const KCPPublicHeader& public_header,
+                           KCPReceivedPacket& packet,
+                           const muduo::net::InetAddress& client_address);
+
+  uint8_t LocalOptions() const {
+    return static_cast<uint8_t>(
+        (sack_enabled_ ? SACK_OPTION : 0) | (fec_enabled_ ? FEC_OPTION : 0) |
+        (datagram_enabled_ ? DATAGRAM_OPTION : 0) |
+        (migration_enabled_ ? MIGRATION_OPTION : 0) |
+        (resumption_enabled_ ? RESUMPTION_OPTION : 0) | checksum_options_);
+  }
+  void ProcessPacket(Shard* shard, RxSlot* rx_slot, const char* data,
+                     size_t length);
+
+  void AppendIngressPacket(Shard* shard, const KCPSessionPtr& session,
+                           uint8_t packet_type, const KCPReceivedPacket& packet,
+                           KCPPacketRef slot);
+  void DispatchIngressBatches(Shard* shard);
+
+  void SetWritable() { --num_write_blocked_threads_; }
+  void SetWriteBlocked() { ++num_write_blocked_threads_; }
+
+  void InitializeThread(muduo::net::EventLoop* loop);
+  void InitializeThreadSocket(muduo::net::EventLoop* loop,
+                              const UDPSocket& socket);
+  void ResetThread();
+  // KCPSession::OutputTransport of the sessions, |context| is the server
+  static void OutputSessionPacket(KCPSession* session, char* data,
+                                  size_t len, uint8_t packet_type,
+                                  const muduo::net::InetAddress& address,
+                                  void* context);
+  // the tx queue slot the next packet may be built in, AppendPacket takes
+  // it without a copy
+  static char* AcquireTxBuffer(size_t capacity, void* context);
   void AppendPacket(const KCPPendingSendPacket& packet,
-                    const muduo::net::InetAddress& address);
+                    const muduo::net::InetAddress& address,
+                    uint64_t tx_time);
   void FlushTxQueue();
+  static unsigned int CoalesceTxQueue(ThreadData* thread_data);
+  void AppendTxBacklog(ThreadData* thread_data, unsigned int first_packet);
 
   struct RawPacket {
     struct iovec iov;
     struct sockaddr_storage addr;
+    // CLOCK_MONOTONIC ns to leave at, 0 if now
+    uint64_t tx_time{0};
     // MSG_TRUNC
     char buf[kMaxPacketSize + 1];
   };
 
+  // UDP_SEGMENT, then SCM_TXTIME of the first segment
+  union GSOControl {
+    char buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    struct cmsghdr align;
+  };
+
+  union TxTimeControl {
+    char buf[CMSG_SPACE(sizeof(uint64_t))];
+    struct cmsghdr align;
+  };
+
+  // a packet which could not be sent yet, in a slot of the backlog pool
+  struct BacklogPacket {
+    KCPPacketRef slot;
+    socklen_t addr_len{0};
+    // CLOCK_MONOTONIC ns to leave at, 0 if now
+    uint64_t tx_time{0};
+  };
+
   struct ThreadData {
     std::unique_ptr<mmsghdr[]> mmsg_hdrs;
     std::unique_ptr<RawPacket[]> raw_packets;
     unsigned int num_packets{0};
+    // mmsg_hdrs coalesced by CoalesceTxQueue
+    bool gso_enabled{false};
+    std::unique_ptr<mmsghdr[]> gso_hdrs;
+    std::unique_ptr<struct iovec[]> gso_iovs;
+    std::unique_ptr<GSOControl[]> gso_controls;
+    // SCM_TXTIME of mmsg_hdrs
+    bool tx_time_enabled{false};
+    std::unique_ptr<TxTimeControl[]> tx_time_controls;
+    // sessions do not flush while a batch of packets is being processed, the
+    // tx queue is flushed once at the end of it
+    bool in_ingress_batch{false};
+    // socket used by the sessions of this thread, a descriptor of its own so
+    // that the loop can wait for it to become writable
+    std::unique_ptr<UDPSocket> socket;
+    std::unique_ptr<muduo::net::Channel> channel;
+    // packets unsent on EAGAIN or a partial send, in order, the tx queue goes
+    // here as well until it has been drained by HandleWrite, dropped once the
+    // pool has run out, declared first as the backlog returns its slots
+    std::unique_ptr<KCPPacketPool> backlog_pool;
+    std::deque<BacklogPacket> backlog;
+    // drives the sessions of this thread, their packets of a tick are sent
+    // by one FlushTxQueue after it
+    std::unique_ptr<KCPTimerWheel> timer_wheel;
   };
 
-  muduo::net::EventLoop* const loop_{nullptr};
-  muduo::net::InetAddress server_address_;
+  // a received packet bound for a session of another loop
+  struct IngressPacket {
+    KCPSessionPtr session;
+    KCPPacketRef slot;
+    size_t offset{0};
+    size_t length{0};
+    // DATA_PACKET or DATAGRAM_PACKET
+    uint8_t packet_type{DATA_PACKET};
+  };
 
-  // server side socket
-  std::unique_ptr<UDPSocket> socket_;
-  std::unique_ptr<muduo::net::Channel> channel_;
+  using IngressPackets = std::vector<IngressPacket>;
 
-  // dispatch session to different threads
-  uint8_t num_threads_{0};
-  std::unique_ptr<muduo::net::EventLoopThreadPool> thread_pool_;
+  struct IngressBatch {
+    muduo::net::EventLoop* loop{nullptr};
+    IngressPackets packets;
+  };
 
-  std::unique_ptr<mmsghdr[]> mmsg_hdrs_;
-  std::unique_ptr<RawPacket[]> raw_packets_;
+  void ProcessIngressBatch(IngressPackets& packets);
+
+  union GROControl {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  };
+
+  // a receive slot armed in the mmsg_hdrs of a shard, |spare| is acquired
+  // once |slot| is shared with another loop and takes its place after the
+  // datagram has been processed
+  struct RxSlot {
+    KCPPacketRef slot;
+    KCPPacketRef spare;
+    GROControl control;
+  };
 
   using PendingSessionMap =
       std::unordered_map<std::string, std::unique_ptr<KCPPendingSession>>;
-  using SessionMap = std::unordered_map<uint32_t, KCPSessionPtr>;
-  using IdleSessionMap = std::unordered_map<uint32_t, muduo::Timestamp>;
 
-  PendingSessionMap pending_session_map_;
-  SessionMap session_map_;
-  IdleSessionMap idle_session_map_;
+  // a server side socket and the sessions received on it, all members are
+  // only touched in the thread of |loop|
+  struct Shard {
+    muduo::net::EventLoop* loop{nullptr};
+    // index of the socket in the reuse port group
+    uint32_t index{0};
 
-  muduo::net::TimerId periodic_task_timer_;
+    std::unique_ptr<UDPSocket> socket;
+    std::unique_ptr<muduo::net::Channel> channel;
 
-  bool write_blocked_{false};
-  // std::vector<std::unique_ptr<RawPacket>> queued_packets_;
+    std::unique_ptr<mmsghdr[]> mmsg_hdrs;
+    std::unique_ptr<KCPPacketPool> packet_pool;
+    std::vector<RxSlot> rx_slots;
 
-  std::unordered_map<uint32_t, muduo::Timestamp> time_wait_session_map_;
+    // packets of the current recvmmsg batch grouped by loop, each loop is
+    // woken up once per batch
+    std::vector<IngressBatch> ingress_batches;
+
+    // keyed by client address, the sessions themselves are in
+    // session_table_ once established
+    PendingSessionMap pending_session_map;
+
+    muduo::net::TimerId periodic_task_timer;
+  };
+
+  muduo::net::EventLoop* const loop_{nullptr};
+  muduo::net::InetAddress server_address_;
+
+  // one shard on loop_ by default, one shard per thread pool loop if
+  // reuse_port_ is set
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // sessions of all shards, so that any of them can find a session whose
+  // packets arrive on another socket, each shard sweeps its share of stripes
+  KCPSessionTable session_table_;
+  bool reuse_port_{false};
+  bool session_affinity_{false};
+
+  bool udp_gso_{true};
+  bool gso_supported_{false};
+  bool udp_gro_{false};
+
+  bool sack_enabled_{true};
+  bool fec_enabled_{true};
+  bool datagram_enabled_{true};
+  bool migration_enabled_{true};
+  bool resumption_enabled_{true};
+  uint8_t checksum_options_{CRC32C_OPTION};
+  KCPSession::Params session_params_{kFastModeKCPParams};
+  KCPTicketCrypter ticket_crypter_;
+
+  bool tx_time_{false};
+  bool tx_time_supported_{false};
+
+  // dispatch session to different threads
+  uint8_t num_threads_{0};
+  std::unique_ptr<muduo::net::EventLoopThreadPool> thread_pool_;
+  // filled in by the threads of the pool as they start one by one
+  std::unordered_map<muduo::net::EventLoop*, KCPTimerWheel*> timer_wheels_;
+
+  std::atomic<int> num_write_blocked_threads_{0};
+  std::atomic<uint64_t> num_dropped_tx_packets_{0};
+  std::atomic<uint64_t> num_dropped_tx_bytes_{0};
 
   ConnectionCallback connection_callback_;
 
@@ -154,6 +424,8 @@ class KCPServer final {
 
   WriteCompleteCallback write_complete_callback_;
 
+  DatagramCallback datagram_callback_;
+
   HighWaterMarkCallback high_water_mark_callback_;
 
   DISALLOW_COPY_AND_ASSIGN(KCPServer);
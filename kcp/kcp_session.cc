@@ -2,7 +2,11 @@
 #include "kcp_session.h"
 
 #include <assert.h>
+#include <endian.h>
+#include <string.h>
+#include <time.h>
 
+#include <algorithm>
 #include <memory>
 
 #include <muduo/base/Logging.h>
@@ -15,6 +19,9 @@
 
 #include "kcp_callbacks.h"
 #include "kcp_packets.h"
+#include "kcp_segment_pool.h"
+#include "udp_socket.h"
+#include "urandom.h"
 
 KCPSession::KCPSession(muduo::net::EventLoop* loop)
     : loop_(CHECK_NOTNULL(loop)) {}
@@ -31,12 +38,17 @@ bool KCPSession::Initialize(uint32_t session_id,
                             const Params& params) {
   assert(kcp_.get() == nullptr);
 
+  KCPSegmentPool::Install();
+
   ScopedKCPCB kcp(ikcp_create(session_id, this));
   if (kcp.get() == nullptr) {
     return false;
   }
 
   ikcp_setoutput(kcp.get(), KCPSession::OnKCPOutput);
+  if (output_transport_.acquire_buffer != nullptr) {
+    ikcp_setoutputbuffer(kcp.get(), KCPSession::OnKCPOutputBuffer);
+  }
   ikcp_stream(kcp.get(), params.stream_mode);
 
   int rv = ikcp_wndsize(kcp.get(), params.snd_wnd, params.rcv_wnd);
@@ -49,7 +61,17 @@ bool KCPSession::Initialize(uint32_t session_id,
     return false;
   }
 
-  rv = ikcp_set_head_room(kcp.get(), params.head_room);
+  if (params.head_room < 0) {
+    return false;
+  }
+
+  // the fec sub header is written between the transport's header and the
+  // data of ikcp, so that parity packets are never larger than the mtu
+  auto head_room = static_cast<size_t>(params.head_room);
+  if (params.fec > 0) {
+    head_room += KCPFecHeader::kFecHeadRoom;
+  }
+  rv = ikcp_set_head_room(kcp.get(), static_cast<IUINT32>(head_room));
   if (rv < 0) {
     return false;
   }
@@ -65,12 +87,68 @@ bool KCPSession::Initialize(uint32_t session_id,
     return false;
   }
 
+  rv = ikcp_sack(kcp.get(), params.sack);
+  if (rv < 0) {
+    return false;
+  }
+
+  rv = ikcp_unordered(kcp.get(), params.unordered);
+  if (rv < 0) {
+    return false;
+  }
+
+  rv = ikcp_congestion(kcp.get(), params.nocongestion > 0 ? IKCP_CC_NONE
+                                                          : params.congestion);
+  if (rv < 0) {
+    return false;
+  }
+
+  if (params.checksum_type < 0 || params.checksum_type >= NUM_CHECKSUM_TYPES) {
+    return false;
+  }
+
+  if (params.ack_every < 0 || params.ack_delay_ms < 0) {
+    return false;
+  }
+
   kcp_ = std::move(kcp);
   peer_address_ = peer_address;
   session_id_ = session_id;
+  checksum_type_ = static_cast<KCPChecksumType>(params.checksum_type);
+  migration_ = params.migration > 0;
+  ack_every_ = static_cast<uint32_t>(params.ack_every);
+  ack_delay_ms_ = static_cast<uint32_t>(params.ack_delay_ms);
+
+  transport_head_room_ = static_cast<size_t>(params.head_room);
+  if (params.fec > 0) {
+    size_t mtu = kcp_->mtu;
+    fec_encoder_ = std::make_unique<KCPFecEncoder>(
+        mtu - transport_head_room_ - KCPFecHeader::kFecHeaderLength);
+    // shards of the peer are at most as large as a packet may be
+    fec_decoder_ = std::make_unique<KCPFecDecoder>(
+        std::max<size_t>(mtu, kMaxPacketSize) - transport_head_room_ -
+        KCPFecHeader::kFecHeaderLength);
+  }
+
+  if (params.datagram > 0) {
+    max_datagram_size_ = kcp_->mtu - transport_head_room_;
+  }
+
+  if ((params.fec > 0 || params.datagram > 0) &&
+      output_transport_.acquire_buffer == nullptr) {
+    packet_buffer_.resize(kcp_->mtu);
+  }
 
   base_time_ = muduo::Timestamp::now();
 
+  if (timer_wheel_ != nullptr) {
+    assert(timer_wheel_->loop() == loop_);
+    state_wheel_timer_.callback = [this] {
+      KCPSessionPtr holder = std::move(state_timer_holder_);
+      UpdateConnectionState();
+    };
+  }
+
   KCPSessionPtr shared_this = shared_from_this();
   loop_->runInLoop([shared_this] { shared_this->OnConnectionEvent(true); });
   loop_->queueInLoop([shared_this] { shared_this->UpdateConnectionState(); });
@@ -86,10 +164,19 @@ void KCPSession::Close(bool last_flush) {
   }
 
   closed_ = true;
-  loop_->cancel(state_timer_);
+  // may be the last reference, released on return
+  KCPSessionPtr holder = std::move(state_timer_holder_);
+  if (timer_wheel_ != nullptr) {
+    timer_wheel_->Cancel(&state_wheel_timer_);
+  } else {
+    loop_->cancel(state_timer_);
+  }
 
   if (last_flush) {
     ikcp_flush(kcp_.get(), CurrentMs());
+    if (fec_encoder_ && fec_encoder_->HasPendingShards()) {
+      OutputFecParity();
+    }
     FlushTxQueue();
   }
 
@@ -116,6 +203,8 @@ bool KCPSession::IsClosed() const { return closed_; }
 void KCPSession::UpdateConnectionState() {
   loop_->assertInLoopThread();
 
+  update_scheduled_ = false;
+
   if (IsClosed()) {
     return;
   }
@@ -126,14 +215,80 @@ void KCPSession::UpdateConnectionState() {
   }
 
   uint32_t wait_ms = ikcp_flush(kcp_.get(), CurrentMs());
+  // a group left incomplete is not held back for the next data packets
+  if (fec_encoder_ && fec_encoder_->HasPendingShards()) {
+    OutputFecParity();
+  }
   FlushTxQueue();
 
+  ScheduleUpdate(wait_ms);
+}
+
+void KCPSession::FlushAfterInput() {
+  // the acks go along with the data the input has made room for
+  if (ikcp_can_flush_after_input(kcp_.get()) > 0) {
+    uint32_t wait_ms = ikcp_flush(kcp_.get(), CurrentMs());
+    FlushTxQueue();
+    ScheduleUpdate(wait_ms);
+    return;
+  }
+
+  int urgent = 0;
+  uint32_t pending_acks = ikcp_acks_pending(kcp_.get(), &urgent);
+  if (pending_acks == 0) {
+    return;
+  }
+
+  if (urgent || pending_acks >= ack_every_) {
+    ikcp_flush_ack(kcp_.get());
+    FlushTxQueue();
+  } else {
+    ScheduleUpdate(ack_delay_ms_);
+  }
+}
+
+void KCPSession::ScheduleUpdate(uint32_t wait_ms) {
+  uint32_t update_ms = CurrentMs() + wait_ms;
+  if (update_scheduled_ &&
+      static_cast<int32_t>(update_ms - update_ms_) >= 0) {
+    return;
+  }
+
+  update_scheduled_ = true;
+  update_ms_ = update_ms;
+
+  if (timer_wheel_ != nullptr) {
+    state_timer_holder_ = shared_from_this();
+    timer_wheel_->Schedule(&state_wheel_timer_, wait_ms);
+    return;
+  }
+
+  loop_->cancel(state_timer_);
   state_timer_ = loop_->runAfter(static_cast<double>(wait_ms) / 1000,
                                  [shared_this = shared_from_this()] {
                                    shared_this->UpdateConnectionState();
                                  });
 }
 
+uint64_t KCPSession::NextDepartureTime(size_t len) {
+  uint32_t pacing_rate = ikcp_pacing_rate(kcp_.get());
+  if (pacing_rate == 0) {
+    return 0;
+  }
+
+  const uint64_t kNanosPerSecond = 1000 * 1000 * 1000;
+
+  struct timespec now;
+  ::clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_ns = static_cast<uint64_t>(now.tv_sec) * kNanosPerSecond +
+                    static_cast<uint64_t>(now.tv_nsec);
+
+  // an idle session does not get to send its pacing credit in one burst
+  uint64_t departure_ns = std::max(now_ns, next_departure_ns_);
+  next_departure_ns_ = departure_ns + len * kNanosPerSecond / pacing_rate;
+  return departure_ns;
+}
+
 // wrap around
 // https://tools.ietf.org/html/rfc1323#page-11
 // send/recv buffer window [x, x + 2^30)
@@ -166,6 +321,23 @@ void KCPSession::FlushTxQueue() {
 }
 
 void KCPSession::OnReadEvent(size_t bytes_can_read) {
+  if (message_spans_callback_) {
+    int count = ikcp_peekv(kcp_.get(), message_spans_.data(),
+                           static_cast<int>(message_spans_.size()));
+    if (count > static_cast<int>(message_spans_.size())) {
+      message_spans_.resize(static_cast<size_t>(count));
+      ikcp_peekv(kcp_.get(), message_spans_.data(), count);
+    }
+    assert(count > 0);
+
+    message_spans_callback_(shared_from_this(), message_spans_.data(), count);
+    // the segments go back to their pool
+    int len = ikcp_recv(kcp_.get(), nullptr, static_cast<int>(bytes_can_read));
+    assert(len == static_cast<int>(bytes_can_read));
+    UNUSED(len);
+    return;
+  }
+
   input_buffer_.ensureWritableBytes(bytes_can_read);
   int len = ikcp_recv(kcp_.get(), input_buffer_.beginWrite(),
                       static_cast<int>(bytes_can_read));
@@ -192,6 +364,200 @@ void KCPSession::ProcessPacket(const KCPReceivedPacket& packet,
   }
 }
 
+void KCPSession::ProcessPacket(const KCPReceivedPacket& packet,
+                               KCPPacketRef slot) {
+  assert(slot);
+  assert(packet.RemainingData() >= slot->buf &&
+         packet.RemainingData() <= slot->buf + slot->length);
+
+  if (loop_->isInLoopThread()) {
+    ProcessPacketInLoopThread(packet, slot->peer_address);
+  } else {
+    auto offset = static_cast<size_t>(packet.RemainingData() - slot->buf);
+    size_t length = packet.RemainingBytes();
+    loop_->queueInLoop([shared_this = shared_from_this(),
+                        slot = std::move(slot), offset, length]() {
+      KCPReceivedPacket slot_packet(slot->buf + offset, length);
+      shared_this->ProcessPacketInLoopThread(slot_packet, slot->peer_address);
+    });
+  }
+}
+
+void KCPSession::ProcessDatagram(const KCPReceivedPacket& packet,
+                                 const muduo::net::InetAddress& peer_address) {
+  UNUSED(peer_address);
+
+  if (loop_->isInLoopThread()) {
+    ProcessDatagramInLoopThread(packet);
+  } else {
+    KCPSessionPtr shared_this = shared_from_this();
+    std::shared_ptr<KCPReceivedPacket> packet_clone =
+        packet.CloneFromRemainingData();
+    loop_->queueInLoop([shared_this = std::move(shared_this),
+                        packet_clone = std::move(packet_clone)]() {
+      shared_this->ProcessDatagramInLoopThread(*packet_clone);
+    });
+  }
+}
+
+void KCPSession::ProcessDatagram(const KCPReceivedPacket& packet,
+                                 KCPPacketRef slot) {
+  assert(slot);
+  assert(packet.RemainingData() >= slot->buf &&
+         packet.RemainingData() <= slot->buf + slot->length);
+
+  if (loop_->isInLoopThread()) {
+    ProcessDatagramInLoopThread(packet);
+  } else {
+    auto offset = static_cast<size_t>(packet.RemainingData() - slot->buf);
+    size_t length = packet.RemainingBytes();
+    loop_->queueInLoop([shared_this = shared_from_this(),
+                        slot = std::move(slot), offset, length]() {
+      KCPReceivedPacket slot_packet(slot->buf + offset, length);
+      shared_this->ProcessDatagramInLoopThread(slot_packet);
+    });
+  }
+}
+
+void KCPSession::ProcessDatagramInLoopThread(const KCPReceivedPacket& packet) {
+  loop_->assertInLoopThread();
+
+  // the peer does not know that the session is gone, nor is it told
+  if (IsClosed()) {
+    return;
+  }
+
+  if (datagram_callback_) {
+    datagram_callback_(shared_from_this(), packet.RemainingData(),
+                       packet.RemainingBytes());
+  }
+}
+
+void KCPSession::ProbePeerAddress(const muduo::net::InetAddress& peer_address) {
+  if (loop_->isInLoopThread()) {
+    ProbePeerAddressInLoopThread(peer_address);
+  } else {
+    loop_->queueInLoop([shared_this = shared_from_this(), peer_address] {
+      shared_this->ProbePeerAddressInLoopThread(peer_address);
+    });
+  }
+}
+
+void KCPSession::ProbePeerAddressInLoopThread(
+    const muduo::net::InetAddress& peer_address) {
+  loop_->assertInLoopThread();
+
+  if (IsClosed() || UDPSocket::IsSameAddress(peer_address, peer_address_)) {
+    return;
+  }
+
+  // a peer which knows of no challenge is taken at its word
+  if (!migration_) {
+    peer_address_ = peer_address;
+    return;
+  }
+
+  uint32_t now_ms = CurrentMs();
+  bool probing = path_challenge_token_ != 0 &&
+                 UDPSocket::IsSameAddress(peer_address, probing_address_);
+  if (probing && static_cast<int32_t>(now_ms - path_challenge_ms_) <
+                     kPathChallengeIntervalMs) {
+    return;
+  }
+
+  // the data keeps going along the old path meanwhile
+  if (!probing) {
+    uint64_t token = 0;
+    while (token == 0) {
+      if (!URandom::GetInstance().RandBytes(&token, sizeof(token))) {
+        LOG_ERROR << "session: " << session_id_
+                  << " failed to make a path challenge";
+        return;
+      }
+    }
+    path_challenge_token_ = token;
+    probing_address_ = peer_address;
+  }
+
+  path_challenge_ms_ = now_ms;
+  SendPathPacket(PATH_CHALLENGE_PACKET, path_challenge_token_, peer_address);
+  FlushTxQueue();
+}
+
+void KCPSession::ProcessPathPacket(uint8_t packet_type,
+                                   const KCPReceivedPacket& packet,
+                                   const muduo::net::InetAddress& peer_address) {
+  uint64_t token = 0;
+  if (!packet.PeekUInt64(&token)) {
+    LOG_ERROR << "session: " << session_id_ << " path packet too short, len: "
+              << packet.RemainingBytes();
+    return;
+  }
+
+  if (loop_->isInLoopThread()) {
+    ProcessPathPacketInLoopThread(packet_type, token, peer_address);
+  } else {
+    loop_->queueInLoop(
+        [shared_this = shared_from_this(), packet_type, token, peer_address] {
+          shared_this->ProcessPathPacketInLoopThread(packet_type, token,
+                                                     peer_address);
+        });
+  }
+}
+
+void KCPSession::ProcessPathPacketInLoopThread(
+    uint8_t packet_type, uint64_t token,
+    const muduo::net::InetAddress& peer_address) {
+  loop_->assertInLoopThread();
+
+  if (IsClosed()) {
+    return;
+  }
+
+  if (packet_type == PATH_CHALLENGE_PACKET) {
+    // answered along the path it came from
+    SendPathPacket(PATH_RESPONSE_PACKET, token, peer_address);
+    FlushTxQueue();
+    return;
+  }
+
+  assert(packet_type == PATH_RESPONSE_PACKET);
+  if (path_challenge_token_ == 0 || token != path_challenge_token_ ||
+      !UDPSocket::IsSameAddress(peer_address, probing_address_)) {
+    LOG_WARN << "session: " << session_id_
+             << " unexpected path response from " << peer_address.toIpPort();
+    return;
+  }
+
+  // a nat rebinding only changes the port, the path is the same
+  bool path_changed =
+      !UDPSocket::IsSameAddress(peer_address, peer_address_, true);
+  LOG_INFO << "session: " << session_id_ << " migrated from "
+           << peer_address_.toIpPort() << " to " << peer_address.toIpPort()
+           << (path_changed ? ", path changed" : "");
+
+  peer_address_ = peer_address;
+  path_challenge_token_ = 0;
+  ++num_path_changes_;
+  if (path_changed) {
+    ikcp_reset_path(kcp_.get());
+  }
+
+  // what was sent along the old path is resent along the new one as its
+  // rto expires
+  uint32_t wait_ms = ikcp_flush(kcp_.get(), CurrentMs());
+  FlushTxQueue();
+  ScheduleUpdate(wait_ms);
+}
+
+void KCPSession::SendPathPacket(uint8_t packet_type, uint64_t token,
+                                const muduo::net::InetAddress& address) {
+  char* buf = AcquirePacketBuffer();
+  uint64_t le64 = htole64(token);
+  memcpy(buf + transport_head_room_, &le64, sizeof(le64));
+  OutputPacket(buf, transport_head_room_ + sizeof(le64), packet_type, address);
+}
+
 void KCPSession::ProcessPacketInLoopThread(
     const KCPReceivedPacket& packet,
     const muduo::net::InetAddress& peer_address) {
@@ -207,8 +573,7 @@ void KCPSession::ProcessPacketInLoopThread(
   // packet.ReadBytes(...);
 
   int need_drain_before_process = ikcp_need_drain(kcp_.get());
-  int result = ikcp_input(kcp_.get(), packet.RemainingData(),
-                          static_cast<long>(packet.RemainingBytes()));
+  int result = InputPacket(packet.RemainingData(), packet.RemainingBytes());
   if (result < 0) {
     LOG_ERROR << "kcp_input error: " << result
               << ", session_id: " << session_id()
@@ -216,8 +581,7 @@ void KCPSession::ProcessPacketInLoopThread(
     return;
   }
 
-  // connection migration ?
-  peer_address_ = peer_address;
+  ProbePeerAddressInLoopThread(peer_address);
 
   while (!IsClosed()) {
     int available_data_size = ikcp_peeksize(kcp_.get());
@@ -227,18 +591,17 @@ void KCPSession::ProcessPacketInLoopThread(
     OnReadEvent(available_data_size);
   }
 
-  // bool need_flush_tx_queue = false;
-  // if (IsClosed() || ikcp_can_flush_after_input(kcp_.get()) > 0) {
-  //   ikcp_flush(kcp_.get(), CurrentMs());
-  //   need_flush_tx_queue = true;
-  // } else if (ikcp_can_send_ack(kcp_.get()) > 0) {
-  //   ikcp_flush_ack(kcp_.get());
-  //   need_flush_tx_queue = true;
-  // }
+  // written now, the data goes along with the acks
+  if (!IsClosed() && window_update_callback_) {
+    size_t writable_bytes = WritableBytes();
+    if (writable_bytes > 0) {
+      window_update_callback_(shared_from_this(), writable_bytes);
+    }
+  }
 
-  // if (need_flush_tx_queue) {
-  //   FlushTxQueue();
-  // }
+  if (!IsClosed() && ack_every_ > 0) {
+    FlushAfterInput();
+  }
 
   if (!IsClosed()) {
     int need_drain_after_process = ikcp_need_drain(kcp_.get());
@@ -251,6 +614,56 @@ void KCPSession::ProcessPacketInLoopThread(
   }
 }
 
+int KCPSession::InputPacket(const char* data, size_t len) {
+  if (!fec_decoder_) {
+    return ikcp_input(kcp_.get(), data, static_cast<long>(len));
+  }
+
+  KCPFecHeader fec_header;
+  if (!fec_header.ReadFrom(data, len)) {
+    return -1;
+  }
+
+  const char* shard = data + KCPFecHeader::kFecHeaderLength;
+  size_t shard_length = len - KCPFecHeader::kFecHeaderLength;
+
+  // a data shard goes to ikcp at once, the parity is only of use for the
+  // ones lost, a packet of no group for nothing else
+  int result = 0;
+  bool unprotected = fec_header.data_shards == 0;
+  if (unprotected || fec_header.shard_index < fec_header.data_shards) {
+    uint16_t data_length = 0;
+    if (shard_length < KCPFecHeader::kShardLengthSize) {
+      return -1;
+    }
+    memcpy(&data_length, shard, sizeof(data_length));
+    data_length = le16toh(data_length);
+    if (KCPFecHeader::kShardLengthSize + data_length != shard_length) {
+      return -1;
+    }
+
+    result = ikcp_input(kcp_.get(), shard + KCPFecHeader::kShardLengthSize,
+                        static_cast<long>(data_length));
+    if (result < 0 || unprotected) {
+      return result;
+    }
+  }
+
+  KCPFecDecoder::Shard recovered[kFecMaxDataShards];
+  int num_recovered =
+      fec_decoder_->AddShard(fec_header, shard, shard_length, recovered);
+  for (int i = 0; i < num_recovered; ++i) {
+    int rv = ikcp_input(kcp_.get(), recovered[i].data,
+                        static_cast<long>(recovered[i].length));
+    LOG_TRACE << "session: " << session_id_ << " rebuilt a "
+              << recovered[i].length << "-byte packet of fec group "
+              << fec_header.group_id << ", kcp_input: " << rv;
+    UNUSED(rv);
+  }
+
+  return result;
+}
+
 void KCPSession::Write(muduo::net::Buffer* buf) {
   if (loop_->isInLoopThread()) {
     WriteInLoopThread(buf->peek(), buf->readableBytes());
@@ -280,15 +693,151 @@ void KCPSession::Write(const void* data, size_t len) {
   }
 }
 
+void KCPSession::Write(const struct iovec* iov, int iovcnt) {
+  if (loop_->isInLoopThread()) {
+    WriteInLoopThread(iov, iovcnt);
+  } else {
+    auto data_clone = std::make_shared<KCPClonedPacket>(iov, iovcnt);
+    KCPSessionPtr shared_this = shared_from_this();
+    loop_->queueInLoop([data_clone = std::move(data_clone),
+                        shared_this = std::move(shared_this)]() mutable {
+      shared_this->WriteInLoopThread(data_clone->data(), data_clone->length());
+    });
+  }
+}
+
+void KCPSession::Write(muduo::net::Buffer&& buf) {
+  if (loop_->isInLoopThread()) {
+    WriteInLoopThread(buf.peek(), buf.readableBytes());
+    buf.retrieveAll();
+  } else {
+    auto data = std::make_shared<muduo::net::Buffer>();
+    data->swap(buf);
+    KCPSessionPtr shared_this = shared_from_this();
+    loop_->queueInLoop([data = std::move(data),
+                        shared_this = std::move(shared_this)]() mutable {
+      shared_this->WriteInLoopThread(data->peek(), data->readableBytes());
+    });
+  }
+}
+
+size_t KCPSession::WritableBytes() const {
+  loop_->assertInLoopThread();
+
+  if (IsClosed() || ikcp_need_drain(kcp_.get()) > 0) {
+    return 0;
+  }
+  return ikcp_available_wnd_in_bytes(kcp_.get());
+}
+
+bool KCPSession::SendDatagram(const void* data, size_t len) {
+  if (max_datagram_size_ == 0 || len > max_datagram_size_) {
+    LOG_ERROR << "session: " << session_id_ << " datagram of " << len
+              << " bytes, max_datagram_size: " << max_datagram_size_;
+    return false;
+  }
+
+  if (loop_->isInLoopThread()) {
+    SendDatagramInLoopThread(data, len);
+  } else {
+    auto data_clone = std::make_shared<KCPClonedPacket>(data, len);
+    KCPSessionPtr shared_this = shared_from_this();
+    loop_->queueInLoop([data_clone = std::move(data_clone),
+                        shared_this = std::move(shared_this)]() mutable {
+      shared_this->SendDatagramInLoopThread(data_clone->data(),
+                                            data_clone->length());
+    });
+  }
+  return true;
+}
+
+void KCPSession::SendDatagramInLoopThread(const void* data, size_t len) {
+  loop_->assertInLoopThread();
+
+  if (IsClosed()) {
+    return;
+  }
+
+  char* buf = AcquirePacketBuffer();
+  memcpy(buf + transport_head_room_, data, len);
+  OutputPacket(buf, transport_head_room_ + len, DATAGRAM_PACKET);
+  FlushTxQueue();
+}
+
+void KCPSession::WriteWithTTL(const void* data, size_t len, uint32_t ttl_ms) {
+  if (loop_->isInLoopThread()) {
+    WriteWithTTLInLoopThread(data, len, ttl_ms);
+  } else {
+    auto data_clone = std::make_shared<KCPClonedPacket>(data, len);
+    KCPSessionPtr shared_this = shared_from_this();
+    loop_->queueInLoop([data_clone = std::move(data_clone),
+                        shared_this = std::move(shared_this),
+                        ttl_ms]() mutable {
+      shared_this->WriteWithTTLInLoopThread(data_clone->data(),
+                                            data_clone->length(), ttl_ms);
+    });
+  }
+}
+
+void KCPSession::WriteWithTTLInLoopThread(const void* data, size_t len,
+                                          uint32_t ttl_ms) {
+  loop_->assertInLoopThread();
+
+  if (IsClosed()) {
+    LOG_ERROR << "session has already been closed, session_id: " << session_id()
+              << ", data len: " << len;
+    return;
+  }
+
+  // queued whole behind the window if need be, where it may expire
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(data);
+  iov.iov_len = len;
+  int result =
+      ikcp_writev(kcp_.get(), &iov, 1, 0, static_cast<int>(len), 0);
+  if (result < 0) {
+    LOG_ERROR << "ikcp_writev error: " << result
+              << ", session_id: " << session_id() << ", data len: " << len;
+    return;
+  }
+  ikcp_expire_last(kcp_.get(), CurrentMs() + ttl_ms);
+
+  if (ikcp_available_sndwnd_in_bytes(kcp_.get()) > 0) {
+    uint32_t wait_ms = ikcp_flush(kcp_.get(), CurrentMs());
+    FlushTxQueue();
+    ScheduleUpdate(wait_ms);
+  }
+}
+
 void KCPSession::WriteInLoopThread(const void* data, size_t len) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(data);
+  iov.iov_len = len;
+  WriteInLoopThread(&iov, 1);
+}
+
+void KCPSession::WriteInLoopThread(const struct iovec* iov, int iovcnt) {
   loop_->assertInLoopThread();
 
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    len += iov[i].iov_len;
+  }
+
   if (IsClosed()) {
     LOG_ERROR << "session has already been closed, session_id: " << session_id()
               << ", data len: " << len;
     return;
   }
 
+  // unordered, each message is one segment written whole, see ikcp_unordered
+  bool unordered = kcp_->unordered != 0;
+  if (unordered && len > kcp_->mss) {
+    LOG_ERROR << "message larger than mss in unordered mode, session_id: "
+              << session_id() << ", data len: " << len;
+    return;
+  }
+
   size_t bytes_write = 0;
   size_t bytes_remaining = len;
 
@@ -297,18 +846,23 @@ void KCPSession::WriteInLoopThread(const void* data, size_t len) {
   if (ikcp_need_drain(kcp_.get()) == 0) {
     size_t bytes_can_write = ikcp_available_wnd_in_bytes(kcp_.get());
     bytes_can_write = std::min(bytes_can_write, len);
+    if (unordered && bytes_can_write < len) {
+      bytes_can_write = 0;
+    }
 
     if (bytes_can_write > 0) {
       size_t bytes_can_write_to_wire =
           ikcp_available_sndwnd_in_bytes(kcp_.get());
 
-      int result = ikcp_send(kcp_.get(), static_cast<const char*>(data),
-                             static_cast<int>(bytes_can_write));
+      int result = ikcp_writev(kcp_.get(), iov, iovcnt, 0,
+                               static_cast<int>(bytes_can_write), 0);
       if (result == 0) {
         bytes_write = bytes_can_write;
         if (bytes_can_write_to_wire > 0) {
-          ikcp_flush(kcp_.get(), CurrentMs());
+          // paced segments left behind must not wait for the next interval
+          uint32_t wait_ms = ikcp_flush(kcp_.get(), CurrentMs());
           FlushTxQueue();
+          ScheduleUpdate(wait_ms);
         }
 
         bytes_remaining -= bytes_write;
@@ -324,9 +878,10 @@ void KCPSession::WriteInLoopThread(const void* data, size_t len) {
 
   if (bytes_remaining > 0) {
     LOG_WARN << "bytes_remaining: " << bytes_remaining;
-    int result =
-        ikcp_append(kcp_.get(), static_cast<const char*>(data) + bytes_write,
-                    static_cast<int>(bytes_remaining));
+    int result = ikcp_writev(kcp_.get(), iov, iovcnt,
+                             static_cast<int>(bytes_write),
+                             static_cast<int>(bytes_remaining),
+                             unordered ? 0 : 1);
     if (result == 0) {
       int reach_snd_hghwat_after_process = ikcp_reach_snd_hghwat(kcp_.get());
       if (reach_snd_hghwat_before_process == 0 &&
@@ -343,11 +898,88 @@ void KCPSession::WriteInLoopThread(const void* data, size_t len) {
   }
 }
 
+void KCPSession::OutputPacket(char* buf, size_t len, uint8_t packet_type) {
+  OutputPacket(buf, len, packet_type, peer_address_);
+}
+
+void KCPSession::OutputPacket(char* buf, size_t len, uint8_t packet_type,
+                              const muduo::net::InetAddress& address) {
+  const OutputTransport& transport = output_transport_;
+  if (transport.output != nullptr) {
+    transport.output(this, buf, len, packet_type, address, transport.context);
+  } else {
+    output_callback_(buf, len, packet_type, session_id_, address);
+  }
+}
+
+char* KCPSession::AcquirePacketBuffer() {
+  size_t mtu = kcp_->mtu;
+  // built in place in the tx queue like the data packets, if it may be
+  char* buf = nullptr;
+  if (output_transport_.acquire_buffer != nullptr) {
+    buf = output_transport_.acquire_buffer(mtu, output_transport_.context);
+  }
+  if (buf == nullptr) {
+    packet_buffer_.resize(mtu);
+    buf = packet_buffer_.data();
+  }
+  return buf;
+}
+
+void KCPSession::OutputFecDataShard(char* buf, size_t len) {
+  assert(len > transport_head_room_ + KCPFecHeader::kFecHeadRoom);
+
+  size_t data_length = len - transport_head_room_ - KCPFecHeader::kFecHeadRoom;
+  // acks alone are not worth the parity, a lost one is made up by the next,
+  // nor do they hold a group open until the next tick
+  if (!ikcp_packet_has_push(buf + len - data_length,
+                            static_cast<long>(data_length))) {
+    KCPFecEncoder::WriteUnprotected(buf + transport_head_room_, data_length);
+    OutputPacket(buf, len, DATA_PACKET);
+    return;
+  }
+
+  bool group_complete =
+      fec_encoder_->AddDataShard(buf + transport_head_room_, data_length);
+  OutputPacket(buf, len, DATA_PACKET);
+
+  if (group_complete) {
+    OutputFecParity();
+  }
+}
+
+void KCPSession::OutputFecParity() {
+  IUINT32 delivered = 0;
+  IUINT32 retransmits = 0;
+  ikcp_xmit_stats(kcp_.get(), &delivered, &retransmits);
+  fec_encoder_->Adapt(delivered, retransmits);
+
+  size_t mtu = kcp_->mtu;
+  int num_parity_shards = fec_encoder_->EncodeParity();
+  for (int i = 0; i < num_parity_shards; ++i) {
+    char* buf = AcquirePacketBuffer();
+    size_t len = transport_head_room_ +
+                 fec_encoder_->WriteParityPacket(i, buf + transport_head_room_);
+    assert(len <= mtu);
+    UNUSED(mtu);
+    OutputPacket(buf, len, DATA_PACKET);
+  }
+}
+
 int KCPSession::OnKCPOutput(char* buf, int len, IKCPCB* kcp, void* user) {
   UNUSED(kcp);
 
   KCPSession* session = static_cast<KCPSession*>(user);
-  session->output_callback_(buf, static_cast<size_t>(len),
-                            session->session_id(), session->peer_address());
+  if (session->fec_encoder_) {
+    session->OutputFecDataShard(buf, static_cast<size_t>(len));
+  } else {
+    session->OutputPacket(buf, static_cast<size_t>(len), DATA_PACKET);
+  }
   return 0;
 }
+
+char* KCPSession::OnKCPOutputBuffer(IKCPCB* kcp, void* user) {
+  KCPSession* session = static_cast<KCPSession*>(user);
+  const OutputTransport& transport = session->output_transport_;
+  return transport.acquire_buffer(kcp->mtu, transport.context);
+}
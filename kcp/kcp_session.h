@@ -2,10 +2,12 @@
 #define KCP_SESSION_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include <atomic>
 #include <functional>
 #include <memory>
+#include <vector>
 
 #include <muduo/base/Timestamp.h>
 #include <muduo/net/Buffer.h>
@@ -18,7 +20,10 @@
 
 #include "kcp_callbacks.h"
 #include "kcp_constants.h"
+#include "kcp_fec.h"
+#include "kcp_packet_pool.h"
 #include "kcp_packets.h"
+#include "kcp_timer_wheel.h"
 
 namespace muduo {
 namespace net {
@@ -33,6 +38,10 @@ struct KCPPendingSession {
   muduo::Timestamp syn_received_time;
   muduo::Timestamp syn_sent_time;
   muduo::net::InetAddress peer_address;
+  // KCPSessionOption bits agreed on, only echoed in the SYN if the peer sent
+  // some, see KCPServer::ProcessSynPacket
+  uint8_t options{0};
+  bool has_options{false};
 };
 
 // icmp error
@@ -81,6 +90,44 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
     int mtu{512};
     int head_room{0};
     int stream_mode{0};
+    // selective acks, both sides must have agreed on SACK_OPTION
+    int sack{0};
+    // one of IKCP_CC_*, IKCP_CC_NONE if nocongestion is set, only
+    // IKCP_CC_RENO_PACED and IKCP_CC_BBR pace data segments out instead of
+    // bursting a whole window
+    int congestion{IKCP_CC_RENO};
+    // KCPChecksumType of the data packets, for the transport writing their
+    // public header
+    int checksum_type{ADLER32_CHECKSUM};
+    // 0 leaves the acks to the next update, otherwise they are sent at once
+    // for a segment out of order or once ack_every of them are pending, and
+    // no later than ack_delay_ms, unless data to send takes them along
+    int ack_every{0};
+    int ack_delay_ms{0};
+    // groups of data packets are followed by parity packets, sized to the
+    // residual loss, both sides must have agreed on FEC_OPTION
+    int fec{0};
+    // each message is handed over as soon as it arrives, not in the order
+    // sent, only for a peer whose messages fit in one segment, such as the
+    // frames of KCPStreamMux
+    int unordered{0};
+    // SendDatagram, both sides must have agreed on DATAGRAM_OPTION
+    int datagram{0};
+    // a new address of the peer is only taken once it has answered a path
+    // challenge from there, both sides must have agreed on MIGRATION_OPTION
+    int migration{0};
+  };
+
+  // takes the packets straight from ikcp in place of the output callback,
+  // plain functions so that nothing but them is called per packet
+  struct OutputTransport {
+    // at least |capacity| bytes to build the next packet in, nullptr for the
+    // buffer of the session
+    char* (*acquire_buffer)(size_t capacity, void* context){nullptr};
+    void (*output)(KCPSession* session, char* data, size_t len,
+                   uint8_t packet_type, const muduo::net::InetAddress& address,
+                   void* context){nullptr};
+    void* context{nullptr};
   };
 
   explicit KCPSession(muduo::net::EventLoop* loop);
@@ -99,9 +146,40 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
 
   void ProcessPacket(const KCPReceivedPacket& packet,
                      const muduo::net::InetAddress& peer_address);
+  // |packet| points into |slot|, which is handed over to the loop instead of
+  // cloning the packet, and returned to its pool after ikcp_input
+  void ProcessPacket(const KCPReceivedPacket& packet, KCPPacketRef slot);
 
   void Write(const void* data, size_t len);
+  // segmented straight from the fragments in the loop thread, gathered into
+  // one copy to be handed to it otherwise
+  void Write(const struct iovec* iov, int iovcnt);
   void Write(muduo::net::Buffer* buf);
+  // takes the contents of |buf| over, no copy is made to hand them to the
+  // loop thread
+  void Write(muduo::net::Buffer&& buf);
+
+  // a message of one packet past ikcp, lost with it, false if it is larger
+  // than max_datagram_size or datagrams were not agreed on
+  bool SendDatagram(const void* data, size_t len);
+
+  // dropped unless it has begun to be sent within |ttl_ms|, for state which
+  // is only of use while fresh, never split up by a full window
+  void WriteWithTTL(const void* data, size_t len, uint32_t ttl_ms);
+
+  void ProcessDatagram(const KCPReceivedPacket& packet,
+                       const muduo::net::InetAddress& peer_address);
+  // see ProcessPacket
+  void ProcessDatagram(const KCPReceivedPacket& packet, KCPPacketRef slot);
+
+  // a packet known to be of the peer by its session id came from
+  // |peer_address|, another path is challenged and only taken once the peer
+  // has answered along it, at once if migration was not agreed on
+  void ProbePeerAddress(const muduo::net::InetAddress& peer_address);
+
+  // PATH_CHALLENGE_PACKET or PATH_RESPONSE_PACKET
+  void ProcessPathPacket(uint8_t packet_type, const KCPReceivedPacket& packet,
+                         const muduo::net::InetAddress& peer_address);
 
   void Close(bool last_flush = false);
 
@@ -123,10 +201,26 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
     message_callback_ = std::move(cb);
   }
 
+  // takes the place of the message callback, each message is handed over
+  // where its fragments are queued instead of being copied into a Buffer
+  void set_message_spans_callback(MessageSpansCallback cb) {
+    message_spans_callback_ = std::move(cb);
+  }
+
   void set_write_complete_callback(WriteCompleteCallback cb) {
     write_complete_callback_ = std::move(cb);
   }
 
+  void set_datagram_callback(DatagramCallback cb) {
+    datagram_callback_ = std::move(cb);
+  }
+
+  // after an input which has left room in the window, for the writers which
+  // keep their data until ikcp can take it, see WritableBytes
+  void set_window_update_callback(WindowUpdateCallback cb) {
+    window_update_callback_ = std::move(cb);
+  }
+
   void set_high_water_mark_callback(HighWaterMarkCallback cb) {
     high_water_mark_callback_ = std::move(cb);
   }
@@ -135,12 +229,50 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
     output_callback_ = std::move(cb);
   }
 
+  // must be set before Initialize
+  void set_output_transport(const OutputTransport& output_transport) {
+    output_transport_ = output_transport;
+  }
+
+  KCPChecksumType checksum_type() const { return checksum_type_; }
+
+  // the largest message sent as one segment
+  size_t mss() const { return kcp_->mss; }
+
+  size_t max_datagram_size() const { return max_datagram_size_; }
+
+  // path validation agreed on, see ProbePeerAddress
+  bool migration() const { return migration_; }
+
+  // validated paths taken since the session began
+  uint64_t num_path_changes() const { return num_path_changes_; }
+
+  // bytes a Write takes without queueing them behind the window, in whole
+  // segments, only to be called in the loop thread
+  size_t WritableBytes() const;
+
+  // data packets lost on the way but rebuilt from the parity
+  uint64_t num_fec_recovered_shards() const {
+    return fec_decoder_ ? fec_decoder_->num_recovered_shards() : 0;
+  }
+
   void set_flush_tx_queue(FlushTxQueueCallback cb) {
     flush_tx_queue_callback_ = std::move(cb);
   }
 
   void set_pending_error(PendingError error) { pending_error_ = error; }
 
+  // CLOCK_MONOTONIC ns at which a packet of |len| bytes being output should
+  // leave so that the packets are spaced at the pacing rate, 0 if unpaced,
+  // only to be called by the output callback
+  uint64_t NextDepartureTime(size_t len);
+
+  // drive the connection state with the wheel of the loop instead of a muduo
+  // timer per session, must be set before Initialize
+  void set_timer_wheel(KCPTimerWheel* timer_wheel) {
+    timer_wheel_ = timer_wheel;
+  }
+
  private:
   uint32_t CurrentMs() const;
 
@@ -148,6 +280,20 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
   void OnReadEvent(size_t bytes_can_read);
 
   void UpdateConnectionState();
+  // sends what the ack policy and the window opened by the input allow
+  void FlushAfterInput();
+  // ikcp_input of a packet, its data shard and any rebuilt from the parity
+  int InputPacket(const char* data, size_t len);
+  void OutputPacket(char* buf, size_t len, uint8_t packet_type);
+  void OutputPacket(char* buf, size_t len, uint8_t packet_type,
+                    const muduo::net::InetAddress& address);
+  // a buffer of the transport, or packet_buffer_
+  char* AcquirePacketBuffer();
+  void OutputFecDataShard(char* buf, size_t len);
+  // parity of the group, full or not
+  void OutputFecParity();
+  // runs UpdateConnectionState after |wait_ms|, or earlier if so scheduled
+  void ScheduleUpdate(uint32_t wait_ms);
   void FlushTxQueue();
 
   // void ProcessPacketInLoopThread(const void* data, size_t len,
@@ -157,8 +303,20 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
   void ProcessPacketInLoopThread(const KCPReceivedPacket& packet,
                                  const muduo::net::InetAddress& peer_address);
   void WriteInLoopThread(const void* data, size_t len);
+  void WriteInLoopThread(const struct iovec* iov, int iovcnt);
+  void WriteWithTTLInLoopThread(const void* data, size_t len, uint32_t ttl_ms);
+  void SendDatagramInLoopThread(const void* data, size_t len);
+  void ProcessDatagramInLoopThread(const KCPReceivedPacket& packet);
+  void ProbePeerAddressInLoopThread(
+      const muduo::net::InetAddress& peer_address);
+  void ProcessPathPacketInLoopThread(
+      uint8_t packet_type, uint64_t token,
+      const muduo::net::InetAddress& peer_address);
+  void SendPathPacket(uint8_t packet_type, uint64_t token,
+                      const muduo::net::InetAddress& address);
 
   static int OnKCPOutput(char* buf, int len, IKCPCB* kcp, void* user);
+  static char* OnKCPOutputBuffer(IKCPCB* kcp, void* user);
 
   struct ScopedKCPCBDeleter {
     inline void operator()(IKCPCB* x) const {
@@ -185,25 +343,70 @@ class KCPSession final : public std::enable_shared_from_this<KCPSession> {
   // peer address
   muduo::net::InetAddress peer_address_;
 
+  // see Params, |path_challenge_token_| is 0 unless |probing_address_| is
+  // being validated
+  bool migration_{false};
+  muduo::net::InetAddress probing_address_;
+  uint64_t path_challenge_token_{0};
+  uint32_t path_challenge_ms_{0};
+  uint64_t num_path_changes_{0};
+
   // connection created time
   muduo::Timestamp base_time_;
 
   // update connection state timer
   muduo::net::TimerId state_timer_;
 
+  // used instead of state_timer_ if set, |state_timer_holder_| keeps this
+  // alive while |state_wheel_timer_| is scheduled
+  KCPTimerWheel* timer_wheel_{nullptr};
+  KCPWheelTimer state_wheel_timer_;
+  KCPSessionPtr state_timer_holder_;
+  // CurrentMs of the scheduled UpdateConnectionState, if any
+  bool update_scheduled_{false};
+  uint32_t update_ms_{0};
+
+  // see NextDepartureTime
+  uint64_t next_departure_ns_{0};
+
+  // see Params
+  uint32_t ack_every_{0};
+  uint32_t ack_delay_ms_{0};
+
+  // head room of the transport, the fec sub header follows it
+  size_t transport_head_room_{0};
+  std::unique_ptr<KCPFecEncoder> fec_encoder_;
+  std::unique_ptr<KCPFecDecoder> fec_decoder_;
+  // parity packets and datagrams are built here if the transport has no
+  // buffer for them
+  std::vector<char> packet_buffer_;
+
+  // zero unless datagrams were agreed on
+  size_t max_datagram_size_{0};
+
   // connection event callback
   ConnectionCallback connection_callback_;
 
   // write event callback
   WriteCompleteCallback write_complete_callback_;
 
+  WindowUpdateCallback window_update_callback_;
+
   MessageCallback message_callback_;
 
+  MessageSpansCallback message_spans_callback_;
+
+  DatagramCallback datagram_callback_;
+  // reused by OnReadEvent, one per fragment of the message
+  std::vector<struct iovec> message_spans_;
+
   HighWaterMarkCallback high_water_mark_callback_;
 
   // CloseCallback close_callback_;
 
   OutputCallback output_callback_;
+  OutputTransport output_transport_;
+  KCPChecksumType checksum_type_{ADLER32_CHECKSUM};
   FlushTxQueueCallback flush_tx_queue_callback_;
 
   muduo::net::Buffer input_buffer_;
@@ -224,7 +427,16 @@ const KCPSession::Params ALLOW_UNUSED kNormalModeKCPParams = {
     .nocongestion = 0,
     .mtu = kDefaultMTUSize,
     .head_room = 0,
-    .stream_mode = 0};
+    .stream_mode = 0,
+    .sack = 0,
+    .congestion = IKCP_CC_RENO,
+    .checksum_type = ADLER32_CHECKSUM,
+    .ack_every = 0,
+    .ack_delay_ms = 0,
+    .fec = 0,
+    .unordered = 0,
+    .datagram = 0,
+    .migration = 0};
 
 const KCPSession::Params ALLOW_UNUSED kFastModeKCPParams = {
     .snd_wnd = 128,
@@ -236,6 +448,60 @@ const KCPSession::Params ALLOW_UNUSED kFastModeKCPParams = {
     .nocongestion = 1,
     .mtu = kDefaultMTUSize,
     .head_room = 0,
-    .stream_mode = 0};
+    .stream_mode = 0,
+    .sack = 0,
+    .congestion = IKCP_CC_NONE,
+    .checksum_type = ADLER32_CHECKSUM,
+    .ack_every = 1,
+    .ack_delay_ms = 0,
+    .fec = 0,
+    .unordered = 0,
+    .datagram = 0,
+    .migration = 0};
+
+// fast mode which acks every other segment, for a bulk receiver whose acks
+// would otherwise cost as many packets as the data
+const KCPSession::Params ALLOW_UNUSED kFastDelayedAckModeKCPParams = {
+    .snd_wnd = 128,
+    .rcv_wnd = 128,
+    .snd_hghwat = 16,
+    .nodelay = 1,
+    .interval = 50,
+    .resend = 3,
+    .nocongestion = 1,
+    .mtu = kDefaultMTUSize,
+    .head_room = 0,
+    .stream_mode = 0,
+    .sack = 0,
+    .congestion = IKCP_CC_NONE,
+    .checksum_type = ADLER32_CHECKSUM,
+    .ack_every = 2,
+    .ack_delay_ms = 10,
+    .fec = 0,
+    .unordered = 0,
+    .datagram = 0,
+    .migration = 0};
+
+// fast mode which backs off at the bottleneck instead of flooding it
+const KCPSession::Params ALLOW_UNUSED kPacedModeKCPParams = {
+    .snd_wnd = 128,
+    .rcv_wnd = 128,
+    .snd_hghwat = 16,
+    .nodelay = 1,
+    .interval = 50,
+    .resend = 3,
+    .nocongestion = 0,
+    .mtu = kDefaultMTUSize,
+    .head_room = 0,
+    .stream_mode = 0,
+    .sack = 0,
+    .congestion = IKCP_CC_BBR,
+    .checksum_type = ADLER32_CHECKSUM,
+    .ack_every = 2,
+    .ack_delay_ms = 10,
+    .fec = 0,
+    .unordered = 0,
+    .datagram = 0,
+    .migration = 0};
 
 #endif
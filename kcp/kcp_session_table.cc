@@ -0,0 +1,229 @@
+
+#include "kcp_session_table.h"
+
+#include <assert.h>
+
+#include <utility>
+
+namespace {
+
+const size_t kInitialStripeCapacity = 16;
+
+size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t power = 1;
+  while (power < n) {
+    power <<= 1;
+  }
+  return power;
+}
+
+size_t HomeIndex(uint64_t hash, size_t mask) {
+  // the top bits pick the stripe
+  return static_cast<size_t>(hash >> 20) & mask;
+}
+
+}  // namespace
+
+struct KCPSessionTable::Stripe {
+  mutable muduo::MutexLock mutex;
+  // power of two sized, at most half full
+  std::vector<Entry> entries;
+  size_t size{0};
+};
+
+KCPSessionTable::KCPSessionTable(size_t num_stripes)
+    : num_stripes_(RoundUpToPowerOfTwo(num_stripes)),
+      stripes_(std::make_unique<Stripe[]>(num_stripes_)) {
+  while ((size_t(1) << stripe_bits_) < num_stripes_) {
+    ++stripe_bits_;
+  }
+
+  for (size_t i = 0; i < num_stripes_; ++i) {
+    stripes_[i].entries.resize(kInitialStripeCapacity);
+  }
+}
+
+KCPSessionTable::~KCPSessionTable() = default;
+
+uint64_t KCPSessionTable::Hash(uint32_t session_id) {
+  // ids of a shard are congruent modulo the number of shards with session
+  // affinity, multiplicative hashing spreads them all the same
+  return session_id * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+KCPSessionTable::Stripe& KCPSessionTable::GetStripe(uint64_t hash) const {
+  if (stripe_bits_ == 0) {
+    return stripes_[0];
+  }
+  return stripes_[hash >> (64 - stripe_bits_)];
+}
+
+KCPSessionTable::Entry* KCPSessionTable::FindEntry(Stripe& stripe,
+                                                   uint32_t session_id,
+                                                   uint64_t hash) {
+  assert(session_id != 0);
+
+  std::vector<Entry>& entries = stripe.entries;
+  size_t mask = entries.size() - 1;
+  for (size_t i = HomeIndex(hash, mask);; i = (i + 1) & mask) {
+    Entry& entry = entries[i];
+    if (entry.session_id == session_id) {
+      return &entry;
+    }
+    if (entry.session_id == 0) {
+      return nullptr;
+    }
+  }
+}
+
+void KCPSessionTable::EraseEntry(Stripe& stripe, size_t index) {
+  std::vector<Entry>& entries = stripe.entries;
+  size_t mask = entries.size() - 1;
+
+  // shift the following entries of the cluster back, unless that would move
+  // one before its home bucket
+  size_t hole = index;
+  for (size_t i = (index + 1) & mask; entries[i].session_id != 0;
+       i = (i + 1) & mask) {
+    size_t home = HomeIndex(Hash(entries[i].session_id), mask);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      entries[hole] = std::move(entries[i]);
+      hole = i;
+    }
+  }
+
+  entries[hole] = Entry();
+  --stripe.size;
+}
+
+KCPSessionTable::Entry* KCPSessionTable::AddEntry(Stripe& stripe,
+                                                  uint32_t session_id,
+                                                  uint64_t hash) {
+  if ((stripe.size + 1) * 2 > stripe.entries.size()) {
+    Grow(stripe);
+  }
+
+  std::vector<Entry>& entries = stripe.entries;
+  size_t mask = entries.size() - 1;
+  size_t i = HomeIndex(hash, mask);
+  while (entries[i].session_id != 0) {
+    i = (i + 1) & mask;
+  }
+
+  Entry& entry = entries[i];
+  entry.session_id = session_id;
+  ++stripe.size;
+  return &entry;
+}
+
+void KCPSessionTable::Grow(Stripe& stripe) {
+  std::vector<Entry> entries(stripe.entries.size() * 2);
+  size_t mask = entries.size() - 1;
+
+  for (Entry& entry : stripe.entries) {
+    if (entry.session_id == 0) {
+      continue;
+    }
+
+    size_t i = HomeIndex(Hash(entry.session_id), mask);
+    while (entries[i].session_id != 0) {
+      i = (i + 1) & mask;
+    }
+    entries[i] = std::move(entry);
+  }
+
+  stripe.entries.swap(entries);
+}
+
+bool KCPSessionTable::Insert(uint32_t session_id,
+                             const KCPSessionPtr& session,
+                             muduo::Timestamp now) {
+  uint64_t hash = Hash(session_id);
+  Stripe& stripe = GetStripe(hash);
+
+  muduo::MutexLockGuard lock(stripe.mutex);
+  if (FindEntry(stripe, session_id, hash) != nullptr) {
+    return false;
+  }
+
+  Entry* entry = AddEntry(stripe, session_id, hash);
+  entry->state = ESTABLISHED;
+  entry->session = session;
+  entry->time = now;
+
+  return true;
+}
+
+KCPSessionPtr KCPSessionTable::Find(uint32_t session_id) const {
+  uint64_t hash = Hash(session_id);
+  Stripe& stripe = GetStripe(hash);
+
+  muduo::MutexLockGuard lock(stripe.mutex);
+  Entry* entry = FindEntry(stripe, session_id, hash);
+  if (entry == nullptr || entry->state != ESTABLISHED) {
+    return KCPSessionPtr();
+  }
+  return entry->session;
+}
+
+bool KCPSessionTable::Contains(uint32_t session_id) const {
+  uint64_t hash = Hash(session_id);
+  Stripe& stripe = GetStripe(hash);
+
+  muduo::MutexLockGuard lock(stripe.mutex);
+  return FindEntry(stripe, session_id, hash) != nullptr;
+}
+
+bool KCPSessionTable::Touch(uint32_t session_id, muduo::Timestamp now) {
+  uint64_t hash = Hash(session_id);
+  Stripe& stripe = GetStripe(hash);
+
+  muduo::MutexLockGuard lock(stripe.mutex);
+  Entry* entry = FindEntry(stripe, session_id, hash);
+  if (entry == nullptr || entry->state != ESTABLISHED) {
+    return false;
+  }
+  entry->time = now;
+  return true;
+}
+
+KCPSessionPtr KCPSessionTable::Remove(uint32_t session_id,
+                                      muduo::Timestamp now) {
+  uint64_t hash = Hash(session_id);
+  Stripe& stripe = GetStripe(hash);
+
+  muduo::MutexLockGuard lock(stripe.mutex);
+  Entry* entry = FindEntry(stripe, session_id, hash);
+  if (entry == nullptr || entry->state != ESTABLISHED) {
+    return KCPSessionPtr();
+  }
+
+  entry->state = TIME_WAIT;
+  entry->time = now;
+  return std::move(entry->session);
+}
+
+void KCPSessionTable::Sweep(size_t stripe_index, const Visitor& visitor) {
+  assert(stripe_index < num_stripes_);
+
+  Stripe& stripe = stripes_[stripe_index];
+
+  muduo::MutexLockGuard lock(stripe.mutex);
+  std::vector<Entry>& entries = stripe.entries;
+  size_t mask = entries.size() - 1;
+
+  // start right after an empty bucket, no cluster wraps around then and an
+  // erase only shifts back entries not visited yet
+  size_t start = 0;
+  while (entries[start].session_id != 0) {
+    ++start;
+  }
+
+  size_t i = start;
+  for (size_t n = 1; n < entries.size(); ++n) {
+    i = (i + 1) & mask;
+    while (entries[i].session_id != 0 && !visitor(&entries[i])) {
+      EraseEntry(stripe, i);
+    }
+  }
+}
@@ -0,0 +1,89 @@
+
+#ifndef KCP_SESSION_TABLE_H_
+#define KCP_SESSION_TABLE_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <muduo/base/Mutex.h>
+#include <muduo/base/Timestamp.h>
+
+#include "common/macros.h"
+
+#include "kcp_callbacks.h"
+
+// sessions of a server keyed by session_id, shared by all of its loops
+//
+// the ids are split into stripes, each an open addressing table (linear
+// probing, backward shift deletion) behind its own lock, so that lookups from
+// different loops seldom contend. an entry carries the idle and time wait
+// bookkeeping of its session as well, a session_id in time wait is still
+// taken but has no session anymore.
+class KCPSessionTable final {
+ public:
+  enum State {
+    ESTABLISHED,
+    TIME_WAIT,
+  };
+
+  struct Entry {
+    // 0 if the bucket is empty
+    uint32_t session_id{0};
+    State state{ESTABLISHED};
+    // null in time wait
+    KCPSessionPtr session;
+    // last time a ping was received if established, the time it entered
+    // time wait otherwise
+    muduo::Timestamp time;
+  };
+
+  // returns false to erase |entry|, called with the lock of its stripe held,
+  // so it must not call back into the table
+  using Visitor = std::function<bool(Entry* entry)>;
+
+  explicit KCPSessionTable(size_t num_stripes);
+  ~KCPSessionTable();
+
+  // false if |session_id| is taken, whatever its state
+  bool Insert(uint32_t session_id, const KCPSessionPtr& session,
+              muduo::Timestamp now);
+
+  // established sessions only
+  KCPSessionPtr Find(uint32_t session_id) const;
+
+  bool Contains(uint32_t session_id) const;
+
+  // refreshes the idle time of an established session
+  bool Touch(uint32_t session_id, muduo::Timestamp now);
+
+  // moves an established session to time wait and returns it
+  KCPSessionPtr Remove(uint32_t session_id, muduo::Timestamp now);
+
+  // visits every entry of |stripe|
+  void Sweep(size_t stripe, const Visitor& visitor);
+
+  size_t num_stripes() const { return num_stripes_; }
+
+ private:
+  struct Stripe;
+
+  static uint64_t Hash(uint32_t session_id);
+
+  Stripe& GetStripe(uint64_t hash) const;
+
+  static Entry* FindEntry(Stripe& stripe, uint32_t session_id, uint64_t hash);
+  static Entry* AddEntry(Stripe& stripe, uint32_t session_id, uint64_t hash);
+  static void EraseEntry(Stripe& stripe, size_t index);
+  static void Grow(Stripe& stripe);
+
+  const size_t num_stripes_{0};
+  int stripe_bits_{0};
+  std::unique_ptr<Stripe[]> stripes_;
+
+  DISALLOW_COPY_AND_ASSIGN(KCPSessionTable);
+};
+
+#endif
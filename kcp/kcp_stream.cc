@@ -0,0 +1,429 @@
+
+#include "kcp_stream.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+#include <muduo/base/Logging.h>
+#include <muduo/net/EventLoop.h>
+
+#include "kcp_session.h"
+
+const size_t KCPStreamFrameHeader::kStreamFrameHeaderLength;
+const size_t KCPStreamFrameHeader::kWindowUpdateLength;
+
+bool KCPStreamFrameHeader::ReadFrom(const char* buf, size_t length) {
+  assert(buf != nullptr);
+
+  if (length < kStreamFrameHeaderLength) {
+    return false;
+  }
+
+  // le32
+  memcpy(&stream_id, buf, sizeof(stream_id));
+  stream_id = le32toh(stream_id);
+  size_t offset = sizeof(stream_id);
+
+  flags = static_cast<uint8_t>(buf[offset++]);
+
+  // le32
+  memcpy(&frame_seq, buf + offset, sizeof(frame_seq));
+  frame_seq = le32toh(frame_seq);
+
+  return true;
+}
+
+bool KCPStreamFrameHeader::WriteTo(char* buf, size_t length) const {
+  assert(buf != nullptr);
+
+  if (length < kStreamFrameHeaderLength) {
+    return false;
+  }
+
+  uint32_t le32 = htole32(stream_id);
+  memcpy(buf, &le32, sizeof(le32));
+  size_t offset = sizeof(le32);
+
+  buf[offset++] = static_cast<char>(flags);
+
+  le32 = htole32(frame_seq);
+  memcpy(buf + offset, &le32, sizeof(le32));
+
+  return true;
+}
+
+KCPStreamMux::KCPStreamMux(const KCPSessionPtr& session, bool client)
+    : session_(session),
+      next_stream_id_(client ? 1 : 2),
+      peer_closed_below_(client ? 2 : 1) {
+  session_->loop()->assertInLoopThread();
+
+  session_->set_message_spans_callback(
+      [this](const KCPSessionPtr&, const struct iovec* iov, int count) {
+        OnMessage(iov, count);
+      });
+  session_->set_window_update_callback(
+      [this](const KCPSessionPtr&, size_t) { Schedule(); });
+}
+
+KCPStreamMux::~KCPStreamMux() {
+  session_->loop()->assertInLoopThread();
+
+  session_->set_message_spans_callback(nullptr);
+  session_->set_window_update_callback(nullptr);
+}
+
+uint32_t KCPStreamMux::OpenStream(int weight) {
+  session_->loop()->assertInLoopThread();
+
+  uint32_t stream_id = next_stream_id_;
+  next_stream_id_ += 2;
+
+  auto stream = std::make_unique<Stream>();
+  stream->stream_id = stream_id;
+  stream->weight = std::min(std::max(weight, 1), kStreamMaxWeight);
+  streams_.emplace(stream_id, std::move(stream));
+  return stream_id;
+}
+
+bool KCPStreamMux::Write(uint32_t stream_id, const void* data, size_t len) {
+  session_->loop()->assertInLoopThread();
+
+  Stream* stream = FindStream(stream_id);
+  if (stream == nullptr || stream->fin_pending || stream->fin_sent) {
+    return false;
+  }
+
+  stream->send_buffer.append(data, len);
+  Activate(stream);
+  Schedule();
+  return true;
+}
+
+bool KCPStreamMux::CloseStream(uint32_t stream_id) {
+  session_->loop()->assertInLoopThread();
+
+  Stream* stream = FindStream(stream_id);
+  if (stream == nullptr || stream->fin_pending || stream->fin_sent) {
+    return false;
+  }
+
+  stream->fin_pending = true;
+  Activate(stream);
+  Schedule();
+  return true;
+}
+
+bool KCPStreamMux::SetWeight(uint32_t stream_id, int weight) {
+  Stream* stream = FindStream(stream_id);
+  if (stream == nullptr) {
+    return false;
+  }
+
+  stream->weight = std::min(std::max(weight, 1), kStreamMaxWeight);
+  return true;
+}
+
+size_t KCPStreamMux::PendingBytes(uint32_t stream_id) const {
+  Stream* stream = FindStream(stream_id);
+  return stream != nullptr ? stream->send_buffer.readableBytes() : 0;
+}
+
+KCPStreamMux::Stream* KCPStreamMux::FindStream(uint32_t stream_id) const {
+  auto it = streams_.find(stream_id);
+  return it != streams_.end() ? it->second.get() : nullptr;
+}
+
+bool KCPStreamMux::HasFrameToSend(const Stream* stream) const {
+  if (stream->fin_sent) {
+    return false;
+  }
+
+  size_t readable_bytes = stream->send_buffer.readableBytes();
+  if (readable_bytes == 0) {
+    return stream->fin_pending;
+  }
+  // the fin waits behind the data out of credit as well
+  return stream->send_credit > 0;
+}
+
+void KCPStreamMux::Activate(Stream* stream) {
+  if (!stream->active && HasFrameToSend(stream)) {
+    stream->active = true;
+    active_.push_back(stream);
+  }
+}
+
+void KCPStreamMux::MaybeRemove(Stream* stream) {
+  if (stream->fin_sent && stream->fin_received && !stream->active) {
+    uint32_t stream_id = stream->stream_id;
+    streams_.erase(stream_id);
+    if (!IsLocalStream(stream_id)) {
+      ClosePeerStream(stream_id);
+    }
+  }
+}
+
+void KCPStreamMux::ResetStream(Stream* stream) {
+  uint32_t stream_id = stream->stream_id;
+  if (stream->active) {
+    active_.erase(std::find(active_.begin(), active_.end(), stream));
+  }
+  streams_.erase(stream_id);
+  if (!IsLocalStream(stream_id)) {
+    ClosePeerStream(stream_id);
+  }
+
+  if (stream_callback_) {
+    stream_callback_(this, stream_id, false);
+  }
+}
+
+bool KCPStreamMux::IsClosedPeerStream(uint32_t stream_id) const {
+  return static_cast<int32_t>(stream_id - peer_closed_below_) < 0 ||
+         closed_peer_streams_.count(stream_id) > 0;
+}
+
+void KCPStreamMux::ClosePeerStream(uint32_t stream_id) {
+  closed_peer_streams_.insert(stream_id);
+  // only those above the lowest one still open are kept
+  auto it = closed_peer_streams_.begin();
+  while (it != closed_peer_streams_.end() && *it == peer_closed_below_) {
+    it = closed_peer_streams_.erase(it);
+    peer_closed_below_ += 2;
+  }
+}
+
+void KCPStreamMux::Schedule() {
+  if (session_->IsClosed()) {
+    return;
+  }
+
+  const size_t mss = session_->mss();
+  assert(mss > KCPStreamFrameHeader::kStreamFrameHeaderLength);
+  const size_t max_payload =
+      mss - KCPStreamFrameHeader::kStreamFrameHeaderLength;
+
+  // in whole segments, one per frame
+  size_t writable_bytes = session_->WritableBytes();
+
+  // the credit of the peer must not wait behind data, nor be written past
+  // the window where ikcp would append it to the segment of another frame
+  while (!window_updates_.empty() && writable_bytes >= mss) {
+    Stream* stream = FindStream(window_updates_.front());
+    window_updates_.pop_front();
+    if (stream != nullptr) {
+      SendWindowUpdate(stream);
+      writable_bytes -= mss;
+    }
+  }
+
+  while (!active_.empty() && writable_bytes >= mss) {
+    Stream* stream = active_.front();
+    active_.pop_front();
+    stream->deficit += static_cast<size_t>(stream->weight) * kStreamQuantum;
+
+    while (writable_bytes >= mss && HasFrameToSend(stream)) {
+      size_t readable_bytes = stream->send_buffer.readableBytes();
+      size_t len = std::min(readable_bytes, max_payload);
+      len = static_cast<size_t>(std::min<uint64_t>(len, stream->send_credit));
+      if (len > stream->deficit) {
+        break;
+      }
+
+      SendFrame(stream, len, stream->fin_pending && len == readable_bytes);
+      stream->deficit -= len;
+      writable_bytes -= mss;
+    }
+
+    if (!HasFrameToSend(stream)) {
+      // no credit is saved up while idle
+      stream->active = false;
+      stream->deficit = 0;
+      MaybeRemove(stream);
+    } else if (writable_bytes < mss) {
+      // its turn goes on once the window has room again
+      active_.push_front(stream);
+    } else {
+      active_.push_back(stream);
+    }
+  }
+}
+
+void KCPStreamMux::SendFrame(Stream* stream, size_t len, bool fin) {
+  KCPStreamFrameHeader header;
+  header.stream_id = stream->stream_id;
+  header.flags = fin ? STREAM_FIN : 0;
+  header.frame_seq = stream->send_seq++;
+
+  char buf[KCPStreamFrameHeader::kStreamFrameHeaderLength];
+  header.WriteTo(buf, sizeof(buf));
+
+  struct iovec iov[2];
+  iov[0].iov_base = buf;
+  iov[0].iov_len = sizeof(buf);
+  iov[1].iov_base = const_cast<char*>(stream->send_buffer.peek());
+  iov[1].iov_len = len;
+  session_->Write(iov, 2);
+
+  stream->send_buffer.retrieve(len);
+  stream->send_credit -= len;
+  if (fin) {
+    stream->fin_pending = false;
+    stream->fin_sent = true;
+  }
+}
+
+void KCPStreamMux::SendWindowUpdate(Stream* stream) {
+  KCPStreamFrameHeader header;
+  header.stream_id = stream->stream_id;
+  header.flags = STREAM_WINDOW;
+
+  char buf[KCPStreamFrameHeader::kStreamFrameHeaderLength +
+           KCPStreamFrameHeader::kWindowUpdateLength];
+  header.WriteTo(buf, sizeof(buf));
+  uint32_t le32 = htole32(stream->consumed);
+  memcpy(buf + KCPStreamFrameHeader::kStreamFrameHeaderLength, &le32,
+         sizeof(le32));
+
+  session_->Write(buf, sizeof(buf));
+  stream->consumed = 0;
+  stream->window_update_pending = false;
+}
+
+void KCPStreamMux::OnMessage(const struct iovec* iov, int count) {
+  // frames are never sent in more than one segment
+  if (count != 1) {
+    LOG_ERROR << "session: " << session_->session_id()
+              << " stream frame in " << count << " fragments";
+    return;
+  }
+
+  const char* data = static_cast<const char*>(iov[0].iov_base);
+  size_t len = iov[0].iov_len;
+
+  KCPStreamFrameHeader header;
+  if (!header.ReadFrom(data, len)) {
+    LOG_ERROR << "session: " << session_->session_id()
+              << " stream frame too short, len: " << len;
+    return;
+  }
+  data += KCPStreamFrameHeader::kStreamFrameHeaderLength;
+  len -= KCPStreamFrameHeader::kStreamFrameHeaderLength;
+
+  Stream* stream = FindStream(header.stream_id);
+
+  if (header.flags & STREAM_WINDOW) {
+    // for a stream closed since, if at all
+    if (stream == nullptr || len < KCPStreamFrameHeader::kWindowUpdateLength) {
+      return;
+    }
+
+    uint32_t consumed = 0;
+    memcpy(&consumed, data, sizeof(consumed));
+    stream->send_credit += le32toh(consumed);
+    // scheduled by the window update callback after the input
+    Activate(stream);
+    return;
+  }
+
+  if (stream == nullptr) {
+    if (IsLocalStream(header.stream_id) ||
+        IsClosedPeerStream(header.stream_id)) {
+      LOG_WARN << "session: " << session_->session_id()
+               << " frame of closed stream: " << header.stream_id;
+      return;
+    }
+
+    auto new_stream = std::make_unique<Stream>();
+    new_stream->stream_id = header.stream_id;
+    stream = new_stream.get();
+    streams_.emplace(header.stream_id, std::move(new_stream));
+    if (stream_callback_) {
+      stream_callback_(this, header.stream_id, true);
+    }
+  }
+
+  OnDataFrame(stream, header, data, len);
+
+  // the callbacks may have closed it
+  stream = FindStream(header.stream_id);
+  if (stream != nullptr) {
+    MaybeRemove(stream);
+  }
+}
+
+void KCPStreamMux::OnDataFrame(Stream* stream,
+                               const KCPStreamFrameHeader& header,
+                               const char* data, size_t len) {
+  bool fin = (header.flags & STREAM_FIN) != 0;
+  auto ahead = static_cast<int32_t>(header.frame_seq - stream->recv_seq);
+  if (stream->fin_received || ahead < 0) {
+    return;
+  }
+
+  if (ahead > 0) {
+    // every frame but the fin carries a byte at least
+    if (static_cast<uint32_t>(ahead) > kStreamWindow ||
+        stream->out_of_order_bytes + len > kStreamWindow) {
+      LOG_ERROR << "session: " << session_->session_id()
+                << " stream: " << stream->stream_id
+                << " past its window, reset, frames ahead: " << ahead;
+      ResetStream(stream);
+      return;
+    }
+
+    auto result = stream->out_of_order.emplace(
+        header.frame_seq, std::make_pair(std::string(data, len), fin));
+    if (result.second) {
+      stream->out_of_order_bytes += len;
+    }
+    return;
+  }
+
+  // the stream may be gone once its fin is delivered
+  Deliver(stream, data, len, fin);
+  while (!fin) {
+    auto it = stream->out_of_order.find(stream->recv_seq);
+    if (it == stream->out_of_order.end()) {
+      break;
+    }
+
+    std::pair<std::string, bool> frame = std::move(it->second);
+    stream->out_of_order.erase(it);
+    stream->out_of_order_bytes -= frame.first.size();
+    fin = frame.second;
+    Deliver(stream, frame.first.data(), frame.first.size(), fin);
+  }
+}
+
+void KCPStreamMux::Deliver(Stream* stream, const char* data, size_t len,
+                           bool fin) {
+  ++stream->recv_seq;
+
+  if (len > 0 && stream_data_callback_) {
+    stream_data_callback_(this, stream->stream_id, data, len);
+  }
+
+  if (fin) {
+    stream->fin_received = true;
+    stream->out_of_order.clear();
+    stream->out_of_order_bytes = 0;
+    if (stream_callback_) {
+      stream_callback_(this, stream->stream_id, false);
+    }
+    return;
+  }
+
+  // sent by Schedule, from the window update callback after the input
+  stream->consumed += static_cast<uint32_t>(len);
+  if (stream->consumed >= kStreamWindow / 2 &&
+      !stream->window_update_pending) {
+    stream->window_update_pending = true;
+    window_updates_.push_back(stream->stream_id);
+  }
+}
@@ -0,0 +1,165 @@
+
+#ifndef KCP_STREAM_H_
+#define KCP_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include <muduo/net/Buffer.h>
+
+#include "common/macros.h"
+
+#include "kcp_callbacks.h"
+#include "kcp_constants.h"
+
+// many streams over one session, each frame is one message of the session
+// and so one segment of ikcp, with the session unordered a segment lost only
+// holds back the stream it belongs to
+//
+// +-----------+-------+-----------+---------+
+// | stream_id | flags | frame_seq | payload |
+// +-----------+-------+-----------+---------+
+//     le32      uint8     le32
+//
+// frame_seq counts the data frames of the stream, the fin included, a window
+// update is outside of it and carries the bytes delivered since the last one
+// as a le32 payload
+enum KCPStreamFrameFlag : uint8_t {
+  STREAM_FIN = 1 << 0,
+  STREAM_WINDOW = 1 << 1,
+};
+
+struct KCPStreamFrameHeader {
+  bool ReadFrom(const char* buf, size_t length);
+  bool WriteTo(char* buf, size_t length) const;
+
+  uint32_t stream_id{0};
+  uint8_t flags{0};
+  uint32_t frame_seq{0};
+
+  static const size_t kStreamFrameHeaderLength =
+      sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+  static const size_t kWindowUpdateLength = sizeof(uint32_t);
+};
+
+// a stream is open at its first frame and gone once both sides have sent
+// their fin, the streams of the client have odd ids and those of the server
+// even ones so that neither has to ask the other, each stream may have
+// kStreamWindow bytes in flight and the window of the session is shared by
+// deficit round robin in proportion to the weights
+//
+// takes the message spans and window update callbacks of the session over,
+// both sides should make it unordered, see KCPSession::Params, all calls in
+// the loop thread of the session
+class KCPStreamMux final {
+ public:
+  KCPStreamMux(const KCPSessionPtr& session, bool client);
+
+  ~KCPStreamMux();
+
+  // weight in [1, kStreamMaxWeight], returns the stream id
+  uint32_t OpenStream(int weight = kStreamDefaultWeight);
+
+  // queued until the windows of the stream and the session have room, false
+  // if the stream is unknown or closed
+  bool Write(uint32_t stream_id, const void* data, size_t len);
+
+  // the fin follows the data queued
+  bool CloseStream(uint32_t stream_id);
+
+  bool SetWeight(uint32_t stream_id, int weight);
+
+  // bytes queued but not yet handed to the session
+  size_t PendingBytes(uint32_t stream_id) const;
+
+  size_t num_streams() const { return streams_.size(); }
+
+  const KCPSessionPtr& session() const { return session_; }
+
+  void set_stream_callback(StreamCallback cb) {
+    stream_callback_ = std::move(cb);
+  }
+
+  void set_stream_data_callback(StreamDataCallback cb) {
+    stream_data_callback_ = std::move(cb);
+  }
+
+ private:
+  struct Stream {
+    uint32_t stream_id{0};
+    int weight{kStreamDefaultWeight};
+
+    muduo::net::Buffer send_buffer;
+    uint32_t send_seq{0};
+    // bytes the peer has room for
+    uint64_t send_credit{kStreamWindow};
+    size_t deficit{0};
+    bool fin_pending{false};
+    bool fin_sent{false};
+    // in active_
+    bool active{false};
+
+    uint32_t recv_seq{0};
+    // frames ahead of recv_seq, a peer which keeps to the credit sends no
+    // more than kStreamWindow bytes of them, the stream is reset otherwise
+    std::map<uint32_t, std::pair<std::string, bool>> out_of_order;
+    size_t out_of_order_bytes{0};
+    // delivered since the last window update
+    uint32_t consumed{0};
+    // in window_updates_
+    bool window_update_pending{false};
+    bool fin_received{false};
+  };
+
+  Stream* FindStream(uint32_t stream_id) const;
+  bool IsLocalStream(uint32_t stream_id) const {
+    return (stream_id & 1) == (next_stream_id_ & 1);
+  }
+  bool IsClosedPeerStream(uint32_t stream_id) const;
+  void ClosePeerStream(uint32_t stream_id);
+
+  bool HasFrameToSend(const Stream* stream) const;
+  void Activate(Stream* stream);
+  void MaybeRemove(Stream* stream);
+  // gone at once without a fin, for a peer past its credit
+  void ResetStream(Stream* stream);
+
+  // the window updates and then the frames of the active streams, each frame
+  // in a segment of its own, while the session takes them without queueing
+  void Schedule();
+  void SendFrame(Stream* stream, size_t len, bool fin);
+  void SendWindowUpdate(Stream* stream);
+
+  void OnMessage(const struct iovec* iov, int count);
+  void OnDataFrame(Stream* stream, const KCPStreamFrameHeader& header,
+                   const char* data, size_t len);
+  void Deliver(Stream* stream, const char* data, size_t len, bool fin);
+
+  KCPSessionPtr session_;
+  uint32_t next_stream_id_{0};
+  // the streams of the peer below it are all closed, those above it as well
+  // if in closed_peer_streams_, any other one unknown is opened by its first
+  // frame whatever order the frames of different streams come in
+  uint32_t peer_closed_below_{0};
+  std::set<uint32_t> closed_peer_streams_;
+
+  std::unordered_map<uint32_t, std::unique_ptr<Stream>> streams_;
+  std::deque<Stream*> active_;
+  // ids of the streams owing the peer a window update, a stream may be gone
+  // by the time its turn comes
+  std::deque<uint32_t> window_updates_;
+
+  StreamCallback stream_callback_;
+  StreamDataCallback stream_data_callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(KCPStreamMux);
+};
+
+#endif
@@ -0,0 +1,210 @@
+
+#include "kcp_ticket.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include <muduo/base/Logging.h>
+
+#include "kcp_constants.h"
+#include "urandom.h"
+
+const size_t KCPTicketCrypter::kKeyLength;
+const size_t KCPTicketCrypter::kNonceLength;
+const size_t KCPTicketCrypter::kTagLength;
+const size_t KCPTicketCrypter::kSealedLength;
+const size_t KCPTicketCrypter::kTicketLength;
+const size_t KCPTicketCrypter::kIssuedTicketLength;
+
+namespace {
+
+struct ScopedCipherCtxDeleter {
+  inline void operator()(EVP_CIPHER_CTX* x) const {
+    if (x != nullptr) {
+      EVP_CIPHER_CTX_free(x);
+    }
+  }
+};
+
+using ScopedCipherCtx = std::unique_ptr<EVP_CIPHER_CTX, ScopedCipherCtxDeleter>;
+
+// key_id and nonce, authenticated but not sealed
+const size_t kTicketPrefixLength =
+    sizeof(uint8_t) + KCPTicketCrypter::kNonceLength;
+
+}  // namespace
+
+KCPTicketCrypter::KCPTicketCrypter() {
+  current_key_ = NewKey(0, muduo::Timestamp::now());
+}
+
+KCPTicketCrypter::~KCPTicketCrypter() = default;
+
+std::unique_ptr<KCPTicketCrypter::Key> KCPTicketCrypter::NewKey(
+    uint8_t key_id, muduo::Timestamp now) {
+  auto key = std::make_unique<Key>();
+  key->key_id = key_id;
+  key->created_time = now;
+  if (!URandom::GetInstance().RandBytes(key->key, sizeof(key->key)) ||
+      !URandom::GetInstance().RandBytes(key->salt, sizeof(key->salt))) {
+    LOG_ERROR << "RandBytes failed, no ticket key";
+    return nullptr;
+  }
+  return key;
+}
+
+void KCPTicketCrypter::MaybeRotate(muduo::Timestamp now) {
+  if (current_key_ && muduo::timeDifference(now, current_key_->created_time) <
+                          kTicketKeyRotationSeconds) {
+    return;
+  }
+
+  uint8_t key_id = current_key_ ? static_cast<uint8_t>(current_key_->key_id + 1)
+                                : 0;
+  std::unique_ptr<Key> key = NewKey(key_id, now);
+  if (!key) {
+    return;
+  }
+
+  // a key rotated out twice is gone along with the tickets it has consumed
+  previous_key_ = std::move(current_key_);
+  current_key_ = std::move(key);
+}
+
+KCPTicketCrypter::Key* KCPTicketCrypter::FindKey(uint8_t key_id) const {
+  if (current_key_ && current_key_->key_id == key_id) {
+    return current_key_.get();
+  }
+  if (previous_key_ && previous_key_->key_id == key_id) {
+    return previous_key_.get();
+  }
+  return nullptr;
+}
+
+bool KCPTicketCrypter::Seal(const KCPTicket& ticket, muduo::Timestamp now,
+                            char* buf, size_t length) {
+  assert(buf != nullptr);
+
+  if (length < kTicketLength) {
+    return false;
+  }
+
+  muduo::MutexLockGuard lock(mutex_);
+  MaybeRotate(now);
+  Key* key = current_key_.get();
+  if (key == nullptr) {
+    return false;
+  }
+
+  buf[0] = static_cast<char>(key->key_id);
+  size_t offset = sizeof(uint8_t);
+
+  // never the same nonce twice under one key
+  uint64_t number = key->next_number++;
+  memcpy(buf + offset, key->salt, sizeof(key->salt));
+  offset += sizeof(key->salt);
+  uint64_t le64 = htole64(number);
+  memcpy(buf + offset, &le64, sizeof(le64));
+  offset += sizeof(le64);
+
+  unsigned char plaintext[kSealedLength];
+  uint32_t le32 = htole32(ticket.session_id);
+  memcpy(plaintext, &le32, sizeof(le32));
+  size_t plain_offset = sizeof(le32);
+  le32 = htole32(ticket.resume_session_id);
+  memcpy(plaintext + plain_offset, &le32, sizeof(le32));
+  plain_offset += sizeof(le32);
+  plaintext[plain_offset++] = ticket.options;
+  le32 = htole32(static_cast<uint32_t>(now.secondsSinceEpoch() +
+                                       kTicketKeyRotationSeconds));
+  memcpy(plaintext + plain_offset, &le32, sizeof(le32));
+
+  auto prefix = reinterpret_cast<const unsigned char*>(buf);
+  auto sealed = reinterpret_cast<unsigned char*>(buf + kTicketPrefixLength);
+  auto tag = sealed + kSealedLength;
+
+  ScopedCipherCtx ctx(EVP_CIPHER_CTX_new());
+  int len = 0;
+  if (!ctx ||
+      EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_gcm(), nullptr, key->key,
+                         prefix + sizeof(uint8_t)) != 1 ||
+      EVP_EncryptUpdate(ctx.get(), nullptr, &len, prefix,
+                        static_cast<int>(kTicketPrefixLength)) != 1 ||
+      EVP_EncryptUpdate(ctx.get(), sealed, &len, plaintext,
+                        static_cast<int>(sizeof(plaintext))) != 1 ||
+      EVP_EncryptFinal_ex(ctx.get(), sealed + len, &len) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG,
+                          static_cast<int>(kTagLength), tag) != 1) {
+    LOG_ERROR << "seal ticket failed, session_id: " << ticket.session_id;
+    return false;
+  }
+
+  return true;
+}
+
+bool KCPTicketCrypter::Open(const char* buf, size_t length,
+                            muduo::Timestamp now, bool consume,
+                            KCPTicket* ticket) {
+  assert(buf != nullptr);
+  assert(ticket != nullptr);
+
+  if (length != kTicketLength) {
+    return false;
+  }
+
+  auto prefix = reinterpret_cast<const unsigned char*>(buf);
+  const unsigned char* sealed = prefix + kTicketPrefixLength;
+  const unsigned char* tag = sealed + kSealedLength;
+
+  muduo::MutexLockGuard lock(mutex_);
+  MaybeRotate(now);
+  Key* key = FindKey(prefix[0]);
+  if (key == nullptr) {
+    return false;
+  }
+
+  unsigned char plaintext[kSealedLength];
+  ScopedCipherCtx ctx(EVP_CIPHER_CTX_new());
+  int len = 0;
+  if (!ctx ||
+      EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_gcm(), nullptr, key->key,
+                         prefix + sizeof(uint8_t)) != 1 ||
+      EVP_DecryptUpdate(ctx.get(), nullptr, &len, prefix,
+                        static_cast<int>(kTicketPrefixLength)) != 1 ||
+      EVP_DecryptUpdate(ctx.get(), plaintext, &len, sealed,
+                        static_cast<int>(kSealedLength)) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG,
+                          static_cast<int>(kTagLength),
+                          const_cast<unsigned char*>(tag)) != 1 ||
+      EVP_DecryptFinal_ex(ctx.get(), plaintext + len, &len) != 1) {
+    return false;
+  }
+
+  uint32_t expire_time = 0;
+  memcpy(&expire_time,
+         plaintext + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t),
+         sizeof(expire_time));
+  if (static_cast<int64_t>(le32toh(expire_time)) < now.secondsSinceEpoch()) {
+    return false;
+  }
+
+  if (consume) {
+    uint64_t number = 0;
+    memcpy(&number, prefix + sizeof(uint8_t) + sizeof(key->salt),
+           sizeof(number));
+    if (!key->consumed.insert(le64toh(number)).second) {
+      return false;
+    }
+  }
+
+  uint32_t le32 = 0;
+  memcpy(&le32, plaintext, sizeof(le32));
+  ticket->session_id = le32toh(le32);
+  memcpy(&le32, plaintext + sizeof(le32), sizeof(le32));
+  ticket->resume_session_id = le32toh(le32);
+  ticket->options = plaintext[sizeof(le32) + sizeof(le32)];
+  return true;
+}
@@ -0,0 +1,93 @@
+
+#ifndef KCP_TICKET_H_
+#define KCP_TICKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <unordered_set>
+
+#include <muduo/base/Mutex.h>
+#include <muduo/base/Timestamp.h>
+
+#include "common/macros.h"
+
+// what the server vouches for to a client which resumes a session without a
+// handshake, see RESUME_PACKET
+struct KCPTicket {
+  // the session the ticket was handed out in
+  uint32_t session_id{0};
+  // a fresh one for the resumed session, so that it has its own ikcp conv and
+  // the late packets of the session before are not taken for its own
+  uint32_t resume_session_id{0};
+  // KCPSessionOption bits agreed on in the handshake
+  uint8_t options{0};
+};
+
+// tickets are sealed with AES-128-GCM under a key only the server knows, so a
+// client can neither read nor forge them
+//
+// +--------+-------+------------+-----------+---------+--------+-----+
+// | key_id | nonce | session_id | resume_id | options | expire | tag |
+// +--------+-------+------------+-----------+---------+--------+-----+
+//   uint8    12 B      le32         le32       uint8     le32   16 B
+//                  '---------------- sealed ----------------'
+//
+// resume_id is the resume_session_id and expire the expire time
+//
+// the server hands a ticket out with its resume_session_id in front of it as
+// le32, as the client has to know it, see kIssuedTicketLength
+//
+// the key changes every kTicketKeyRotationSeconds, tickets of the key before
+// are still opened, thread safe
+class KCPTicketCrypter final {
+ public:
+  KCPTicketCrypter();
+  ~KCPTicketCrypter();
+
+  // |buf| of kTicketLength bytes at least
+  bool Seal(const KCPTicket& ticket, muduo::Timestamp now, char* buf,
+            size_t length);
+
+  // false if forged, expired or of a key rotated out, a ticket opened with
+  // |consume| is refused from then on, so that the first flight sent along
+  // can not be replayed
+  bool Open(const char* buf, size_t length, muduo::Timestamp now,
+            bool consume, KCPTicket* ticket);
+
+  static const size_t kKeyLength = 16;
+  static const size_t kNonceLength = 12;
+  static const size_t kTagLength = 16;
+  static const size_t kSealedLength = sizeof(uint32_t) + sizeof(uint32_t) +
+                                      sizeof(uint8_t) + sizeof(uint32_t);
+  static const size_t kTicketLength =
+      sizeof(uint8_t) + kNonceLength + kSealedLength + kTagLength;
+  static const size_t kIssuedTicketLength = sizeof(uint32_t) + kTicketLength;
+
+ private:
+  struct Key {
+    uint8_t key_id{0};
+    unsigned char key[kKeyLength];
+    // the nonce is the salt followed by the le64 number of the ticket
+    unsigned char salt[kNonceLength - sizeof(uint64_t)];
+    uint64_t next_number{0};
+    muduo::Timestamp created_time;
+    // numbers of the tickets consumed
+    std::unordered_set<uint64_t> consumed;
+  };
+
+  static std::unique_ptr<Key> NewKey(uint8_t key_id, muduo::Timestamp now);
+
+  // with mutex_ held
+  void MaybeRotate(muduo::Timestamp now);
+  Key* FindKey(uint8_t key_id) const;
+
+  muduo::MutexLock mutex_;
+  std::unique_ptr<Key> current_key_;
+  std::unique_ptr<Key> previous_key_;
+
+  DISALLOW_COPY_AND_ASSIGN(KCPTicketCrypter);
+};
+
+#endif
@@ -0,0 +1,270 @@
+
+#include "kcp_timer_wheel.h"
+
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <muduo/base/Logging.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+
+const int KCPTimerWheel::kNumLevels;
+const int KCPTimerWheel::kLevel0Bits;
+const int KCPTimerWheel::kLevelBits;
+const int KCPTimerWheel::kLevel0Slots;
+const int KCPTimerWheel::kLevelSlots;
+const uint64_t KCPTimerWheel::kMaxTicks;
+
+namespace {
+
+const int64_t kNanoSecondsPerTick = 1000 * 1000;
+
+int64_t MonotonicNanoSeconds() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+int CreateTimerfd() {
+  int timerfd =
+      ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerfd < 0) {
+    LOG_SYSFATAL << "::timerfd_create";
+  }
+  return timerfd;
+}
+
+// the first tick of level 0 covered by |level|
+int LevelShift(int level) { return level == 0 ? 0 : 8 + (level - 1) * 6; }
+
+}  // namespace
+
+KCPTimerWheel::KCPTimerWheel(muduo::net::EventLoop* loop)
+    : loop_(CHECK_NOTNULL(loop)),
+      timerfd_(CreateTimerfd()),
+      channel_(std::make_unique<muduo::net::Channel>(loop, timerfd_)),
+      start_ns_(MonotonicNanoSeconds()),
+      slots_(std::make_unique<KCPWheelTimer[]>(
+          kLevel0Slots + (kNumLevels - 1) * kLevelSlots)) {
+  static_assert(kLevel0Bits == 8 && kLevelBits == 6, "see LevelShift");
+
+  channel_->setReadCallback([this](muduo::Timestamp) { HandleRead(); });
+  channel_->enableReading();
+}
+
+KCPTimerWheel::~KCPTimerWheel() {
+  loop_->assertInLoopThread();
+
+  channel_->disableAll();
+  channel_->remove();
+  ::close(timerfd_);
+
+  if (num_timers_ > 0) {
+    LOG_WARN << "~KCPTimerWheel there are still " << num_timers_
+             << " timers scheduled";
+    int num_slots = kLevel0Slots + (kNumLevels - 1) * kLevelSlots;
+    for (int i = 0; i < num_slots; ++i) {
+      KCPWheelTimer* head = &slots_[i];
+      while (head->next != nullptr) {
+        Unlink(head->next);
+      }
+    }
+  }
+}
+
+uint64_t KCPTimerWheel::NowTick() const {
+  return static_cast<uint64_t>((MonotonicNanoSeconds() - start_ns_) /
+                               kNanoSecondsPerTick);
+}
+
+KCPWheelTimer* KCPTimerWheel::Slot(int level, int index) {
+  if (level == 0) {
+    return &slots_[index];
+  }
+  return &slots_[kLevel0Slots + (level - 1) * kLevelSlots + index];
+}
+
+void KCPTimerWheel::Link(KCPWheelTimer* head, KCPWheelTimer* timer) {
+  assert(!timer->IsScheduled());
+
+  timer->prev = head;
+  timer->next = head->next;
+  if (head->next != nullptr) {
+    head->next->prev = timer;
+  }
+  head->next = timer;
+}
+
+void KCPTimerWheel::Unlink(KCPWheelTimer* timer) {
+  assert(timer->IsScheduled());
+
+  timer->prev->next = timer->next;
+  if (timer->next != nullptr) {
+    timer->next->prev = timer->prev;
+  }
+  timer->prev = nullptr;
+  timer->next = nullptr;
+}
+
+void KCPTimerWheel::Schedule(KCPWheelTimer* timer, uint32_t delay_ms) {
+  loop_->assertInLoopThread();
+  assert(timer->callback);
+
+  if (timer->IsScheduled()) {
+    Unlink(timer);
+    --num_timers_;
+  }
+
+  // ticks passed since the last one handled are not lost
+  uint64_t now_tick = std::max(NowTick(), current_tick_);
+  timer->expire_tick = std::max(now_tick + delay_ms, current_tick_ + 1);
+  AddTimer(timer);
+  ++num_timers_;
+
+  if (!in_tick_ && (armed_tick_ == 0 || timer->expire_tick < armed_tick_)) {
+    ArmTimerfd();
+  }
+}
+
+void KCPTimerWheel::Cancel(KCPWheelTimer* timer) {
+  loop_->assertInLoopThread();
+
+  // the timerfd is left armed, a spurious tick is cheap
+  if (timer->IsScheduled()) {
+    Unlink(timer);
+    --num_timers_;
+  }
+}
+
+void KCPTimerWheel::AddTimer(KCPWheelTimer* timer) {
+  // cascaded on the very tick it expires, the slot runs right after
+  if (timer->expire_tick <= current_tick_) {
+    Link(Slot(0, static_cast<int>(current_tick_ & (kLevel0Slots - 1))), timer);
+    return;
+  }
+
+  uint64_t delta = timer->expire_tick - current_tick_;
+  if (delta >= kMaxTicks) {
+    timer->expire_tick = current_tick_ + kMaxTicks - 1;
+    delta = kMaxTicks - 1;
+  }
+
+  if (delta < kLevel0Slots) {
+    Link(Slot(0, static_cast<int>(timer->expire_tick & (kLevel0Slots - 1))),
+         timer);
+    return;
+  }
+
+  for (int level = 1; level < kNumLevels; ++level) {
+    int shift = LevelShift(level);
+    if (delta < (uint64_t(1) << (shift + kLevelBits))) {
+      int index =
+          static_cast<int>((timer->expire_tick >> shift) & (kLevelSlots - 1));
+      Link(Slot(level, index), timer);
+      return;
+    }
+  }
+
+  assert(false);
+}
+
+void KCPTimerWheel::Cascade(int level) {
+  int shift = LevelShift(level);
+  int index = static_cast<int>((current_tick_ >> shift) & (kLevelSlots - 1));
+
+  KCPWheelTimer* head = Slot(level, index);
+  while (head->next != nullptr) {
+    KCPWheelTimer* timer = head->next;
+    Unlink(timer);
+    AddTimer(timer);
+  }
+}
+
+void KCPTimerWheel::Advance(uint64_t now_tick) {
+  if (num_timers_ == 0) {
+    current_tick_ = std::max(current_tick_, now_tick);
+    return;
+  }
+
+  while (current_tick_ < now_tick) {
+    ++current_tick_;
+
+    int index = static_cast<int>(current_tick_ & (kLevel0Slots - 1));
+    if (index == 0) {
+      for (int level = 1; level < kNumLevels; ++level) {
+        Cascade(level);
+        int shift = LevelShift(level);
+        if (((current_tick_ >> shift) & (kLevelSlots - 1)) != 0) {
+          break;
+        }
+      }
+    }
+
+    // a callback may cancel or reschedule any timer, including itself
+    KCPWheelTimer* head = Slot(0, index);
+    while (head->next != nullptr) {
+      KCPWheelTimer* timer = head->next;
+      Unlink(timer);
+      --num_timers_;
+      timer->callback();
+    }
+  }
+}
+
+void KCPTimerWheel::HandleRead() {
+  loop_->assertInLoopThread();
+
+  uint64_t expirations = 0;
+  ssize_t n = ::read(timerfd_, &expirations, sizeof(expirations));
+  UNUSED(n);
+
+  armed_tick_ = 0;
+
+  in_tick_ = true;
+  Advance(NowTick());
+  in_tick_ = false;
+
+  if (tick_callback_) {
+    tick_callback_();
+  }
+
+  ArmTimerfd();
+}
+
+void KCPTimerWheel::ArmTimerfd() {
+  if (num_timers_ == 0) {
+    return;
+  }
+
+  // the next non empty slot of level 0, or the end of its round where the
+  // upper levels are cascaded
+  uint64_t next_tick = current_tick_ + 1;
+  while ((next_tick & (kLevel0Slots - 1)) != 0 &&
+         Slot(0, static_cast<int>(next_tick & (kLevel0Slots - 1)))->next ==
+             nullptr) {
+    ++next_tick;
+  }
+
+  if (next_tick == armed_tick_) {
+    return;
+  }
+
+  int64_t expire_ns =
+      start_ns_ + static_cast<int64_t>(next_tick) * kNanoSecondsPerTick;
+
+  struct itimerspec new_value;
+  memset(&new_value, 0, sizeof(new_value));
+  new_value.it_value.tv_sec = expire_ns / (1000 * 1000 * 1000);
+  new_value.it_value.tv_nsec = expire_ns % (1000 * 1000 * 1000);
+  if (::timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &new_value, nullptr) <
+      0) {
+    LOG_SYSERR << "::timerfd_settime";
+    return;
+  }
+
+  armed_tick_ = next_tick;
+}
@@ -0,0 +1,113 @@
+
+#ifndef KCP_TIMER_WHEEL_H_
+#define KCP_TIMER_WHEEL_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+
+#include "common/macros.h"
+
+namespace muduo {
+namespace net {
+
+class Channel;
+class EventLoop;
+}  // namespace net
+}  // namespace muduo
+
+// a timer of KCPTimerWheel, embedded in its owner which must cancel it before
+// going away, no allocation is needed to (re)schedule it
+struct KCPWheelTimer {
+  KCPWheelTimer() = default;
+  ~KCPWheelTimer() { assert(!IsScheduled()); }
+
+  bool IsScheduled() const { return prev != nullptr; }
+
+  std::function<void()> callback;
+
+  // managed by the wheel, |prev| of a list head is always null
+  KCPWheelTimer* prev{nullptr};
+  KCPWheelTimer* next{nullptr};
+  uint64_t expire_tick{0};
+
+  DISALLOW_COPY_AND_ASSIGN(KCPWheelTimer);
+};
+
+// hierarchical timing wheel with 1ms ticks
+// http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+//
+// level 0 holds the timers of the next 256 ticks, each upper level covers 64
+// slots of the whole lower level and is cascaded down when the lower one
+// wraps around, so schedule and cancel are O(1) whatever the number of
+// timers. one timerfd per loop, armed for the next non empty tick only.
+//
+// all methods must be called in the thread of the loop
+class KCPTimerWheel final {
+ public:
+  using TickCallback = std::function<void()>;
+
+  explicit KCPTimerWheel(muduo::net::EventLoop* loop);
+  ~KCPTimerWheel();
+
+  // fires |timer| after |delay_ms|, reschedules it if already scheduled
+  void Schedule(KCPWheelTimer* timer, uint32_t delay_ms);
+  void Cancel(KCPWheelTimer* timer);
+
+  // the timers of a tick are running
+  bool InTick() const { return in_tick_; }
+
+  // called after all the timers of a tick have run
+  void set_tick_callback(TickCallback cb) { tick_callback_ = std::move(cb); }
+
+  size_t num_timers() const { return num_timers_; }
+
+  muduo::net::EventLoop* loop() const { return loop_; }
+
+ private:
+  static const int kNumLevels = 4;
+  static const int kLevel0Bits = 8;
+  static const int kLevelBits = 6;
+  static const int kLevel0Slots = 1 << kLevel0Bits;
+  static const int kLevelSlots = 1 << kLevelBits;
+  // 2^26 ms, ~18.6 hours
+  static const uint64_t kMaxTicks = uint64_t(1)
+                                    << (kLevel0Bits + 3 * kLevelBits);
+
+  uint64_t NowTick() const;
+
+  void HandleRead();
+  void Advance(uint64_t now_tick);
+  void Cascade(int level);
+  void AddTimer(KCPWheelTimer* timer);
+  void ArmTimerfd();
+
+  KCPWheelTimer* Slot(int level, int index);
+
+  static void Link(KCPWheelTimer* head, KCPWheelTimer* timer);
+  static void Unlink(KCPWheelTimer* timer);
+
+  muduo::net::EventLoop* const loop_{nullptr};
+
+  const int timerfd_{-1};
+  std::unique_ptr<muduo::net::Channel> channel_;
+
+  // CLOCK_MONOTONIC of tick 0
+  int64_t start_ns_{0};
+  uint64_t current_tick_{0};
+  // 0 if disarmed
+  uint64_t armed_tick_{0};
+
+  // list heads, level 0 first
+  std::unique_ptr<KCPWheelTimer[]> slots_;
+  size_t num_timers_{0};
+
+  bool in_tick_{false};
+  TickCallback tick_callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(KCPTimerWheel);
+};
+
+#endif
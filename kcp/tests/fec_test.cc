@@ -0,0 +1,278 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <muduo/net/Buffer.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+
+#include "common/macros.h"
+
+#include "ikcp.h"
+#include "kcp_constants.h"
+#include "kcp_fec.h"
+#include "kcp_packets.h"
+#include "kcp_session.h"
+#include "tests/test_util.h"
+
+namespace {
+
+struct Shape {
+  int data_shards;
+  int parity_shards;
+};
+
+// the adaptive levels of KCPFecEncoder, from the least to the most redundant
+const Shape kShapes[] = {{10, 1}, {8, 2}, {6, 2}, {5, 3}, {4, 4}};
+
+const size_t kShardSize = kMaxPacketSize - KCPPublicHeader::kPublicHeaderLength -
+                          KCPFecHeader::kFecHeaderLength;
+const size_t kMaxDataLength = kShardSize - KCPFecHeader::kShardLengthSize;
+
+uint32_t g_random = 1;
+
+char NextByte() {
+  g_random = g_random * 1103515245 + 12345;
+  return static_cast<char>(g_random >> 16);
+}
+
+// one packet of the group, the sub header and the shard
+struct Packet {
+  std::vector<char> buf;
+  size_t length{0};
+};
+
+// the encoder begins the group after the next EncodeParity in the shape
+// of its level, a group of one data shard is flushed to get there
+void FlushShape(KCPFecEncoder* encoder) {
+  char buf[KCPFecHeader::kFecHeadRoom + 1] = {0};
+  encoder->AddDataShard(buf, 1);
+  encoder->EncodeParity();
+}
+
+// |num_data| data shards of random lengths, full sized ones among them, and
+// the parity shards of the shape
+std::vector<Packet> EncodeGroup(KCPFecEncoder* encoder, int num_data,
+                                int* num_parity) {
+  std::vector<Packet> packets;
+  for (int j = 0; j < num_data; ++j) {
+    size_t data_length = (j % 3 == 0)
+                             ? kMaxDataLength
+                             : 1 + static_cast<size_t>(g_random) %
+                                       kMaxDataLength;
+    Packet packet;
+    packet.buf.resize(KCPFecHeader::kFecHeadRoom + data_length);
+    for (size_t i = 0; i < data_length; ++i) {
+      packet.buf[KCPFecHeader::kFecHeadRoom + i] = NextByte();
+    }
+    packet.length = packet.buf.size();
+
+    bool complete = encoder->AddDataShard(packet.buf.data(), data_length);
+    CHECK(complete == (j + 1 == encoder->data_shards()));
+    packets.push_back(std::move(packet));
+  }
+
+  *num_parity = encoder->EncodeParity();
+  for (int i = 0; i < *num_parity; ++i) {
+    Packet packet;
+    packet.buf.resize(KCPFecHeader::kFecHeaderLength + kShardSize);
+    packet.length = encoder->WriteParityPacket(i, packet.buf.data());
+    packets.push_back(std::move(packet));
+  }
+  return packets;
+}
+
+// every pattern of up to |num_parity| shards lost, the data shards lost must
+// come back byte for byte
+void CheckErasures(const std::vector<Packet>& packets, int num_data,
+                   int num_parity) {
+  const int num_shards = num_data + num_parity;
+  for (uint32_t lost = 0; lost < (1u << num_shards); ++lost) {
+    if (__builtin_popcount(lost) > num_parity) {
+      continue;
+    }
+
+    std::vector<int> lost_data;
+    for (int j = 0; j < num_data; ++j) {
+      if (lost & (1u << j)) {
+        lost_data.push_back(j);
+      }
+    }
+
+    KCPFecDecoder decoder(kShardSize);
+    KCPFecDecoder::Shard recovered[kFecMaxDataShards];
+    int num_recovered = 0;
+    for (int index = 0; index < num_shards; ++index) {
+      if (lost & (1u << index)) {
+        continue;
+      }
+
+      const Packet& packet = packets[static_cast<size_t>(index)];
+      KCPFecHeader header;
+      CHECK(header.ReadFrom(packet.buf.data(), packet.length));
+      int n = decoder.AddShard(
+          header, packet.buf.data() + KCPFecHeader::kFecHeaderLength,
+          packet.length - KCPFecHeader::kFecHeaderLength, recovered);
+      if (n == 0) {
+        continue;
+      }
+
+      // all of them at once, in the order of their index
+      CHECK(num_recovered == 0);
+      num_recovered = n;
+      CHECK(static_cast<size_t>(n) == lost_data.size());
+      for (int r = 0; r < n; ++r) {
+        const Packet& original =
+            packets[static_cast<size_t>(lost_data[static_cast<size_t>(r)])];
+        size_t data_length = original.length - KCPFecHeader::kFecHeadRoom;
+        CHECK(recovered[r].length == data_length);
+        CHECK(memcmp(recovered[r].data,
+                     original.buf.data() + KCPFecHeader::kFecHeadRoom,
+                     data_length) == 0);
+      }
+    }
+
+    CHECK(static_cast<size_t>(num_recovered) == lost_data.size());
+  }
+}
+
+void TestErasuresOfEveryLevel() {
+  KCPFecEncoder encoder(kShardSize);
+  uint32_t delivered = 0;
+  uint32_t retransmits = 0;
+
+  // quiet windows take it down to the least redundant level
+  for (size_t i = 0; i < 4 * arraysize(kShapes); ++i) {
+    delivered += kFecAdaptWindow;
+    encoder.Adapt(delivered, retransmits);
+  }
+
+  for (size_t level = 0; level < arraysize(kShapes); ++level) {
+    FlushShape(&encoder);
+    CHECK(encoder.data_shards() == kShapes[level].data_shards);
+    CHECK(encoder.parity_shards() == kShapes[level].parity_shards);
+
+    // the full group and every partial one the session closes on its tick
+    for (int num_data = kShapes[level].data_shards; num_data > 0; --num_data) {
+      int num_parity = 0;
+      std::vector<Packet> packets =
+          EncodeGroup(&encoder, num_data, &num_parity);
+      CHECK(num_parity == kShapes[level].parity_shards);
+      CheckErasures(packets, num_data, num_parity);
+    }
+
+    // more than 2% retransmitted raises the level
+    delivered += kFecAdaptWindow;
+    retransmits += kFecAdaptWindow;
+    encoder.Adapt(delivered, retransmits);
+  }
+}
+
+// a sub header of a packet of no group and the data of ikcp after it
+struct Output {
+  KCPFecHeader header;
+  const char* data{nullptr};
+  long length{0};
+};
+
+Output ParseOutput(const std::string& packet) {
+  Output output;
+  CHECK(output.header.ReadFrom(packet.data(), packet.size()));
+  output.data = packet.data() + KCPFecHeader::kFecHeadRoom;
+  output.length =
+      static_cast<long>(packet.size() - KCPFecHeader::kFecHeadRoom);
+  return output;
+}
+
+// a bulk transfer between two sessions, the acks of the receiver must never
+// be taken into a group, the data must always be
+void TestAcksNotGrouped() {
+  muduo::net::EventLoop loop;
+  muduo::net::InetAddress address(9527, true);
+
+  KCPSession::Params params = kFastModeKCPParams;
+  params.fec = 1;
+
+  std::deque<std::string> to_receiver;
+  std::deque<std::string> to_sender;
+  auto sender = std::make_shared<KCPSession>(&loop);
+  auto receiver = std::make_shared<KCPSession>(&loop);
+  sender->set_output_callback(
+      [&to_receiver](void* data, size_t len, uint8_t, uint32_t,
+                     const muduo::net::InetAddress&) {
+        to_receiver.emplace_back(static_cast<const char*>(data), len);
+      });
+  receiver->set_output_callback(
+      [&to_sender](void* data, size_t len, uint8_t, uint32_t,
+                   const muduo::net::InetAddress&) {
+        to_sender.emplace_back(static_cast<const char*>(data), len);
+      });
+
+  size_t received = 0;
+  receiver->set_message_callback(
+      [&received](const KCPSessionPtr&, muduo::net::Buffer* buf) {
+        received += buf->readableBytes();
+        buf->retrieveAll();
+      });
+
+  CHECK(sender->Initialize(1, address, params));
+  CHECK(receiver->Initialize(1, address, params));
+
+  std::string data(64 * 1024, 'k');
+  sender->Write(data.data(), data.size());
+
+  int num_grouped = 0;
+  int num_acks = 0;
+  for (int round = 0; round < 16 && received < data.size(); ++round) {
+    while (!to_receiver.empty()) {
+      std::string packet = std::move(to_receiver.front());
+      to_receiver.pop_front();
+
+      Output output = ParseOutput(packet);
+      if (output.header.data_shards == 0) {
+        CHECK(!ikcp_packet_has_push(output.data, output.length));
+      } else if (output.header.shard_index < output.header.data_shards) {
+        CHECK(ikcp_packet_has_push(output.data, output.length));
+        ++num_grouped;
+      }
+      receiver->ProcessPacket(KCPReceivedPacket(packet.data(), packet.size()),
+                              address);
+    }
+
+    while (!to_sender.empty()) {
+      std::string packet = std::move(to_sender.front());
+      to_sender.pop_front();
+
+      Output output = ParseOutput(packet);
+      CHECK(output.header.data_shards == 0);
+      CHECK(!ikcp_packet_has_push(output.data, output.length));
+      ++num_acks;
+      sender->ProcessPacket(KCPReceivedPacket(packet.data(), packet.size()),
+                            address);
+    }
+  }
+
+  CHECK(received == data.size());
+  CHECK(num_grouped > 0);
+  CHECK(num_acks > 0);
+
+  sender->Close();
+  receiver->Close();
+}
+
+}  // namespace
+
+int main() {
+  printf("galois kernel: %s\n", KCPGaloisKernelName());
+
+  TestErasuresOfEveryLevel();
+  TestAcksNotGrouped();
+
+  printf("PASS\n");
+  return 0;
+}
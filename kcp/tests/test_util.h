@@ -0,0 +1,17 @@
+#ifndef KCP_TESTS_TEST_UTIL_H_
+#define KCP_TESTS_TEST_UTIL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// unlike ASSERT_EXIT a failure is the exit status, for ctest
+#define CHECK(x)                                                      \
+  do {                                                                \
+    if (!(x)) {                                                       \
+      fprintf(stderr, "%s:%d: check %s failed\n", __FILE__, __LINE__, \
+              #x);                                                    \
+      ::exit(1);                                                      \
+    }                                                                 \
+  } while (0)
+
+#endif
@@ -0,0 +1,136 @@
+
+#include <stdio.h>
+
+#include <muduo/base/Timestamp.h>
+
+#include "kcp_constants.h"
+#include "kcp_ticket.h"
+#include "tests/test_util.h"
+
+namespace {
+
+// later than the key the crypter makes at construction
+const int64_t kBaseSeconds = muduo::Timestamp::now().secondsSinceEpoch() + 1;
+
+muduo::Timestamp At(int64_t seconds) {
+  return muduo::Timestamp((kBaseSeconds + seconds) *
+                          muduo::Timestamp::kMicroSecondsPerSecond);
+}
+
+KCPTicket MakeTicket() {
+  KCPTicket ticket;
+  ticket.session_id = 0x01020304;
+  ticket.resume_session_id = 0xa0b0c0d0;
+  ticket.options = 0x5;
+  return ticket;
+}
+
+bool SameTicket(const KCPTicket& a, const KCPTicket& b) {
+  return a.session_id == b.session_id &&
+         a.resume_session_id == b.resume_session_id && a.options == b.options;
+}
+
+void TestRoundTrip() {
+  KCPTicketCrypter crypter;
+  char buf[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(0), buf, sizeof(buf)));
+
+  KCPTicket opened;
+  CHECK(crypter.Open(buf, sizeof(buf), At(1), false, &opened));
+  CHECK(SameTicket(opened, MakeTicket()));
+
+  // too short a buffer to seal into
+  CHECK(!crypter.Seal(MakeTicket(), At(0), buf, sizeof(buf) - 1));
+}
+
+void TestTamper() {
+  KCPTicketCrypter crypter;
+  char buf[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(0), buf, sizeof(buf)));
+
+  KCPTicket opened;
+  for (size_t i = 0; i < sizeof(buf); ++i) {
+    buf[i] = static_cast<char>(buf[i] ^ 0x1);
+    CHECK(!crypter.Open(buf, sizeof(buf), At(1), false, &opened));
+    buf[i] = static_cast<char>(buf[i] ^ 0x1);
+  }
+  CHECK(!crypter.Open(buf, sizeof(buf) - 1, At(1), false, &opened));
+
+  // a ticket of another server
+  KCPTicketCrypter other;
+  CHECK(!other.Open(buf, sizeof(buf), At(1), false, &opened));
+
+  CHECK(crypter.Open(buf, sizeof(buf), At(1), false, &opened));
+}
+
+void TestExpiry() {
+  KCPTicketCrypter crypter;
+  char buf[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(0), buf, sizeof(buf)));
+
+  KCPTicket opened;
+  CHECK(crypter.Open(buf, sizeof(buf), At(kTicketKeyRotationSeconds - 1),
+                     false, &opened));
+  CHECK(!crypter.Open(buf, sizeof(buf), At(kTicketKeyRotationSeconds + 1),
+                      false, &opened));
+}
+
+void TestReplay() {
+  KCPTicketCrypter crypter;
+  char buf[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(0), buf, sizeof(buf)));
+
+  KCPTicket opened;
+  CHECK(crypter.Open(buf, sizeof(buf), At(1), true, &opened));
+  CHECK(!crypter.Open(buf, sizeof(buf), At(2), true, &opened));
+  // only a resumption consumes, a peek at it does not
+  CHECK(crypter.Open(buf, sizeof(buf), At(2), false, &opened));
+
+  // another ticket of the same key is not taken for it
+  char other[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(0), other, sizeof(other)));
+  CHECK(crypter.Open(other, sizeof(other), At(2), true, &opened));
+}
+
+void TestRotation() {
+  KCPTicketCrypter crypter;
+  char before[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(0), before, sizeof(before)));
+
+  // rotated, the key before still opens its tickets
+  char after[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(kTicketKeyRotationSeconds), after,
+                     sizeof(after)));
+  CHECK(after[0] != before[0]);
+
+  KCPTicket opened;
+  CHECK(crypter.Open(before, sizeof(before), At(kTicketKeyRotationSeconds),
+                     true, &opened));
+  CHECK(SameTicket(opened, MakeTicket()));
+  // and keeps what it consumed
+  CHECK(!crypter.Open(before, sizeof(before), At(kTicketKeyRotationSeconds),
+                      true, &opened));
+
+  // rotated again, the key of |after| is the key before now
+  char last[KCPTicketCrypter::kTicketLength];
+  CHECK(crypter.Seal(MakeTicket(), At(2 * kTicketKeyRotationSeconds), last,
+                     sizeof(last)));
+  CHECK(last[0] != after[0]);
+  CHECK(crypter.Open(after, sizeof(after), At(2 * kTicketKeyRotationSeconds),
+                     false, &opened));
+  CHECK(crypter.Open(last, sizeof(last), At(2 * kTicketKeyRotationSeconds),
+                     false, &opened));
+}
+
+}  // namespace
+
+int main() {
+  TestRoundTrip();
+  TestTamper();
+  TestExpiry();
+  TestReplay();
+  TestRotation();
+
+  printf("PASS\n");
+  return 0;
+}
@@ -1,7 +1,11 @@
 
 #include "udp_socket.h"
 
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 #include <net/if.h>
+#include <netinet/udp.h>
 
 #include <muduo/base/Logging.h>
 #include <muduo/net/InetAddress.h>
@@ -191,6 +195,25 @@ void UDPSocket::Close() {
   socket_options_ = 0;
 }
 
+int UDPSocket::Duplicate(UDPSocket* socket) const {
+  assert(socket != nullptr);
+  assert(IsValidSocket());
+  assert(!socket->IsValidSocket());
+
+  int sockfd = ::fcntl(sockfd_, F_DUPFD_CLOEXEC, 0);
+  if (sockfd == kInvalidSocket) {
+    int last_error = errno;
+    LOG_SYSERR << "::fcntl";
+    return -last_error;
+  }
+
+  socket->sockfd_ = sockfd;
+  socket->addr_family_ = addr_family_;
+  socket->socket_options_ = socket_options_;
+
+  return 0;
+}
+
 void UDPSocket::AllowReuseAddress() {
   assert(!IsValidSocket());
 
@@ -221,6 +244,12 @@ void UDPSocket::AllowReceiveDSCPAndECN() {
   socket_options_ |= SOCKET_OPTION_RECEIVE_DSCP_AND_ECN;
 }
 
+void UDPSocket::AllowReceiveGRO() {
+  assert(!IsValidSocket());
+
+  socket_options_ |= SOCKET_OPTION_RECEIVE_GRO;
+}
+
 int UDPSocket::GetLocalAddress(muduo::net::InetAddress* address) {
   assert(address != nullptr);
 
@@ -366,6 +395,11 @@ int UDPSocket::SetSocketOptions() {
     }
   }
 
+  if (socket_options_ & SOCKET_OPTION_RECEIVE_GRO) {
+    ERROR_RETURN(::setsockopt(sockfd_, SOL_UDP, UDP_GRO, &true_value,
+                              sizeof(true_value)));
+  }
+
   return 0;
 }
 
@@ -395,6 +429,29 @@ int UDPSocket::SetSendBufferSize(int size) {
   return 0;
 }
 
+int UDPSocket::GetSegmentSize(int* segment_size) {
+  assert(segment_size != nullptr);
+  assert(IsValidSocket());
+
+  socklen_t len = sizeof(*segment_size);
+  ERROR_RETURN(
+      ::getsockopt(sockfd_, SOL_UDP, UDP_SEGMENT, segment_size, &len));
+
+  return 0;
+}
+
+int UDPSocket::EnableTxTime() {
+  assert(IsValidSocket());
+
+  struct sock_txtime txtime;
+  memset(&txtime, 0, sizeof(txtime));
+  txtime.clockid = CLOCK_MONOTONIC;
+  ERROR_RETURN(
+      ::setsockopt(sockfd_, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)));
+
+  return 0;
+}
+
 int UDPSocket::SetMulticastIF(unsigned int ifindex) {
   assert(IsValidSocket());
   assert(addr_family_ != AF_UNSPEC);
@@ -502,6 +559,25 @@ int UDPSocket::SetDSCPAndECN(uint8_t dscp_and_ecn) {
   return 0;
 }
 
+int UDPSocket::AttachReusePortFilter(const struct sock_filter* filter,
+                                     unsigned short len) {
+  assert(filter != nullptr);
+  assert(IsValidSocket());
+
+  if (!(socket_options_ & SOCKET_OPTION_REUSE_PORT)) {
+    return -EINVAL;
+  }
+
+  // the kernel copies the program, so it need not outlive the call
+  struct sock_fprog prog;
+  prog.len = len;
+  prog.filter = const_cast<struct sock_filter*>(filter);
+  ERROR_RETURN(::setsockopt(sockfd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                            &prog, sizeof(prog)));
+
+  return 0;
+}
+
 int UDPSocket::JoinMulticastGroup(const muduo::net::InetAddress& group_address,
                                   unsigned int ifindex) {
   return JoinOrLeaveMulticastGroup(group_address, ifindex, true);
@@ -717,6 +793,32 @@ int UDPSocket::RecvMsg(struct msghdr* msg, int flags) {
   return result;
 }
 
+bool UDPSocket::IsSameAddress(const muduo::net::InetAddress& address,
+                              const muduo::net::InetAddress& other,
+                              bool ip_only) {
+  if (address.family() != other.family()) {
+    return false;
+  }
+
+  if (address.family() == AF_INET) {
+    const struct sockaddr_in* addr =
+        reinterpret_cast<const struct sockaddr_in*>(address.getSockAddr());
+    const struct sockaddr_in* other_addr =
+        reinterpret_cast<const struct sockaddr_in*>(other.getSockAddr());
+    return addr->sin_addr.s_addr == other_addr->sin_addr.s_addr &&
+           (ip_only || addr->sin_port == other_addr->sin_port);
+  } else if (address.family() == AF_INET6) {
+    const struct sockaddr_in6* addr =
+        reinterpret_cast<const struct sockaddr_in6*>(address.getSockAddr());
+    const struct sockaddr_in6* other_addr =
+        reinterpret_cast<const struct sockaddr_in6*>(other.getSockAddr());
+    return IN6_ARE_ADDR_EQUAL(&addr->sin6_addr, &other_addr->sin6_addr) &&
+           (ip_only || addr->sin6_port == other_addr->sin6_port);
+  }
+
+  return false;
+}
+
 bool UDPSocket::IsAddressMulticast(const muduo::net::InetAddress& address) {
   if (address.family() == AF_INET) {
     const struct sockaddr_in* addr =
@@ -15,6 +15,8 @@ class InetAddress;
 };
 };  // namespace muduo
 
+struct sock_filter;
+
 struct SockaddrStorage {
   SockaddrStorage();
   SockaddrStorage(const SockaddrStorage& other);
@@ -48,15 +50,29 @@ class UDPSocket final {
   int Bind(const muduo::net::InetAddress& address);
   void Close();
 
+  // |socket| gets a new descriptor of the same socket (F_DUPFD_CLOEXEC)
+  int Duplicate(UDPSocket* socket) const;
+
   void AllowReuseAddress();
   void AllowReusePort();
   void AllowBroadcast();
   void AllowReceiveError();
   void AllowReceiveDSCPAndECN();
+  // UDP_GRO(since Linux 5.0), coalesced datagrams come with a UDP_GRO cmsg
+  // holding the segment size
+  void AllowReceiveGRO();
 
   int SetReceiveBufferSize(int size);
   int SetSendBufferSize(int size);
 
+  // UDP_SEGMENT(since Linux 4.18), fails if the kernel has no udp gso
+  int GetSegmentSize(int* segment_size);
+
+  // SO_TXTIME(since Linux 4.19), a datagram sent with a SCM_TXTIME cmsg
+  // leaves at that CLOCK_MONOTONIC time in ns, the spacing is done by the fq
+  // qdisc of the egress device
+  int EnableTxTime();
+
   // for sending mcast datagram
   int SetMulticastIF(unsigned int ifindex);
   int SetMulticastIF(const char* ifname);
@@ -65,6 +81,11 @@ class UDPSocket final {
 
   int SetDSCPAndECN(uint8_t dscp_and_ecn);
 
+  // SO_ATTACH_REUSEPORT_CBPF, the program returns the index of the socket in
+  // the reuse port group (in bind order), out of range means the default hash
+  int AttachReusePortFilter(const struct sock_filter* filter,
+                            unsigned short len);
+
   // for receiving mcast datagram
   int JoinMulticastGroup(const muduo::net::InetAddress& group_address,
                          const char* ifname);
@@ -96,6 +117,10 @@ class UDPSocket final {
   int SendMmsg(struct mmsghdr* msgvec, unsigned int vlen, int flags = 0);
 
   static bool IsAddressMulticast(const muduo::net::InetAddress& address);
+  // the ports too unless |ip_only|
+  static bool IsSameAddress(const muduo::net::InetAddress& address,
+                            const muduo::net::InetAddress& other,
+                            bool ip_only = false);
 
  private:
   enum SocketOptions : uint8_t {
@@ -107,6 +132,9 @@ class UDPSocket final {
     // IPPROTO_IP/IPV6
     SOCKET_OPTION_RECEIVE_ERROR = 1 << 3,
     SOCKET_OPTION_RECEIVE_DSCP_AND_ECN = 1 << 4,
+
+    // SOL_UDP
+    SOCKET_OPTION_RECEIVE_GRO = 1 << 5,
   };
 
   int CreateSocket(int addr_family);